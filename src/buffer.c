@@ -535,6 +535,7 @@ free_buffer_stuff (
   map_clear_int(buf, MAP_ALL_MODES, TRUE, TRUE);     /* clear local abbrevs */
   vim_free(buf->b_start_fenc);
   buf->b_start_fenc = NULL;
+  hlcache_clear(&buf->b_hlcache);
 }
 
 /*
@@ -73,6 +73,7 @@ buf_init_chartab (
   int tilde;
   int do_isalpha;
 
+  ++chartab_tick;
   if (global) {
     /*
      * Set the default size for printable characters:
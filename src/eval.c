@@ -606,6 +606,7 @@ static void f_matchend __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_matchlist __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_matchstr __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_max __ARGS((typval_T *argvars, typval_T *rettv));
+static void f_memfilestats __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_min __ARGS((typval_T *argvars, typval_T *rettv));
 #ifdef vim_mkdir
 static void f_mkdir __ARGS((typval_T *argvars, typval_T *rettv));
@@ -697,6 +698,7 @@ static void f_taglist __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_tagfiles __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_tempname __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_test __ARGS((typval_T *argvars, typval_T *rettv));
+static void f_test_override __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_tan __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_tanh __ARGS((typval_T *argvars, typval_T *rettv));
 static void f_tolower __ARGS((typval_T *argvars, typval_T *rettv));
@@ -6916,6 +6918,7 @@ static struct fst {
   {"matchlist",       2, 4, f_matchlist},
   {"matchstr",        2, 4, f_matchstr},
   {"max",             1, 1, f_max},
+  {"memfilestats",    0, 1, f_memfilestats},
   {"min",             1, 1, f_min},
 #ifdef vim_mkdir
   {"mkdir",           1, 3, f_mkdir},
@@ -7009,6 +7012,7 @@ static struct fst {
   {"tanh",            1, 1, f_tanh},
   {"tempname",        0, 0, f_tempname},
   {"test",            1, 1, f_test},
+  {"test_override",   2, 2, f_test_override},
   {"tolower",         1, 1, f_tolower},
   {"toupper",         1, 1, f_toupper},
   {"tr",              3, 3, f_tr},
@@ -11586,6 +11590,39 @@ static void f_max(typval_T *argvars, typval_T *rettv)
   max_min(argvars, rettv, TRUE);
 }
 
+/*
+ * "memfilestats()" function
+ */
+static void f_memfilestats(typval_T *argvars, typval_T *rettv)
+{
+  memfile_T   *mfp = NULL;
+  buf_T       *buf;
+  mfstats_T stats;
+  long_u memused;
+  dict_T      *dict;
+
+  if (rettv_dict_alloc(rettv) == FAIL)
+    return;
+  if (argvars[0].v_type != VAR_UNKNOWN) {
+    (void)get_tv_number(&argvars[0]);       /* issue errmsg if type error */
+    ++emsg_off;
+    buf = get_buf_tv(&argvars[0], FALSE);
+    --emsg_off;
+    if (buf == NULL || buf->b_ml.ml_mfp == NULL)
+      return;
+    mfp = buf->b_ml.ml_mfp;
+  }
+
+  memused = mf_get_stats(mfp, &stats);
+  dict = rettv->vval.v_dict;
+  dict_add_nr_str(dict, "hits", (long)stats.mst_hits, NULL);
+  dict_add_nr_str(dict, "misses", (long)stats.mst_misses, NULL);
+  dict_add_nr_str(dict, "evictions", (long)stats.mst_evictions, NULL);
+  dict_add_nr_str(dict, "written", (long)stats.mst_written, NULL);
+  dict_add_nr_str(dict, "writes", (long)stats.mst_writes, NULL);
+  dict_add_nr_str(dict, "memused", (long)memused, NULL);
+}
+
 /*
  * "min()" function
  */
@@ -14708,6 +14745,28 @@ static void f_test(typval_T *argvars, typval_T *rettv)
   /* Used for unit testing.  Change the code below to your liking. */
 }
 
+/*
+ * "test_override(name, val)" function: make something fail for testing.
+ * "swapflush": flushing a swap file to disk fails.
+ * "ALL": reset everything.
+ */
+static void f_test_override(typval_T *argvars, typval_T *rettv)
+{
+  char_u      *name;
+  int val;
+
+  name = get_tv_string_chk(&argvars[0]);
+  val = get_tv_number(&argvars[1]);
+  if (name == NULL)
+    return;
+  if (STRCMP(name, "swapflush") == 0)
+    fail_swapflush_for_testing = val;
+  else if (STRCMP(name, "ALL") == 0)
+    fail_swapflush_for_testing = FALSE;
+  else
+    EMSG2(_(e_invarg2), name);
+}
+
 /*
  * "tan()" function
  */
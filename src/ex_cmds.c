@@ -3701,7 +3701,7 @@ void do_sub(exarg_T *eap)
                                              || aborting()
                                              ); ++lnum) {
     nmatch = vim_regexec_multi(&regmatch, curwin, curbuf, lnum,
-        (colnr_T)0, NULL);
+        (colnr_T)0, NULL, NULL);
     if (nmatch) {
       colnr_T copycol;
       colnr_T matchcol;
@@ -4224,7 +4224,7 @@ skip:
             || nmatch_tl > 0
             || (nmatch = vim_regexec_multi(&regmatch, curwin,
                     curbuf, sub_firstlnum,
-                    matchcol, NULL)) == 0
+                    matchcol, NULL, NULL)) == 0
             || regmatch.startpos[0].lnum > 0) {
           if (new_start != NULL) {
             /*
@@ -4285,7 +4285,7 @@ skip:
           }
           if (nmatch == -1 && !lastone)
             nmatch = vim_regexec_multi(&regmatch, curwin, curbuf,
-                sub_firstlnum, matchcol, NULL);
+                sub_firstlnum, matchcol, NULL, NULL);
 
           /*
            * 5. break if there isn't another match in this line
@@ -4439,6 +4439,9 @@ void ex_global(exarg_T *eap)
   regmmatch_T regmatch;
   int match;
   int which_pat;
+  char_u      *must;
+  int mustlen;
+  int mustic;
 
   if (global_busy) {
     EMSG(_("E147: Cannot do :global recursive"));       /* will increment global_busy */
@@ -4490,13 +4493,25 @@ void ex_global(exarg_T *eap)
     return;
   }
 
+  /* Text that must be in a line for a match to start there. */
+  mustic = regmatch.rmm_ic;
+  must = vim_regmust(regmatch.regprog, &mustic, &mustlen);
+
   /*
    * pass 1: set marks for each (not) matching line
    */
   for (lnum = eap->line1; lnum <= eap->line2 && !got_int; ++lnum) {
+    /* For ":g" skip lines that can't match, looking at the memline blocks
+     * instead of trying to match each line. */
+    if (must != NULL && type == 'g') {
+      lnum = ml_find_text(curbuf, lnum, eap->line2, FORWARD, must, mustlen,
+          mustic);
+      if (lnum == 0)
+        break;
+    }
     /* a match on this line? */
     match = vim_regexec_multi(&regmatch, curwin, curbuf, lnum,
-        (colnr_T)0, NULL);
+        (colnr_T)0, NULL, NULL);
     if ((type == 'g' && match) || (type == 'v' && !match)) {
       ml_setmarked(lnum);
       ndone++;
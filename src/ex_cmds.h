@@ -769,6 +769,8 @@ enum CMD_index
       BANG|TRLBAR|CMDWIN),
   EX(CMD_registers,       "registers",    ex_display,
       EXTRA|NOTRLCOM|TRLBAR|CMDWIN),
+  EX(CMD_regexpcache,     "regexpcache",  ex_regexpcache,
+      BANG|TRLBAR|CMDWIN),
   EX(CMD_resize,          "resize",       ex_resize,
       RANGE|NOTADR|TRLBAR|WORD1),
   EX(CMD_retab,           "retab",        ex_retab,
@@ -3419,6 +3419,10 @@ void ex_language(exarg_T *eap)
       /* Reset $LC_ALL, otherwise it would overrule everything. */
       vim_setenv((char_u *)"LC_ALL", (char_u *)"");
 
+      /* isalpha(), tolower() etc. may give different results now. */
+      if (what == LC_ALL || what == LC_CTYPE)
+        ++chartab_tick;
+
       if (what != LC_TIME) {
         /* Tell gettext() what to translate to.  It apparently doesn't
          * use the currently effective locale.  Also do this when
@@ -1506,6 +1506,8 @@ void                *cookie;                    /* argument for fgetline() */
     if (lnum == MAXLNUM) {
       if (*ea.cmd == '%') {                 /* '%' - all lines */
         ++ea.cmd;
+        if (!ea.skip)
+          readfile_bg_wait(curbuf);
         ea.line1 = 1;
         ea.line2 = curbuf->b_ml.ml_line_count;
         ++ea.addr_count;
@@ -1583,6 +1585,8 @@ void                *cookie;                    /* argument for fgetline() */
         ex_print(&ea);
       }
     } else if (ea.addr_count != 0)   {
+      if (ea.line2 > curbuf->b_ml.ml_line_count)
+        readfile_bg_wait(curbuf);
       if (ea.line2 > curbuf->b_ml.ml_line_count) {
         /* With '-' in 'cpoptions' a line number past the file is an
          * error, otherwise put it at the end of the file. */
@@ -1840,6 +1844,8 @@ void                *cookie;                    /* argument for fgetline() */
   }
 
   if ((ea.argt & DFLALL) && ea.addr_count == 0) {
+    if (!ea.skip)
+      readfile_bg_wait(curbuf);
     ea.line1 = 1;
     ea.line2 = curbuf->b_ml.ml_line_count;
   }
@@ -3270,6 +3276,8 @@ get_address (
 
     case '$':                               /* '$' - last line */
       ++cmd;
+      if (!skip)
+        readfile_bg_wait(curbuf);
       lnum = curbuf->b_ml.ml_line_count;
       break;
 
@@ -3459,6 +3467,10 @@ static void ex_script_ni(exarg_T *eap)
  */
 static char_u *invalid_range(exarg_T *eap)
 {
+  /* Lines past the end may still be loaded. */
+  if ((eap->argt & RANGE) && !(eap->argt & NOTADR)
+      && eap->line2 > curbuf->b_ml.ml_line_count)
+    readfile_bg_wait(curbuf);
   if (       eap->line1 < 0
              || eap->line2 < 0
              || eap->line1 > eap->line2
@@ -6678,12 +6690,18 @@ static void ex_sleep(exarg_T *eap)
 void do_sleep(long msec)
 {
   long done;
+  long step;
 
   cursor_on();
   out_flush();
-  for (done = 0; !got_int && done < msec; done += 1000L) {
-    ui_delay(msec - done > 1000L ? 1000L : msec - done, TRUE);
+  for (done = 0; !got_int && done < msec; done += step) {
+    /* Keep adding the lines of files loaded in the background. */
+    step = readfile_bg_busy() ? BGLOAD_WAIT : 1000L;
+    if (step > msec - done)
+      step = msec - done;
+    ui_delay(step, TRUE);
     ui_breakcheck();
+    readfile_bg_poll();
   }
 }
 
@@ -12,14 +12,99 @@
  */
 
 #include "vim.h"
+#include "os/os.h"
 
 
 #if defined(HAVE_UTIME) && defined(HAVE_UTIME_H)
 # include <utime.h>             /* for struct utimbuf */
 #endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>          /* for mmap() */
+# include <uv.h>                /* for uv_thread_create() */
+#endif
 
 #define BUFSIZE         8192    /* size of normal write buffer */
 #define SMBUFSIZE       256     /* size of emergency write buffer */
+#define BIGBUFSIZE      0x100000 /* max size of growing write buffer */
+
+#ifdef HAVE_SYS_MMAN_H
+# define MMAP_MIN_SIZE  0x100000L       /* mmap() files at least this big */
+# define MMAP_DROP_SIZE 0x400000L       /* drop pages after this many bytes */
+
+# define MAPSEG_SIZE    0x10000L        /* nr of mapped bytes in a segment */
+# define MAPSEG_MAX     16              /* max nr of segments being decoded */
+# define MAPSCAN_THREADS 4              /* max nr of decoding threads */
+
+/*
+ * A segment of a mapped file, decoded by one of the threads used by
+ * readfile().
+ */
+typedef struct {
+  char_u      *sg_text;         /* text in 'encoding', NULs replaced by NLs */
+  char_u      *sg_alloc;        /* allocated text or NULL */
+  long sg_len;                  /* length of sg_text */
+  char_u      *sg_guess;        /* text with NULs to guess the fileformat
+                                   from or NULL to use sg_text */
+  long sg_guess_len;            /* length to guess the fileformat from */
+  int         *sg_ends;         /* offsets of the line ends in sg_text */
+  int sg_count;                 /* nr of offsets in sg_ends[] */
+  int sg_bad;                   /* TRUE when an illegal byte was found */
+  int sg_nocr;                  /* TRUE when a NL without a CR before it was
+                                   found */
+  char_u      *sg_map_end;      /* end of the segment in the mapping */
+} mapseg_T;
+
+typedef struct {
+  char_u      *ms_start;        /* start of the mapped text */
+  char_u      *ms_end;          /* end of the mapped text */
+  int ms_fio_flags;             /* FIO_ flags for decoding */
+  int ms_check_utf8;            /* check for illegal UTF-8 */
+  int ms_copy;                  /* copy text that needs no conversion */
+  long ms_guess_len;            /* nr of bytes to guess fileformat from */
+  int ms_nthreads;              /* nr of threads started */
+  uv_thread_t ms_threads[MAPSCAN_THREADS];
+  uv_mutex_t ms_mutex;          /* protects the items below */
+  uv_cond_t ms_cond;            /* signalled when the items below change */
+  char_u      *ms_next;         /* start of the next segment to decode */
+  long ms_next_nr;              /* number of that segment */
+  long ms_get_nr;               /* segment mapscan_get() returns next */
+  mapseg_T    *ms_done[MAPSEG_MAX];     /* decoded segments, by number */
+  int ms_cancel;                /* threads must stop */
+  int ms_fault;                 /* a thread got a SIGBUS */
+  int ms_thread_nr;             /* nr of threads that got their number */
+} mapscan_T;
+
+/*
+ * A file that readfile() loads in the background: the threads of "bg_ms"
+ * keep finding the line ends while the buffer is being used and
+ * readfile_bg_poll() adds the lines to the buffer while waiting for a key.
+ */
+struct bgload_S {
+  bgload_T    *bg_next;         /* next one in bgload_list */
+  buf_T       *bg_buf;          /* buffer being loaded */
+  mlmap_T     *bg_mm;           /* mapped file of bg_buf, NULL when all lines
+                                   were added */
+  mapscan_T bg_ms;              /* threads finding the line ends */
+  garray_T bg_index;            /* entries of mm_index[] of bg_mm */
+  char_u      *bg_drop_start;   /* pages before this were dropped */
+  size_t bg_line_off;           /* where the next line starts */
+  off_t bg_size;                /* nr of bytes in the lines added */
+  int bg_fd;                    /* file to check the size of or -1 */
+  int bg_dos;                   /* reading in Dos format */
+  int bg_bad;                   /* found something that only the read()
+                                   loop handles */
+  int bg_done;                  /* all lines added, BufLoadPost is still to
+                                   be triggered */
+};
+
+# define BGLOAD_TIME    20L     /* msec to spend adding lines at a time */
+
+static bgload_T *bgload_list = NULL;    /* files loaded in the background */
+
+# if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
+#endif
 
 /* crypt_magic[0] is pkzip crypt, crypt_magic[1] is sha2+blowfish */
 static char     *crypt_magic[] = {"VimCrypt~01!", "VimCrypt~02!"};
@@ -37,6 +122,35 @@ static int crypt_seed_len[] = {0, 8};
 #define USE_MCH_ACCESS
 
 static char_u *next_fenc __ARGS((char_u **pp));
+static int readfile_guess_ff __ARGS((char_u *ptr, long size, int try_dos,
+                                     int try_unix, int try_mac));
+#ifdef HAVE_SYS_MMAN_H
+static char_u *readfile_map __ARGS((int fd, size_t *lenp));
+static int readfile_map_copy __ARGS((char_u *to, char_u *from, size_t len));
+static int readfile_map_truncated __ARGS((int fd, size_t len));
+static int mapscan_start __ARGS((mapscan_T *ms, char_u *start, char_u *end,
+                                 int fio_flags, int check_utf8, int copy,
+                                 long guess_len));
+static void mapscan_thread __ARGS((void *arg));
+static char_u *mapscan_seg_end __ARGS((mapscan_T *ms, char_u *start));
+static int mapscan_decode __ARGS((mapscan_T *ms, mapseg_T *sg, char_u *start,
+                                  char_u *end));
+static int mapscan_add_end __ARGS((mapseg_T *sg, long off, int *sizep));
+static int mapscan_keep_guess __ARGS((mapseg_T *sg, char_u *text));
+static mapseg_T *mapscan_get __ARGS((mapscan_T *ms));
+static int mapscan_ready __ARGS((mapscan_T *ms));
+static void mapseg_free __ARGS((mapseg_T *sg));
+static void mapscan_stop __ARGS((mapscan_T *ms));
+static int bgload_can_update __ARGS((void));
+static void bgload_add __ARGS((bgload_T *bg, int wait));
+static int bgload_add_line __ARGS((bgload_T *bg));
+static void bgload_end __ARGS((bgload_T *bg));
+static void bgload_rest __ARGS((bgload_T *bg));
+static void bgload_detach __ARGS((bgload_T *bg));
+static void bgload_reread __ARGS((bgload_T *bg));
+static void bgload_finished __ARGS((bgload_T *bg));
+static void bgload_free __ARGS((bgload_T *bg));
+#endif
 static char_u *readfile_charconvert __ARGS((char_u *fname, char_u *fenc,
                                             int *fdp));
 static void check_marks_read __ARGS((void));
@@ -106,6 +220,8 @@ struct bw_info {
 };
 
 static int buf_write_bytes __ARGS((struct bw_info *ip));
+static void buf_write_grow __ARGS((struct bw_info *ip, char_u **bufferp,
+                                   int *bufsizep));
 
 static linenr_T readfile_linenr __ARGS((linenr_T linecnt, char_u *p,
                                         char_u *endp));
@@ -269,6 +385,12 @@ readfile (
   char_u      *old_b_fname;
   int using_b_ffname;
   int using_b_fname;
+#ifdef HAVE_SYS_MMAN_H
+  char_u      *map;                     /* file mapped into memory */
+  size_t map_len;
+#endif
+  int map_kept = FALSE;                 /* buffer uses the mapping */
+  int map_async = FALSE;                /* lines are added in the background */
 
   curbuf->b_no_eol_lnum = 0;    /* in case it was set by the previous read */
 
@@ -954,7 +1076,406 @@ retry:
       sha256_start(&sha_ctx);
   }
 
-  while (!error && !got_int) {
+#ifdef HAVE_SYS_MMAN_H
+  /*
+   * A big file is mapped into memory.  Segments of the mapping are converted
+   * to 'encoding' and split into lines by other threads, while this thread
+   * appends the lines to the buffer in order.  Pages are dropped again once
+   * their lines have been stored, thus memory use doesn't grow with the file
+   * size.
+   * When editing a file that needs no conversion the lines are not copied
+   * at all: only where every MLMAP_STEP'th line starts is remembered and the
+   * buffer keeps using the mapping until it is changed, see ml_unmap().
+   * Only Latin1 and Unicode conversion to UTF-8 is done this way.
+   * Anything unusual (encryption, an illegal byte, Mac line endings, the
+   * file being truncated) falls back to the read() loop below, which then
+   * starts at the beginning of the file.
+   * This is also done when the start of the file was already read to check
+   * for a BOM, the text after the BOM is used then.
+   * With 'asyncload' set and the mapping kept only the lines for the first
+   * screen are found before returning, the threads go on and
+   * readfile_bg_poll() adds the other lines while waiting for a key.
+   */
+  if ((!skip_read || (linerest == 0 && lnum == from))
+      && !read_stdin && !read_buffer
+      && (fio_flags == 0
+          || (enc_utf8
+              && ((fio_flags & ~FIO_ENDIAN_L) == FIO_UCS2
+                  || (fio_flags & ~FIO_ENDIAN_L) == FIO_UTF16
+                  || (fio_flags & ~FIO_ENDIAN_L) == FIO_UCS4
+                  || fio_flags == FIO_LATIN1)))
+# ifdef USE_ICONV
+      && iconv_fd == (iconv_t)-1
+# endif
+      && cryptkey == NULL && *curbuf->b_p_key == NUL
+      && (map = readfile_map(fd, &map_len)) != NULL) {
+    char_u      *map_end = map + map_len;
+    char_u      *map_start;               /* start of the text */
+    char_u      *drop_start = map;
+    char_u      *seg_end;                 /* end of segment in mapping */
+    char_u      *line;
+    char_u head[16];                      /* start of the file */
+    mapscan_T map_ms;
+    mapscan_T   *ms = &map_ms;
+    mapseg_T    *sg;
+    garray_T carry;                       /* line continued in next segment */
+    garray_T map_index;                   /* where every MLMAP_STEP'th line
+                                             starts when keeping the map */
+    mlmap_T     *mm = NULL;
+    bgload_T    *bg = NULL;               /* for loading in the background */
+    struct stat map_st;
+    size_t line_off = 0;                  /* where the next line starts */
+    size_t seg_off;
+    long guess_len;
+    long text_len = 0;                    /* nr of bytes after conversion */
+    int map_ok = TRUE;
+    int map_restart = FALSE;
+    int map_keep;
+    int map_noeol = FALSE;                /* last line has no NL */
+    int blen = 0;
+    int first;
+    int i;
+
+    ga_init2(&carry, 1, 4096);
+    ga_init2(&map_index, (int)sizeof(size_t), 1024);
+    ms->ms_nthreads = 0;
+    if (skip_read) {
+      /* A BOM was already removed, the bytes read so far are used to guess
+       * the fileformat. */
+      map_start = map + filesize;
+      guess_len = size;
+    } else {
+      map_start = map;
+      guess_len = 0x10000L;
+      if (fio_flags & FIO_LATIN1)
+        guess_len = guess_len / 2;
+      else if (fio_flags & (FIO_UCS2 | FIO_UTF16))
+        guess_len = (guess_len * 2 / 3) & ~1;
+      else if (fio_flags & FIO_UCS4)
+        guess_len = (guess_len * 2 / 3) & ~3;
+      if (readfile_map_copy(head, map, sizeof(head)) == FAIL
+          || memcmp(head, crypt_magic_head, STRLEN(crypt_magic_head)) == 0)
+        map_ok = FALSE;
+      else if (!curbuf->b_p_bomb && !curbuf->b_p_bin && tmpname == NULL
+               && (*fenc == 'u' || (*fenc == NUL && enc_utf8))
+               && check_for_bom(head, (long)sizeof(head), &i,
+                   get_fio_flags(fenc)) != NULL) {
+        /* Skip the BOM, like the read() loop does. */
+        blen = i;
+        map_start += blen;
+        guess_len -= blen;
+      }
+    }
+    if (map_start >= map_end)
+      map_ok = FALSE;
+    line_off = (size_t)(map_start - map);
+
+    /* Keep the mapping when editing a file that needs no conversion. */
+    map_keep = newfile && wasempty && fio_flags == 0 && !filtering
+               && !read_undo_file && !recoverymode
+               && lines_to_skip == 0 && lines_to_read == MAXLNUM
+               && curbuf->b_ml.ml_map == NULL
+               && curbuf->b_ml.ml_line_count == 1;
+
+    /* Load the rest of the file in the background when it is edited
+     * interactively. */
+    if (map_keep && p_asl && !(flags & (READ_DUMMY | READ_NOBG))
+        && !silent_mode && !exmode_active
+        && (bg = (bgload_T *)alloc_clear((unsigned)sizeof(bgload_T))) != NULL)
+      ms = &bg->bg_ms;
+
+    if (map_ok && mapscan_start(ms, map_start, map_end, fio_flags,
+            enc_utf8 && !curbuf->b_p_bin && fio_flags == 0, !map_keep,
+            guess_len) == FAIL)
+      map_ok = FALSE;
+    first = TRUE;
+    while (map_ok && !error && !got_int && (sg = mapscan_get(ms)) != NULL) {
+      if (sg->sg_bad) {
+        /* An illegal byte, out of memory or the file was truncated: let the
+         * read() loop handle it. */
+        mapseg_free(sg);
+        map_ok = FALSE;
+        break;
+      }
+      if (first) {
+        first = FALSE;
+        if (fileformat == EOL_UNKNOWN) {
+          int map_ff = readfile_guess_ff(
+              sg->sg_guess != NULL ? sg->sg_guess : sg->sg_text,
+              sg->sg_guess_len,
+              try_dos, try_unix, try_mac);
+
+          if (map_ff == EOL_MAC) {
+            mapseg_free(sg);
+            map_ok = FALSE;
+            break;
+          }
+          fileformat = map_ff;
+          if (set_options)
+            set_fileformat(fileformat, OPT_LOCAL);
+        }
+      }
+      text_len += sg->sg_len;
+
+      if (map_keep) {
+        /* Only remember where the lines start. */
+        if (fileformat == EOL_DOS && sg->sg_nocr && ff_error != EOL_DOS) {
+          /* Reading in Dos format, but no CR-LF found!  Start all over
+           * again in Unix format if 'fileformats' allows it. */
+          if (try_unix)
+            map_restart = TRUE;
+          else
+            ff_error = EOL_DOS;
+        }
+        seg_off = (size_t)(sg->sg_map_end - map) - (size_t)sg->sg_len;
+        for (i = 0; !map_restart && i < sg->sg_count; ++i) {
+          if ((lnum - from) % MLMAP_STEP == 0) {
+            if (ga_grow(&map_index, 1) == FAIL) {
+              error = TRUE;
+              break;
+            }
+            ((size_t *)map_index.ga_data)[map_index.ga_len++] = line_off;
+          }
+          ++lnum;
+          line_off = seg_off + (size_t)sg->sg_ends[i] + 1;
+        }
+      } else {
+        line = sg->sg_text;
+        for (i = 0; i < sg->sg_count; ++i) {
+          char_u  *line_end = sg->sg_text + sg->sg_ends[i];
+
+          if (skip_count == 0) {
+            /* Join with the start of the line from the previous segment. */
+            if (carry.ga_len > 0) {
+              if (ga_grow(&carry, (int)(line_end - line)) == FAIL) {
+                error = TRUE;
+                break;
+              }
+              mch_memmove((char_u *)carry.ga_data + carry.ga_len, line,
+                  (size_t)(line_end - line));
+              carry.ga_len += (int)(line_end - line);
+              line = carry.ga_data;
+              line_end = line + carry.ga_len;
+            }
+            len = (colnr_T)(line_end - line);
+            if (fileformat == EOL_DOS) {
+              if (len > 0 && line[len - 1] == CAR)
+                --len;                  /* remove CR */
+              else if (ff_error != EOL_DOS) {
+                /* Reading in Dos format, but no CR-LF found!  Start all
+                 * over again in Unix format if 'fileformats' allows it. */
+                if (try_unix) {
+                  map_restart = TRUE;
+                  break;
+                }
+                ff_error = EOL_DOS;
+              }
+            }
+            ++len;                      /* NUL is added by ml_append() */
+            if (ml_append(lnum, line, len, newfile) == FAIL) {
+              error = TRUE;
+              break;
+            }
+            if (read_undo_file) {
+              sha256_update(&sha_ctx, line, len - 1);
+              sha256_update(&sha_ctx, (char_u *)"", 1);
+            }
+            ++lnum;
+            if (--read_count == 0) {
+              error = TRUE;             /* break loop */
+              break;
+            }
+          } else
+            --skip_count;
+          carry.ga_len = 0;
+          line = sg->sg_text + sg->sg_ends[i] + 1;
+        }
+
+        /* Keep the start of a line that continues in the next segment. */
+        if (!error && !map_restart && line < sg->sg_text + sg->sg_len) {
+          int n = (int)(sg->sg_text + sg->sg_len - line);
+
+          if (ga_grow(&carry, n) == FAIL)
+            error = TRUE;
+          else {
+            mch_memmove((char_u *)carry.ga_data + carry.ga_len, line,
+                (size_t)n);
+            carry.ga_len += n;
+          }
+        }
+      }
+      seg_end = sg->sg_map_end;
+      mapseg_free(sg);
+
+      if (map_restart) {
+        mapscan_stop(ms);
+        if (map_keep)
+          lnum = from;
+        while (lnum > from)
+          ml_delete(lnum--, FALSE);
+        skip_count = lines_to_skip;
+        read_count = lines_to_read;
+        if (read_undo_file)
+          sha256_start(&sha_ctx);
+        fileformat = EOL_UNIX;
+        if (set_options)
+          set_fileformat(EOL_UNIX, OPT_LOCAL);
+        carry.ga_len = 0;
+        map_index.ga_len = 0;
+        line_off = (size_t)(map_start - map);
+        text_len = 0;
+        drop_start = map;
+        map_restart = FALSE;
+        if (mapscan_start(ms, map_start, map_end, fio_flags,
+                enc_utf8 && !curbuf->b_p_bin && fio_flags == 0, !map_keep,
+                guess_len) == FAIL)
+          map_ok = FALSE;
+        continue;
+      }
+
+      /* Drop the pages that have been used. */
+      if (seg_end - drop_start >= MMAP_DROP_SIZE) {
+        size_t n = (size_t)(seg_end - drop_start) & ~(size_t)0xffff;
+
+# ifdef MADV_DONTNEED
+        (void)madvise(drop_start, n, MADV_DONTNEED);
+# endif
+        drop_start += n;
+        ui_breakcheck();
+      }
+
+      /* The first screen can be shown now, leave the other lines to the
+       * threads. */
+      if (bg != NULL && !error && lnum - from > Rows && seg_end < map_end) {
+        map_async = TRUE;
+        break;
+      }
+    }
+    if (!map_async)
+      mapscan_stop(ms);
+
+    /* When the file was truncated while scanning it the text isn't right,
+     * read it again. */
+    if (map_ok && !map_async && readfile_map_truncated(fd, map_len))
+      map_ok = FALSE;
+
+    if (map_ok && map_keep && !map_async && !error && !got_int
+        && line_off < map_len) {
+      /* The last line has no NL.  In Dos format ignore a trailing CTRL-Z,
+       * unless 'binary' set. */
+      if (readfile_map_copy(head, map + line_off, (size_t)1) == FAIL)
+        map_ok = FALSE;
+      else if (curbuf->b_p_bin || fileformat != EOL_DOS
+               || map_len - line_off != 1 || head[0] != Ctrl_Z) {
+        if ((lnum - from) % MLMAP_STEP == 0) {
+          if (ga_grow(&map_index, 1) == FAIL)
+            error = TRUE;
+          else
+            ((size_t *)map_index.ga_data)[map_index.ga_len++] = line_off;
+        }
+        ++lnum;
+        map_noeol = TRUE;
+      }
+    }
+    if (map_ok && map_keep) {
+      if (!error && lnum > from && fstat(fd, &map_st) == 0)
+        mm = (mlmap_T *)alloc_clear((unsigned)sizeof(mlmap_T));
+      if (mm == NULL) {
+        /* Out of memory, try the read() loop. */
+        if (map_async) {
+          mapscan_stop(ms);
+          map_async = FALSE;
+        }
+        error = FALSE;
+        map_ok = FALSE;
+      }
+    }
+
+    if (map_ok) {
+      /* Count the number of characters after conversion, like the read()
+       * loop does. */
+      filesize += (off_t)(blen + text_len);
+      if (blen > 0 && set_options) {
+        curbuf->b_p_bomb = TRUE;
+        curbuf->b_start_bomb = TRUE;
+      }
+      linerest = 0;
+      if (map_keep) {
+        mm->mm_start = map;
+        mm->mm_len = map_len;
+        mm->mm_end = map_async ? line_off : map_len;
+        mm->mm_dev = map_st.st_dev;
+        mm->mm_ino = map_st.st_ino;
+        mm->mm_index = (size_t *)map_index.ga_data;
+        if (map_async) {
+          /* The threads go on, mm_index[] grows while they find lines. */
+          bg->bg_buf = curbuf;
+          bg->bg_mm = mm;
+          bg->bg_index = map_index;
+          bg->bg_drop_start = drop_start;
+          bg->bg_line_off = line_off;
+          bg->bg_size = (off_t)(blen + text_len);
+          bg->bg_fd = dup(fd);
+          bg->bg_dos = (fileformat == EOL_DOS);
+          mm->mm_load = bg;
+          bg->bg_next = bgload_list;
+          bgload_list = bg;
+          bg = NULL;
+        }
+        ga_init(&map_index);
+        mm->mm_dos = (fileformat == EOL_DOS);
+        mm->mm_eol = !map_noeol;
+        ml_map_attach(curbuf, mm, lnum - from);
+        map = NULL;                     /* now owned by the buffer */
+        map_kept = TRUE;
+        if (map_noeol) {
+          /* remember for when writing */
+          if (set_options)
+            curbuf->b_p_eol = FALSE;
+          read_no_eol_lnum = lnum;
+        }
+      } else if (!error && !got_int && carry.ga_len > 0) {
+        /* Copy the last line without a NL to the read buffer, the read()
+         * loop completes it at end-of-file. */
+        linerest = carry.ga_len;
+        vim_free(buffer);
+        buffer = lalloc((long_u)linerest + 1, TRUE);
+        if (buffer == NULL) {
+          linerest = 0;
+          error = TRUE;
+        } else {
+          mch_memmove(buffer, carry.ga_data, (size_t)linerest);
+          line_start = buffer;
+          ptr = buffer + linerest;
+        }
+      }
+      /* Continue reading after the mapped text.  Not when loading in the
+       * background, the lines must be added in order. */
+      if (!map_async
+          && lseek(fd, (off_t)map_len, SEEK_SET) != (off_t)map_len)
+        error = TRUE;
+      skip_read = FALSE;
+    } else {
+      /* Delete the lines appended so far, read the file again. */
+      if (map_keep)
+        lnum = from;
+      while (lnum > from)
+        ml_delete(lnum--, FALSE);
+      skip_count = lines_to_skip;
+      read_count = lines_to_read;
+      if (read_undo_file)
+        sha256_start(&sha_ctx);
+      ff_error = EOL_UNKNOWN;
+    }
+    ga_clear(&carry);
+    ga_clear(&map_index);
+    vim_free(bg);
+    if (map != NULL)
+      munmap(map, map_len);
+  }
+#endif
+
+  while (!error && !got_int && !map_async) {
     /*
      * We allocate as much space for the file as we can get, plus
      * space for the old line plus room for one terminating NUL.
@@ -1550,46 +2071,7 @@ rewind_retry:
        * when reading the first part of a file: guess EOL type
        */
       if (fileformat == EOL_UNKNOWN) {
-        /* First try finding a NL, for Dos and Unix */
-        if (try_dos || try_unix) {
-          for (p = ptr; p < ptr + size; ++p) {
-            if (*p == NL) {
-              if (!try_unix
-                  || (try_dos && p > ptr && p[-1] == CAR))
-                fileformat = EOL_DOS;
-              else
-                fileformat = EOL_UNIX;
-              break;
-            }
-          }
-
-          /* Don't give in to EOL_UNIX if EOL_MAC is more likely */
-          if (fileformat == EOL_UNIX && try_mac) {
-            /* Need to reset the counters when retrying fenc. */
-            try_mac = 1;
-            try_unix = 1;
-            for (; p >= ptr && *p != CAR; p--)
-              ;
-            if (p >= ptr) {
-              for (p = ptr; p < ptr + size; ++p) {
-                if (*p == NL)
-                  try_unix++;
-                else if (*p == CAR)
-                  try_mac++;
-              }
-              if (try_mac > try_unix)
-                fileformat = EOL_MAC;
-            }
-          }
-        }
-
-        /* No NL found: may use Mac format */
-        if (fileformat == EOL_UNKNOWN && try_mac)
-          fileformat = EOL_MAC;
-
-        /* Still nothing found?  Use first format in 'ffs' */
-        if (fileformat == EOL_UNKNOWN)
-          fileformat = default_fileformat();
+        fileformat = readfile_guess_ff(ptr, size, try_dos, try_unix, try_mac);
 
         /* if editing a new file: may set p_tx and p_ff */
         if (set_options)
@@ -1633,58 +2115,66 @@ rewind_retry:
         }
       }
     } else   {
-      --ptr;
-      while (++ptr, --size >= 0) {
-        if ((c = *ptr) != NUL && c != NL)          /* catch most common case */
-          continue;
-        if (c == NUL)
-          *ptr = NL;            /* NULs are replaced by newlines! */
-        else {
-          if (skip_count == 0) {
-            *ptr = NUL;                         /* end of line */
-            len = (colnr_T)(ptr - line_start + 1);
-            if (fileformat == EOL_DOS) {
-              if (ptr[-1] == CAR) {             /* remove CR */
-                ptr[-1] = NUL;
-                --len;
-              }
-              /*
-               * Reading in Dos format, but no CR-LF found!
-               * When 'fileformats' includes "unix", delete all
-               * the lines read so far and start all over again.
-               * Otherwise give an error message later.
-               */
-              else if (ff_error != EOL_DOS) {
-                if (   try_unix
-                       && !read_stdin
-                       && (read_buffer
-                           || lseek(fd, (off_t)0L, SEEK_SET) == 0)) {
-                  fileformat = EOL_UNIX;
-                  if (set_options)
-                    set_fileformat(EOL_UNIX, OPT_LOCAL);
-                  file_rewind = TRUE;
-                  keep_fileformat = TRUE;
-                  goto retry;
-                }
-                ff_error = EOL_DOS;
-              }
-            }
-            if (ml_append(lnum, line_start, len, newfile) == FAIL) {
-              error = TRUE;
-              break;
+      char_u  *buf_end = ptr + size;
+      char_u  *nl;
+
+      /* memchr() is much faster than checking byte by byte, it checks
+       * several bytes at once. */
+      for (;; ++ptr) {
+        nl = memchr(ptr, NL, (size_t)(buf_end - ptr));
+        /* NULs are replaced by newlines! */
+        for (p = ptr; (p = memchr(p, NUL,
+                 (size_t)((nl == NULL ? buf_end : nl) - p))) != NULL; ++p)
+          *p = NL;
+        if (nl == NULL) {
+          ptr = buf_end;
+          break;
+        }
+        ptr = nl;
+        if (skip_count == 0) {
+          *ptr = NUL;                         /* end of line */
+          len = (colnr_T)(ptr - line_start + 1);
+          if (fileformat == EOL_DOS) {
+            if (ptr[-1] == CAR) {             /* remove CR */
+              ptr[-1] = NUL;
+              --len;
             }
-            if (read_undo_file)
-              sha256_update(&sha_ctx, line_start, len);
-            ++lnum;
-            if (--read_count == 0) {
-              error = TRUE;                         /* break loop */
-              line_start = ptr;                 /* nothing left to write */
-              break;
+            /*
+             * Reading in Dos format, but no CR-LF found!
+             * When 'fileformats' includes "unix", delete all
+             * the lines read so far and start all over again.
+             * Otherwise give an error message later.
+             */
+            else if (ff_error != EOL_DOS) {
+              if (   try_unix
+                     && !read_stdin
+                     && (read_buffer
+                         || lseek(fd, (off_t)0L, SEEK_SET) == 0)) {
+                fileformat = EOL_UNIX;
+                if (set_options)
+                  set_fileformat(EOL_UNIX, OPT_LOCAL);
+                file_rewind = TRUE;
+                keep_fileformat = TRUE;
+                goto retry;
+              }
+              ff_error = EOL_DOS;
             }
-          } else
-            --skip_count;
-          line_start = ptr + 1;
-        }
+          }
+          if (ml_append(lnum, line_start, len, newfile) == FAIL) {
+            error = TRUE;
+            break;
+          }
+          if (read_undo_file)
+            sha256_update(&sha_ctx, line_start, len);
+          ++lnum;
+          if (--read_count == 0) {
+            error = TRUE;                         /* break loop */
+            line_start = ptr;                 /* nothing left to write */
+            break;
+          }
+        } else
+          --skip_count;
+        line_start = ptr + 1;
       }
     }
     linerest = (long)(ptr - line_start);
@@ -1779,7 +2269,9 @@ failed:
   if (!recoverymode) {
     /* need to delete the last line, which comes from the empty buffer */
     if (newfile && wasempty && !(curbuf->b_ml.ml_flags & ML_EMPTY)) {
-      ml_delete(curbuf->b_ml.ml_line_count, FALSE);
+      /* A buffer using a mapped file doesn't show it. */
+      if (!map_kept)
+        ml_delete(curbuf->b_ml.ml_line_count, FALSE);
       --linecnt;
     }
     linecnt = curbuf->b_ml.ml_line_count - linecnt;
@@ -1891,124 +2383,1095 @@ failed:
         STRCAT(IObuff, _("[READ ERRORS]"));
         c = TRUE;
       }
-      if (msg_add_fileformat(fileformat))
-        c = TRUE;
-      if (cryptkey != NULL)
-        msg_add_lines(c, (long)linecnt, filesize
-            - CRYPT_MAGIC_LEN
-            - crypt_salt_len[use_crypt_method]
-            - crypt_seed_len[use_crypt_method]);
-      else
-        msg_add_lines(c, (long)linecnt, filesize);
+      if (map_async) {
+        STRCAT(IObuff, _("[loading]"));
+        c = TRUE;
+      }
+      if (msg_add_fileformat(fileformat))
+        c = TRUE;
+      if (cryptkey != NULL)
+        msg_add_lines(c, (long)linecnt, filesize
+            - CRYPT_MAGIC_LEN
+            - crypt_salt_len[use_crypt_method]
+            - crypt_seed_len[use_crypt_method]);
+      else
+        msg_add_lines(c, (long)linecnt, filesize);
+
+      vim_free(keep_msg);
+      keep_msg = NULL;
+      msg_scrolled_ign = TRUE;
+      p = msg_trunc_attr(IObuff, FALSE, 0);
+      if (read_stdin || read_buffer || restart_edit != 0
+          || (msg_scrolled != 0 && !need_wait_return))
+        /* Need to repeat the message after redrawing when:
+         * - When reading from stdin (the screen will be cleared next).
+         * - When restart_edit is set (otherwise there will be a delay
+         *   before redrawing).
+         * - When the screen was scrolled but there is no wait-return
+         *   prompt. */
+        set_keep_msg(p, 0);
+      msg_scrolled_ign = FALSE;
+    }
+
+    /* with errors writing the file requires ":w!" */
+    if (newfile && (error
+                    || conv_error != 0
+                    || (illegal_byte > 0 && bad_char_behavior != BAD_KEEP)
+                    ))
+      curbuf->b_p_ro = TRUE;
+
+    u_clearline();          /* cannot use "U" command after adding lines */
+
+    /*
+     * In Ex mode: cursor at last new line.
+     * Otherwise: cursor at first new line.
+     */
+    if (exmode_active)
+      curwin->w_cursor.lnum = from + linecnt;
+    else
+      curwin->w_cursor.lnum = from + 1;
+    check_cursor_lnum();
+    beginline(BL_WHITE | BL_FIX);           /* on first non-blank */
+
+    /*
+     * Set '[ and '] marks to the newly read lines.
+     */
+    curbuf->b_op_start.lnum = from + 1;
+    curbuf->b_op_start.col = 0;
+    curbuf->b_op_end.lnum = from + linecnt;
+    curbuf->b_op_end.col = 0;
+
+  }
+  msg_scroll = msg_save;
+
+  /*
+   * Get the marks before executing autocommands, so they can be used there.
+   */
+  check_marks_read();
+
+  /*
+   * Trick: We remember if the last line of the read didn't have
+   * an eol even when 'binary' is off, for when writing it again with
+   * 'binary' on.  This is required for
+   * ":autocmd FileReadPost *.gz set bin|'[,']!gunzip" to work.
+   */
+  curbuf->b_no_eol_lnum = read_no_eol_lnum;
+
+  /* When reloading a buffer put the cursor at the first line that is
+   * different. */
+  if (flags & READ_KEEP_UNDO)
+    u_find_first_changed();
+
+  /*
+   * When opening a new file locate undo info and read it.
+   */
+  if (read_undo_file) {
+    char_u hash[UNDO_HASH_SIZE];
+
+    sha256_finish(&sha_ctx, hash);
+    u_read_undo(NULL, hash, fname);
+  }
+
+  if (!read_stdin && !read_buffer) {
+    int m = msg_scroll;
+    int n = msg_scrolled;
+
+    /* Save the fileformat now, otherwise the buffer will be considered
+     * modified if the format/encoding was automatically detected. */
+    if (set_options)
+      save_file_ff(curbuf);
+
+    /*
+     * The output from the autocommands should not overwrite anything and
+     * should not be overwritten: Set msg_scroll, restore its value if no
+     * output was done.
+     */
+    msg_scroll = TRUE;
+    if (filtering)
+      apply_autocmds_exarg(EVENT_FILTERREADPOST, NULL, sfname,
+          FALSE, curbuf, eap);
+    else if (newfile)
+      apply_autocmds_exarg(EVENT_BUFREADPOST, NULL, sfname,
+          FALSE, curbuf, eap);
+    else
+      apply_autocmds_exarg(EVENT_FILEREADPOST, sfname, sfname,
+          FALSE, NULL, eap);
+    if (msg_scrolled == n)
+      msg_scroll = m;
+    if (aborting())         /* autocmds may abort script processing */
+      return FAIL;
+  }
+
+  if (recoverymode && error)
+    return FAIL;
+  return OK;
+}
+
+/*
+ * Guess the end-of-line type from the first "size" bytes read from a file.
+ * "try_dos", "try_unix" and "try_mac" tell which formats 'fileformats'
+ * allows.
+ */
+static int readfile_guess_ff(char_u *ptr, long size, int try_dos,
+                             int try_unix, int try_mac)
+{
+  int fileformat = EOL_UNKNOWN;
+  char_u      *p;
+
+  /* First try finding a NL, for Dos and Unix */
+  if (try_dos || try_unix) {
+    for (p = ptr; p < ptr + size; ++p) {
+      if (*p == NL) {
+        if (!try_unix
+            || (try_dos && p > ptr && p[-1] == CAR))
+          fileformat = EOL_DOS;
+        else
+          fileformat = EOL_UNIX;
+        break;
+      }
+    }
+
+    /* Don't give in to EOL_UNIX if EOL_MAC is more likely */
+    if (fileformat == EOL_UNIX && try_mac) {
+      /* Use the flags as counters. */
+      try_mac = 1;
+      try_unix = 1;
+      for (; p >= ptr && *p != CAR; p--)
+        ;
+      if (p >= ptr) {
+        for (p = ptr; p < ptr + size; ++p) {
+          if (*p == NL)
+            try_unix++;
+          else if (*p == CAR)
+            try_mac++;
+        }
+        if (try_mac > try_unix)
+          fileformat = EOL_MAC;
+      }
+    }
+  }
+
+  /* No NL found: may use Mac format */
+  if (fileformat == EOL_UNKNOWN && try_mac)
+    fileformat = EOL_MAC;
+
+  /* Still nothing found?  Use first format in 'ffs' */
+  if (fileformat == EOL_UNKNOWN)
+    fileformat = default_fileformat();
+
+  return fileformat;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Map the file opened as "fd" into memory, when it's a regular file that is
+ * big enough to make this worthwhile.
+ * Accessing a page beyond the end of the file gives a SIGBUS, which happens
+ * when the file is truncated by another process.  Use mch_map_guard() when
+ * reading the mapping.
+ * Returns the start of the mapping and sets "*lenp" to its size.
+ * Returns NULL when the file is not mapped.
+ */
+static char_u *readfile_map(int fd, size_t *lenp)
+{
+  struct stat st;
+  void        *map;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+      || st.st_size < MMAP_MIN_SIZE
+      || (off_t)(size_t)st.st_size != st.st_size)
+    return NULL;
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, (off_t)0);
+  if (map == MAP_FAILED)
+    return NULL;
+# ifdef MADV_SEQUENTIAL
+  (void)madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+# endif
+  *lenp = (size_t)st.st_size;
+  return (char_u *)map;
+}
+
+/*
+ * Copy "len" bytes of a mapped file from "from" to "to".
+ * Returns FAIL when the file was truncated.
+ */
+static int readfile_map_copy(char_u *to, char_u *from, size_t len)
+{
+  JMP_BUF env;
+
+  if (SETJMP(env) != 0) {
+    /* Got a SIGBUS. */
+    mch_map_guard(0, NULL);
+    return FAIL;
+  }
+  mch_map_guard(0, &env);
+  mch_memmove(to, from, len);
+  mch_map_guard(0, NULL);
+  return OK;
+}
+
+/*
+ * Return TRUE when the file mapped as "fd" is now smaller than "len".  When
+ * only the last page became shorter there is no SIGBUS.
+ */
+static int readfile_map_truncated(int fd, size_t len)
+{
+  struct stat st;
+
+  return fstat(fd, &st) < 0 || st.st_size < (off_t)len;
+}
+
+/* Returned by mapscan_get() when a thread ran out of memory or got a
+ * SIGBUS. */
+static mapseg_T mapseg_nomem = {NULL, NULL, 0, NULL, 0, NULL, 0, TRUE, FALSE,
+                                 NULL};
+
+/*
+ * Start threads that convert the mapped text from "start" to "end" to
+ * 'encoding' and find the line ends, one segment at a time.  "fio_flags"
+ * specifies the conversion, zero for none.  When "check_utf8" is TRUE an
+ * illegal UTF-8 byte makes the segment bad.  When "copy" is FALSE text that
+ * needs no conversion is not copied, only the line ends are found.  The
+ * fileformat is to be guessed from the first "guess_len" bytes.
+ * Use mapscan_get() to obtain the segments in order and mapscan_stop() when
+ * done.
+ * Returns FAIL when no thread could be started.
+ */
+static int mapscan_start(mapscan_T *ms, char_u *start, char_u *end,
+                         int fio_flags, int check_utf8, int copy,
+                         long guess_len)
+{
+  int nthreads;
+  int i;
+
+  ms->ms_start = start;
+  ms->ms_end = end;
+  ms->ms_fio_flags = fio_flags;
+  ms->ms_check_utf8 = check_utf8;
+  ms->ms_copy = copy;
+  ms->ms_guess_len = guess_len;
+  ms->ms_next = start;
+  ms->ms_next_nr = 0;
+  ms->ms_get_nr = 0;
+  for (i = 0; i < MAPSEG_MAX; ++i)
+    ms->ms_done[i] = NULL;
+  ms->ms_cancel = FALSE;
+  ms->ms_fault = FALSE;
+  ms->ms_thread_nr = 0;
+  ms->ms_nthreads = 0;
+  if (uv_mutex_init(&ms->ms_mutex) != 0)
+    return FAIL;
+  if (uv_cond_init(&ms->ms_cond) != 0) {
+    uv_mutex_destroy(&ms->ms_mutex);
+    return FAIL;
+  }
+
+  /* Leave one processor for the thread storing the lines. */
+  nthreads = mch_cpu_count() - 1;
+  if (nthreads < 1)
+    nthreads = 1;
+  else if (nthreads > MAPSCAN_THREADS)
+    nthreads = MAPSCAN_THREADS;
+  for (i = 0; i < nthreads; ++i) {
+    if (uv_thread_create(&ms->ms_threads[i], mapscan_thread, ms) != 0)
+      break;
+    ++ms->ms_nthreads;
+  }
+  if (ms->ms_nthreads == 0) {
+    uv_cond_destroy(&ms->ms_cond);
+    uv_mutex_destroy(&ms->ms_mutex);
+    return FAIL;
+  }
+  return OK;
+}
+
+/*
+ * A decoding thread.  It must not use anything but the mapped text and "ms",
+ * thus it uses malloc() instead of alloc(), which may give messages.
+ */
+static void mapscan_thread(void *arg)
+{
+  mapscan_T   *ms = (mapscan_T *)arg;
+  mapseg_T    *volatile sg = NULL;
+  volatile int locked = FALSE;
+  char_u      *start;
+  char_u      *end;
+  long nr;
+  int idx;
+  JMP_BUF env;
+  sigset_t set;
+
+  /* Signals are handled by the main thread.  Except SIGBUS, which must reach
+   * deathtrap() when the mapped file was truncated; a blocked SIGBUS kills
+   * the process. */
+  sigfillset(&set);
+  sigdelset(&set, SIGBUS);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  uv_mutex_lock(&ms->ms_mutex);
+  idx = ++ms->ms_thread_nr;
+  uv_mutex_unlock(&ms->ms_mutex);
+
+  if (SETJMP(env) != 0) {
+    /* Got a SIGBUS, the file was truncated.  mapscan_get() returns a bad
+     * segment now, readfile() reads the file again. */
+    mch_map_guard(idx, NULL);
+    mapseg_free(sg);
+    if (!locked)
+      uv_mutex_lock(&ms->ms_mutex);
+    ms->ms_fault = TRUE;
+    uv_cond_broadcast(&ms->ms_cond);
+    uv_mutex_unlock(&ms->ms_mutex);
+    return;
+  }
+  mch_map_guard(idx, &env);
+
+  for (;; ) {
+    /* Take the next segment, unless too many are waiting to be stored. */
+    uv_mutex_lock(&ms->ms_mutex);
+    locked = TRUE;
+    while (!ms->ms_cancel && !ms->ms_fault && ms->ms_next < ms->ms_end
+           && ms->ms_next_nr >= ms->ms_get_nr + MAPSEG_MAX)
+      uv_cond_wait(&ms->ms_cond, &ms->ms_mutex);
+    if (ms->ms_cancel || ms->ms_fault || ms->ms_next >= ms->ms_end) {
+      locked = FALSE;
+      uv_mutex_unlock(&ms->ms_mutex);
+      break;
+    }
+    start = ms->ms_next;
+    end = mapscan_seg_end(ms, start);
+    nr = ms->ms_next_nr++;
+    ms->ms_next = end;
+    locked = FALSE;
+    uv_mutex_unlock(&ms->ms_mutex);
+
+    sg = (mapseg_T *)malloc(sizeof(mapseg_T));
+    if (sg != NULL && mapscan_decode(ms, sg, start, end) == FAIL) {
+      mapseg_free(sg);
+      sg = NULL;
+    }
+
+    uv_mutex_lock(&ms->ms_mutex);
+    ms->ms_done[nr % MAPSEG_MAX] = sg == NULL ? &mapseg_nomem : sg;
+    sg = NULL;
+    uv_cond_broadcast(&ms->ms_cond);
+    uv_mutex_unlock(&ms->ms_mutex);
+  }
+  mch_map_guard(idx, NULL);
+}
+
+/*
+ * Return the end of the segment starting at "start".  A character is not
+ * split between segments.
+ */
+static char_u *mapscan_seg_end(mapscan_T *ms, char_u *start)
+{
+  char_u      *end;
+  int i;
+
+  if (ms->ms_end - start <= MAPSEG_SIZE)
+    return ms->ms_end;
+  end = start + MAPSEG_SIZE;
+  if (ms->ms_fio_flags == 0) {
+    /* Back up to the first byte of a UTF-8 character. */
+    for (i = 0; i < 5 && end > start && (*end & 0xc0) == 0x80; ++i)
+      --end;
+  } else if ((ms->ms_fio_flags & FIO_UTF16) && end + 2 <= ms->ms_end) {
+    int u16c;
+    int u16c2;
+
+    /* Keep a surrogate pair together. */
+    if (ms->ms_fio_flags & FIO_ENDIAN_L) {
+      u16c = (end[-1] << 8) + end[-2];
+      u16c2 = (end[1] << 8) + end[0];
+    } else {
+      u16c = (end[-2] << 8) + end[-1];
+      u16c2 = (end[0] << 8) + end[1];
+    }
+    if (u16c >= 0xd800 && u16c <= 0xdbff && u16c2 >= 0xdc00 && u16c2 <= 0xdfff)
+      end += 2;
+  }
+  /* Latin1, UCS-2 and UCS-4 segments always end at a character, since
+   * MAPSEG_SIZE is a multiple of four. */
+  return end;
+}
+
+/*
+ * Add the offset "off" of a line end to segment "sg".  "*sizep" is the
+ * number of offsets allocated.
+ * Returns FAIL when out of memory.
+ */
+static int mapscan_add_end(mapseg_T *sg, long off, int *sizep)
+{
+  int         *ends;
+
+  if (sg->sg_count == *sizep) {
+    ends = (int *)realloc(sg->sg_ends, (*sizep * 2 + 100) * sizeof(int));
+    if (ends == NULL)
+      return FAIL;
+    sg->sg_ends = ends;
+    *sizep = *sizep * 2 + 100;
+  }
+  sg->sg_ends[sg->sg_count++] = (int)off;
+  return OK;
+}
+
+/*
+ * When the text "text" of segment "sg" to guess the fileformat from contains
+ * a NUL, keep a copy before NULs are replaced.  NLs found after replacing
+ * would change the guess.
+ * Returns FAIL when out of memory.
+ */
+static int mapscan_keep_guess(mapseg_T *sg, char_u *text)
+{
+  if (sg->sg_guess_len == 0
+      || memchr(text, NUL, (size_t)sg->sg_guess_len) == NULL)
+    return OK;
+  sg->sg_guess = (char_u *)malloc((size_t)sg->sg_guess_len);
+  if (sg->sg_guess == NULL)
+    return FAIL;
+  memmove(sg->sg_guess, text, (size_t)sg->sg_guess_len);
+  return OK;
+}
+
+/*
+ * Convert the mapped text from "start" to "end" into segment "sg" and find
+ * the line ends in it.  NULs are replaced by NLs.  "sg_bad" is set when the
+ * text can't be converted or has an illegal byte; the read() loop reports
+ * those.
+ * Returns FAIL when out of memory.
+ */
+static int mapscan_decode(mapscan_T *ms, mapseg_T *sg, char_u *start,
+                          char_u *end)
+{
+  char_u      *p;
+  char_u      *d;
+  char_u      *guess_end = NULL;
+  int fio_flags = ms->ms_fio_flags;
+  int has_nul = FALSE;
+  int size = 0;
+  int u8c;
+
+  sg->sg_text = start;
+  sg->sg_alloc = NULL;
+  sg->sg_len = (long)(end - start);
+  sg->sg_guess = NULL;
+  sg->sg_ends = NULL;
+  sg->sg_count = 0;
+  sg->sg_bad = FALSE;
+  sg->sg_nocr = FALSE;
+  sg->sg_map_end = end;
+  sg->sg_guess_len = 0;
+  if (start == ms->ms_start) {
+    sg->sg_guess_len = ms->ms_guess_len < sg->sg_len
+                       ? ms->ms_guess_len : sg->sg_len;
+    guess_end = start + sg->sg_guess_len;
+  }
+
+  if (fio_flags == 0) {
+    if (ms->ms_check_utf8) {
+      for (p = start; p < end; ) {
+        if (*p < 0x80)
+          ++p;
+        else {
+          int l = utf_ptr2len_len(p, (int)(end - p));
+
+          if (l == 1 || l > end - p) {
+            sg->sg_bad = TRUE;
+            return OK;
+          }
+          p += l;
+        }
+      }
+    }
+    for (p = start; (p = memchr(p, NL, (size_t)(end - p))) != NULL; ++p) {
+      if (mapscan_add_end(sg, (long)(p - start), &size) == FAIL)
+        return FAIL;
+      if (p == ms->ms_start || p[-1] != CAR)
+        sg->sg_nocr = TRUE;
+    }
+
+    /* The main thread doesn't use the mapping, a SIGBUS there can't be
+     * handled well.  Copy the text to guess the fileformat from. */
+    if (sg->sg_guess_len > 0) {
+      sg->sg_guess = (char_u *)malloc((size_t)sg->sg_guess_len);
+      if (sg->sg_guess == NULL)
+        return FAIL;
+      memmove(sg->sg_guess, start, (size_t)sg->sg_guess_len);
+    }
+
+    /* Copy the text when the lines are used, NULs are replaced by
+     * newlines. */
+    if (ms->ms_copy) {
+      sg->sg_alloc = (char_u *)malloc((size_t)sg->sg_len + 1);
+      if (sg->sg_alloc == NULL)
+        return FAIL;
+      memmove(sg->sg_alloc, start, (size_t)sg->sg_len);
+      for (d = sg->sg_alloc; (d = memchr(d, NUL,
+               (size_t)(sg->sg_alloc + sg->sg_len - d))) != NULL; ++d)
+        *d = NL;
+      sg->sg_text = sg->sg_alloc;
+    }
+    return OK;
+  }
+
+  /* Convert Latin1 or Unicode to UTF-8.  A character takes at most twice
+   * as many bytes. */
+  if (((fio_flags & (FIO_UCS2 | FIO_UTF16)) && (sg->sg_len & 1))
+      || ((fio_flags & FIO_UCS4) && (sg->sg_len & 3))) {
+    /* Trailing bytes that are not a whole character. */
+    sg->sg_bad = TRUE;
+    return OK;
+  }
+  sg->sg_alloc = (char_u *)malloc((size_t)sg->sg_len * 2 + 1);
+  if (sg->sg_alloc == NULL)
+    return FAIL;
+  d = sg->sg_alloc;
+  for (p = start; p < end; ) {
+    if (guess_end != NULL && p >= guess_end) {
+      sg->sg_guess_len = (long)(d - sg->sg_alloc);
+      guess_end = NULL;
+    }
+    if (fio_flags & FIO_LATIN1)
+      u8c = *p++;
+    else if (fio_flags & (FIO_UCS2 | FIO_UTF16)) {
+      if (fio_flags & FIO_ENDIAN_L)
+        u8c = (p[1] << 8) + p[0];
+      else
+        u8c = (p[0] << 8) + p[1];
+      p += 2;
+      if (fio_flags & FIO_UTF16) {
+        if (u8c >= 0xdc00 && u8c <= 0xdfff) {
+          /* Missing leading word. */
+          sg->sg_bad = TRUE;
+          return OK;
+        }
+        if (u8c >= 0xd800 && u8c <= 0xdbff) {
+          int u16c = 0;
+
+          /* A leading word must be followed by a trailing word.
+           * mapscan_seg_end() keeps a pair in one segment, thus a leading
+           * word at the end of a segment is unpaired as well. */
+          if (p < end) {
+            if (fio_flags & FIO_ENDIAN_L)
+              u16c = (p[1] << 8) + p[0];
+            else
+              u16c = (p[0] << 8) + p[1];
+          }
+          if (u16c < 0xdc00 || u16c > 0xdfff) {
+            sg->sg_bad = TRUE;
+            return OK;
+          }
+          /* found second word of double-word, compute the resulting
+           * character */
+          u8c = 0x10000 + ((u8c & 0x3ff) << 10) + (u16c & 0x3ff);
+          p += 2;
+        }
+      }
+    } else {   /* FIO_UCS4 */
+      if (fio_flags & FIO_ENDIAN_L) {
+        if (p[3] >= 0x80) {
+          sg->sg_bad = TRUE;
+          return OK;
+        }
+        u8c = (p[3] << 24) + (p[2] << 16) + (p[1] << 8) + p[0];
+      } else {
+        if (p[0] >= 0x80) {
+          sg->sg_bad = TRUE;
+          return OK;
+        }
+        u8c = (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+      }
+      p += 4;
+    }
+
+    if (u8c == NL) {
+      if (mapscan_add_end(sg, (long)(d - sg->sg_alloc), &size) == FAIL)
+        return FAIL;
+      *d++ = NL;
+    } else if (u8c == NUL) {
+      has_nul = TRUE;
+      *d++ = NUL;
+    } else
+      d += utf_char2bytes(u8c, d);
+  }
+  if (guess_end != NULL)
+    sg->sg_guess_len = (long)(d - sg->sg_alloc);
+  sg->sg_text = sg->sg_alloc;
+  sg->sg_len = (long)(d - sg->sg_alloc);
+
+  if (has_nul) {
+    if (mapscan_keep_guess(sg, sg->sg_text) == FAIL)
+      return FAIL;
+    for (d = sg->sg_text; d < sg->sg_text + sg->sg_len; ++d)
+      if (*d == NUL)
+        *d = NL;                /* NULs are replaced by newlines! */
+  }
+  return OK;
+}
+
+/*
+ * Get the next segment in order, waiting for the threads when needed.  The
+ * caller must free it with mapseg_free().
+ * Returns NULL when all segments have been decoded.
+ */
+static mapseg_T *mapscan_get(mapscan_T *ms)
+{
+  mapseg_T    *sg = NULL;
+  int slot = (int)(ms->ms_get_nr % MAPSEG_MAX);
+
+  uv_mutex_lock(&ms->ms_mutex);
+  while (ms->ms_done[slot] == NULL && !ms->ms_fault
+         && !(ms->ms_next >= ms->ms_end && ms->ms_get_nr == ms->ms_next_nr))
+    uv_cond_wait(&ms->ms_cond, &ms->ms_mutex);
+  if (ms->ms_fault)
+    sg = &mapseg_nomem;         /* the file was truncated */
+  else if (ms->ms_done[slot] != NULL) {
+    sg = ms->ms_done[slot];
+    ms->ms_done[slot] = NULL;
+    ++ms->ms_get_nr;
+    uv_cond_broadcast(&ms->ms_cond);
+  }
+  uv_mutex_unlock(&ms->ms_mutex);
+  return sg;
+}
+
+/*
+ * Return TRUE when mapscan_get() returns without waiting for the threads.
+ */
+static int mapscan_ready(mapscan_T *ms)
+{
+  int ready;
+
+  uv_mutex_lock(&ms->ms_mutex);
+  ready = ms->ms_done[ms->ms_get_nr % MAPSEG_MAX] != NULL || ms->ms_fault
+          || (ms->ms_next >= ms->ms_end && ms->ms_get_nr == ms->ms_next_nr);
+  uv_mutex_unlock(&ms->ms_mutex);
+  return ready;
+}
+
+/*
+ * Free a segment obtained with mapscan_get().
+ */
+static void mapseg_free(mapseg_T *sg)
+{
+  if (sg == NULL || sg == &mapseg_nomem)
+    return;
+  free(sg->sg_alloc);
+  free(sg->sg_guess);
+  free(sg->sg_ends);
+  free(sg);
+}
+
+/*
+ * Stop the decoding threads and free the segments that were not used.
+ */
+static void mapscan_stop(mapscan_T *ms)
+{
+  int i;
+
+  if (ms->ms_nthreads == 0)
+    return;
+  uv_mutex_lock(&ms->ms_mutex);
+  ms->ms_cancel = TRUE;
+  uv_cond_broadcast(&ms->ms_cond);
+  uv_mutex_unlock(&ms->ms_mutex);
+  for (i = 0; i < ms->ms_nthreads; ++i)
+    uv_thread_join(&ms->ms_threads[i]);
+
+  for (i = 0; i < MAPSEG_MAX; ++i) {
+    mapseg_free(ms->ms_done[i]);
+    ms->ms_done[i] = NULL;
+  }
+  uv_cond_destroy(&ms->ms_cond);
+  uv_mutex_destroy(&ms->ms_mutex);
+  ms->ms_nthreads = 0;
+}
+
+/*
+ * Return TRUE when lines of files loaded in the background may be added and
+ * autocommands triggered: while waiting for a command or typing text, not
+ * halfway a command line or at a prompt.
+ */
+static int bgload_can_update(void)
+{
+  return (State == NORMAL || State == NORMAL_BUSY || (State & INSERT))
+         && !updating_screen && !text_locked()
+         && curbuf_lock == 0 && allbuf_lock == 0;
+}
+
+/*
+ * Add the lines in the segments that the threads of "bg" found to its
+ * buffer.  When "wait" is TRUE wait for all of them, otherwise stop when
+ * the threads are not ready or after BGLOAD_TIME msec.
+ * Sets bg_bad when something is found that the read() loop must handle.
+ */
+static void bgload_add(bgload_T *bg, int wait)
+{
+  mlmap_T     *mm = bg->bg_mm;
+  mapseg_T    *sg;
+  char_u      *seg_end;
+  size_t seg_off;
+  proftime_T tm;
+  int i;
+
+  profile_setlimit(wait ? 0L : BGLOAD_TIME, &tm);
+  while (!bg->bg_bad && (wait || mapscan_ready(&bg->bg_ms))) {
+    sg = mapscan_get(&bg->bg_ms);
+    if (sg == NULL) {
+      /* All segments were done. */
+      bgload_end(bg);
+      return;
+    }
+    if (sg->sg_bad || (bg->bg_dos && sg->sg_nocr)) {
+      /* An illegal byte, out of memory, the file was truncated or a NL
+       * without a CR in Dos format. */
+      mapseg_free(sg);
+      bg->bg_bad = TRUE;
+      return;
+    }
+    seg_off = (size_t)(sg->sg_map_end - mm->mm_start) - (size_t)sg->sg_len;
+    for (i = 0; i < sg->sg_count; ++i) {
+      if (bgload_add_line(bg) == FAIL) {
+        bg->bg_bad = TRUE;
+        break;
+      }
+      bg->bg_line_off = seg_off + (size_t)sg->sg_ends[i] + 1;
+    }
+    mm->mm_end = bg->bg_line_off;
+    bg->bg_size += sg->sg_len;
+    seg_end = sg->sg_map_end;
+    mapseg_free(sg);
+
+    /* Drop the pages that have been used, like readfile() does. */
+    if (seg_end - bg->bg_drop_start >= MMAP_DROP_SIZE) {
+      size_t n = (size_t)(seg_end - bg->bg_drop_start) & ~(size_t)0xffff;
+
+# ifdef MADV_DONTNEED
+      (void)madvise(bg->bg_drop_start, n, MADV_DONTNEED);
+# endif
+      bg->bg_drop_start += n;
+    }
+    if (profile_passed_limit(&tm))
+      break;
+  }
+}
+
+/*
+ * Add the line starting at bg_line_off to the buffer of "bg".
+ * Returns FAIL when out of memory.
+ */
+static int bgload_add_line(bgload_T *bg)
+{
+  buf_T       *buf = bg->bg_buf;
+
+  if (buf->b_ml.ml_line_count % MLMAP_STEP == 0) {
+    if (ga_grow(&bg->bg_index, 1) == FAIL)
+      return FAIL;
+    bg->bg_mm->mm_index = (size_t *)bg->bg_index.ga_data;
+    ((size_t *)bg->bg_index.ga_data)[bg->bg_index.ga_len++] =
+      bg->bg_line_off;
+  }
+  ++buf->b_ml.ml_line_count;
+  return OK;
+}
+
+/*
+ * The threads of "bg" found all the line ends.  Add the last line when it
+ * has no NL, like readfile() does.
+ */
+static void bgload_end(bgload_T *bg)
+{
+  mlmap_T     *mm = bg->bg_mm;
+  buf_T       *buf = bg->bg_buf;
+  char_u c;
+
+  mapscan_stop(&bg->bg_ms);
+
+  /* When the file was truncated while scanning it the text isn't right. */
+  if (bg->bg_fd >= 0 && readfile_map_truncated(bg->bg_fd, mm->mm_len)) {
+    bg->bg_bad = TRUE;
+    return;
+  }
+  if (bg->bg_line_off < mm->mm_len) {
+    if (readfile_map_copy(&c, mm->mm_start + bg->bg_line_off, (size_t)1)
+        == FAIL) {
+      bg->bg_bad = TRUE;
+      return;
+    }
+    /* In Dos format ignore a trailing CTRL-Z, unless 'binary' set. */
+    if (buf->b_p_bin || !bg->bg_dos
+        || mm->mm_len - bg->bg_line_off != 1 || c != Ctrl_Z) {
+      if (bgload_add_line(bg) == FAIL) {
+        bg->bg_bad = TRUE;
+        return;
+      }
+      mm->mm_eol = FALSE;
+      buf->b_p_eol = FALSE;
+      buf->b_start_eol = FALSE;
+      buf->b_no_eol_lnum = buf->b_ml.ml_line_count;
+    }
+  }
+  bgload_detach(bg);
+}
 
-      vim_free(keep_msg);
-      keep_msg = NULL;
-      msg_scrolled_ign = TRUE;
-      p = msg_trunc_attr(IObuff, FALSE, 0);
-      if (read_stdin || read_buffer || restart_edit != 0
-          || (msg_scrolled != 0 && !need_wait_return))
-        /* Need to repeat the message after redrawing when:
-         * - When reading from stdin (the screen will be cleared next).
-         * - When restart_edit is set (otherwise there will be a delay
-         *   before redrawing).
-         * - When the screen was scrolled but there is no wait-return
-         *   prompt. */
-        set_keep_msg(p, 0);
-      msg_scrolled_ign = FALSE;
+/*
+ * The threads of "bg" found something only the read() loop handles, but
+ * the buffer is about to be changed.  Add the other lines as they are and
+ * make the buffer read-only, like readfile() does for an illegal byte.
+ */
+static void bgload_rest(bgload_T *bg)
+{
+  mlmap_T     *mm = bg->bg_mm;
+  buf_T       *buf = bg->bg_buf;
+  char_u      *p;
+  JMP_BUF env;
+
+  mapscan_stop(&bg->bg_ms);
+  if (SETJMP(env) == 0) {
+    mch_map_guard(0, &env);
+    while (bg->bg_line_off < mm->mm_len
+           && (p = memchr(mm->mm_start + bg->bg_line_off, NL,
+                   mm->mm_len - bg->bg_line_off)) != NULL
+           && bgload_add_line(bg) == OK)
+      bg->bg_line_off = (size_t)(p - mm->mm_start) + 1;
+    if (bg->bg_line_off < mm->mm_len && bgload_add_line(bg) == OK) {
+      mm->mm_eol = FALSE;
+      buf->b_p_eol = FALSE;
+      buf->b_start_eol = FALSE;
+      buf->b_no_eol_lnum = buf->b_ml.ml_line_count;
     }
+  }
+  /* else: got a SIGBUS, the file was truncated */
+  mch_map_guard(0, NULL);
+  bgload_detach(bg);
 
-    /* with errors writing the file requires ":w!" */
-    if (newfile && (error
-                    || conv_error != 0
-                    || (illegal_byte > 0 && bad_char_behavior != BAD_KEEP)
-                    ))
-      curbuf->b_p_ro = TRUE;
+  buf->b_p_ro = TRUE;
+  EMSG2(_("E5911: Could not load all of \"%s\" correctly, it is read-only"),
+      buf->b_fname);
+}
 
-    u_clearline();          /* cannot use "U" command after adding lines */
+/*
+ * All lines of "bg" were added: let the buffer use the mapping like any
+ * other.  BufLoadPost is still to be triggered.
+ */
+static void bgload_detach(bgload_T *bg)
+{
+  mapscan_stop(&bg->bg_ms);
+  if (bg->bg_fd >= 0)
+    close(bg->bg_fd);
+  bg->bg_fd = -1;
+  bg->bg_mm->mm_end = bg->bg_mm->mm_len;
+  bg->bg_mm->mm_load = NULL;
+  bg->bg_mm = NULL;
+  bg->bg_done = TRUE;
+}
 
-    /*
-     * In Ex mode: cursor at last new line.
-     * Otherwise: cursor at first new line.
-     */
-    if (exmode_active)
-      curwin->w_cursor.lnum = from + linecnt;
-    else
-      curwin->w_cursor.lnum = from + 1;
-    check_cursor_lnum();
-    beginline(BL_WHITE | BL_FIX);           /* on first non-blank */
+/*
+ * The threads of "bg" found something only the read() loop handles: read
+ * the file again, without loading in the background.
+ */
+static void bgload_reread(bgload_T *bg)
+{
+  buf_T       *buf = bg->bg_buf;
+  aco_save_T aco;
+  pos_T old_cursor;
+  linenr_T old_topline;
 
-    /*
-     * Set '[ and '] marks to the newly read lines.
-     */
-    curbuf->b_op_start.lnum = from + 1;
-    curbuf->b_op_start.col = 0;
-    curbuf->b_op_end.lnum = from + linecnt;
-    curbuf->b_op_end.col = 0;
+  bgload_detach(bg);
 
+  /* set curwin/curbuf for "buf" and save some things */
+  aucmd_prepbuf(&aco, buf);
+  old_cursor = curwin->w_cursor;
+  old_topline = curwin->w_topline;
+  ml_map_drop(curbuf);
+  keep_filetype = TRUE;                 /* don't detect 'filetype' */
+  if (readfile(curbuf->b_ffname, curbuf->b_fname, (linenr_T)0, (linenr_T)0,
+          (linenr_T)MAXLNUM, NULL, READ_NEW | READ_NOBG) == OK
+      && buf == curbuf)
+    unchanged(curbuf, TRUE);
+  keep_filetype = FALSE;
+  if (buf == curbuf) {
+    curwin->w_topline = old_topline;
+    curwin->w_cursor = old_cursor;
+    check_cursor();
+    update_topline();
   }
-  msg_scroll = msg_save;
+  redraw_buf_later(buf, NOT_VALID);
+  /* restore curwin/curbuf and a few other things */
+  aucmd_restbuf(&aco);
+}
 
-  /*
-   * Get the marks before executing autocommands, so they can be used there.
-   */
-  check_marks_read();
+/*
+ * Loading "bg" is done: give the file message and trigger BufLoadPost.
+ * "bg" is freed.
+ */
+static void bgload_finished(bgload_T *bg)
+{
+  buf_T       *buf = bg->bg_buf;
+  aco_save_T aco;
+  char_u      *p;
 
-  /*
-   * Trick: We remember if the last line of the read didn't have
-   * an eol even when 'binary' is off, for when writing it again with
-   * 'binary' on.  This is required for
-   * ":autocmd FileReadPost *.gz set bin|'[,']!gunzip" to work.
-   */
-  curbuf->b_no_eol_lnum = read_no_eol_lnum;
+  if (buf == curbuf && !bg->bg_bad) {
+    msg_add_fname(buf, buf->b_fname);
+    msg_add_lines(FALSE, (long)buf->b_ml.ml_line_count, bg->bg_size);
+    msg_scrolled_ign = TRUE;
+    p = msg_trunc_attr(IObuff, FALSE, 0);
+    if (msg_scrolled != 0 && !need_wait_return)
+      set_keep_msg(p, 0);
+    msg_scrolled_ign = FALSE;
+  }
+  bgload_free(bg);
 
-  /* When reloading a buffer put the cursor at the first line that is
-   * different. */
-  if (flags & READ_KEEP_UNDO)
-    u_find_first_changed();
+  aucmd_prepbuf(&aco, buf);
+  apply_autocmds(EVENT_BUFLOADPOST, NULL, NULL, FALSE, curbuf);
+  aucmd_restbuf(&aco);
+}
 
-  /*
-   * When opening a new file locate undo info and read it.
-   */
-  if (read_undo_file) {
-    char_u hash[UNDO_HASH_SIZE];
+/*
+ * Remove "bg" from bgload_list and free it.  The threads must have been
+ * stopped.
+ */
+static void bgload_free(bgload_T *bg)
+{
+  bgload_T    **pp;
 
-    sha256_finish(&sha_ctx, hash);
-    u_read_undo(NULL, hash, fname);
-  }
+  for (pp = &bgload_list; *pp != NULL; pp = &(*pp)->bg_next)
+    if (*pp == bg) {
+      *pp = bg->bg_next;
+      break;
+    }
+  vim_free(bg);
+}
+#endif
 
-  if (!read_stdin && !read_buffer) {
-    int m = msg_scroll;
-    int n = msg_scrolled;
+/*
+ * Return TRUE while a file is being loaded in the background or its
+ * BufLoadPost event is still to be triggered.
+ */
+int readfile_bg_busy(void)
+{
+#ifdef HAVE_SYS_MMAN_H
+  return bgload_list != NULL;
+#else
+  return FALSE;
+#endif
+}
 
-    /* Save the fileformat now, otherwise the buffer will be considered
-     * modified if the format/encoding was automatically detected. */
-    if (set_options)
-      save_file_ff(curbuf);
+/*
+ * Add the lines that the threads found for files loaded in the background
+ * and trigger BufLoadPost for the ones that are done.  Called while waiting
+ * for a key.
+ */
+void readfile_bg_poll(void)
+{
+#ifdef HAVE_SYS_MMAN_H
+  static int busy = FALSE;
+  bgload_T    *bg;
+  buf_T       *buf;
+  win_T       *wp;
+  tabpage_T   *tp;
+  linenr_T old_count;
 
-    /*
-     * The output from the autocommands should not overwrite anything and
-     * should not be overwritten: Set msg_scroll, restore its value if no
-     * output was done.
-     */
-    msg_scroll = TRUE;
-    if (filtering)
-      apply_autocmds_exarg(EVENT_FILTERREADPOST, NULL, sfname,
-          FALSE, curbuf, eap);
-    else if (newfile)
-      apply_autocmds_exarg(EVENT_BUFREADPOST, NULL, sfname,
-          FALSE, curbuf, eap);
-    else
-      apply_autocmds_exarg(EVENT_FILEREADPOST, sfname, sfname,
-          FALSE, NULL, eap);
-    if (msg_scrolled == n)
-      msg_scroll = m;
-    if (aborting())         /* autocmds may abort script processing */
-      return FAIL;
+  if (busy || !bgload_can_update())
+    return;
+  busy = TRUE;
+  bg = bgload_list;
+  while (bg != NULL) {
+    buf = bg->bg_buf;
+    if (bg->bg_mm != NULL) {
+      old_count = buf->b_ml.ml_line_count;
+      bgload_add(bg, FALSE);
+      if (bg->bg_bad) {
+        /* Autocommands may change the list, start all over. */
+        bgload_reread(bg);
+        bg = bgload_list;
+        continue;
+      }
+      FOR_ALL_TAB_WINDOWS(tp, wp)
+      if (wp->w_buffer == buf) {
+        wp->w_redr_status = TRUE;
+        if (buf->b_ml.ml_line_count != old_count) {
+          /* Lines below the end that was shown must be drawn. */
+          if (!(wp->w_valid & VALID_BOTLINE) || wp->w_botline > old_count)
+            redraw_win_later(wp, NOT_VALID);
+          if (!foldmethodIsManual(wp))
+            foldUpdate(wp, old_count + 1, buf->b_ml.ml_line_count);
+        }
+      }
+    }
+    if (bg->bg_done) {
+      bgload_finished(bg);
+      bg = bgload_list;
+      continue;
+    }
+    bg = bg->bg_next;
   }
 
-  if (recoverymode && error)
-    return FAIL;
-  return OK;
+  /* Update the screen, the ruler and the status lines show the progress. */
+  update_screen(0);
+  showruler(FALSE);
+  setcursor();
+  out_flush();
+  busy = FALSE;
+#endif
+}
+
+/*
+ * Wait for all lines of "buf" when it is being loaded in the background.
+ * Used when the buffer is changed or the last line is needed.
+ */
+void readfile_bg_wait(buf_T *buf)
+{
+#ifdef HAVE_SYS_MMAN_H
+  mlmap_T     *mm = buf->b_ml.ml_map;
+  bgload_T    *bg;
+
+  if (mm == NULL || (bg = mm->mm_load) == NULL)
+    return;
+  bgload_add(bg, TRUE);
+  if (bg->bg_bad)
+    bgload_rest(bg);
+  if (buf == curbuf)
+    check_cursor_lnum();
+  redraw_buf_later(buf, NOT_VALID);
+#endif
+}
+
+/*
+ * Stop loading "buf" in the background, it is unloaded.
+ */
+void readfile_bg_cancel(buf_T *buf)
+{
+#ifdef HAVE_SYS_MMAN_H
+  bgload_T    *bg;
+
+  for (bg = bgload_list; bg != NULL; bg = bg->bg_next)
+    if (bg->bg_buf == buf) {
+      if (bg->bg_mm != NULL) {
+        bg->bg_bad = TRUE;      /* no BufLoadPost */
+        bgload_detach(bg);
+      }
+      bgload_free(bg);
+      break;
+    }
+#endif
+}
+
+/*
+ * Return how much of "buf" was loaded in percent when it is being loaded in
+ * the background, -1 otherwise.
+ */
+int readfile_bg_percent(buf_T *buf)
+{
+#ifdef HAVE_SYS_MMAN_H
+  mlmap_T     *mm = buf->b_ml.ml_map;
+
+  if (mm != NULL && mm->mm_load != NULL)
+    return (int)(mm->mm_load->bg_line_off / (mm->mm_len / 100 + 1));
+#endif
+  return -1;
 }
 
 #ifdef OPEN_CHR_FILES
@@ -2509,8 +3972,8 @@ buf_write (
   int made_writable = FALSE;                /* 'w' bit has been set */
 #endif
   /* writing everything */
-  int whole = (start == 1 && end == buf->b_ml.ml_line_count);
-  linenr_T old_line_count = buf->b_ml.ml_line_count;
+  int whole;
+  linenr_T old_line_count;
   int attr;
   int fileformat;
   int write_bin;
@@ -2530,6 +3993,15 @@ buf_write (
   context_sha256_T sha_ctx;
   int crypt_method_used;
 
+  /* Writing up to the last line of a file that is loaded in the background
+   * includes the lines still to be loaded. */
+  if (end == buf->b_ml.ml_line_count) {
+    readfile_bg_wait(buf);
+    end = buf->b_ml.ml_line_count;
+  }
+  whole = (start == 1 && end == buf->b_ml.ml_line_count);
+  old_line_count = buf->b_ml.ml_line_count;
+
   if (fname == NULL || *fname == NUL)   /* safety check */
     return FAIL;
   if (buf->b_ml.ml_mfp == NULL) {
@@ -2882,6 +4354,18 @@ buf_write (
     }
   }
 
+#if defined(UNIX) && defined(HAVE_SYS_MMAN_H)
+  /* The lines of a buffer that uses a mapped file are read from it while
+   * writing.  When writing that same file they must be copied first. */
+  if (buf->b_ml.ml_map != NULL && !newfile
+      && st_old.st_dev == buf->b_ml.ml_map->mm_dev
+      && st_old.st_ino == buf->b_ml.ml_map->mm_ino
+      && ml_unmap(buf) == FAIL) {
+    errmsg = (char_u *)_(e_outofmem);
+    goto fail;
+  }
+#endif
+
 #ifdef HAVE_ACL
   /*
    * For systems that support ACL: get the ACL from the original file.
@@ -3611,28 +5095,42 @@ restore_backup:
   s = buffer;
   len = 0;
   for (lnum = start; lnum <= end; ++lnum) {
+    int todo;
+
     /*
-     * The next while loop is done once for each character written.
+     * The next while loop is done once for each part of the line that fits
+     * in the buffer.  The text is copied at once and special characters are
+     * found with memchr(), which checks several bytes at once.
      * Keep it fast!
      */
-    ptr = ml_get_buf(buf, lnum, FALSE) - 1;
+    ptr = ml_get_buf(buf, lnum, FALSE);
+    todo = (int)STRLEN(ptr);
     if (write_undo_file)
-      sha256_update(&sha_ctx, ptr + 1, (UINT32_T)(STRLEN(ptr + 1) + 1));
-    while ((c = *++ptr) != NUL) {
-      if (c == NL)
-        *s = NUL;                       /* replace newlines with NULs */
-      else if (c == CAR && fileformat == EOL_MAC)
-        *s = NL;                        /* Mac: replace CRs with NLs */
-      else
-        *s = c;
-      ++s;
-      if (++len != bufsize)
+      sha256_update(&sha_ctx, ptr, (UINT32_T)(todo + 1));
+    while (todo > 0) {
+      int n = bufsize - len < todo ? bufsize - len : todo;
+      char_u  *p;
+
+      mch_memmove(s, ptr, (size_t)n);
+      /* replace newlines with NULs */
+      for (p = s; (p = memchr(p, NL, (size_t)(s + n - p))) != NULL; ++p)
+        *p = NUL;
+      /* Mac: replace CRs with NLs */
+      if (fileformat == EOL_MAC)
+        for (p = s; (p = memchr(p, CAR, (size_t)(s + n - p))) != NULL; ++p)
+          *p = NL;
+      s += n;
+      ptr += n;
+      todo -= n;
+      len += n;
+      if (len != bufsize)
         continue;
       if (buf_write_bytes(&write_info) == FAIL) {
         end = 0;                        /* write error: break loop */
         break;
       }
       nchars += bufsize;
+      buf_write_grow(&write_info, &buffer, &bufsize);
       s = buffer;
       len = 0;
       write_info.bw_start_lnum = lnum;
@@ -3670,6 +5168,7 @@ restore_backup:
         break;
       }
       nchars += bufsize;
+      buf_write_grow(&write_info, &buffer, &bufsize);
       s = buffer;
       len = 0;
 
@@ -4247,6 +5746,30 @@ static int time_differs(long t1, long t2)
 #endif
 }
 
+/*
+ * Called by buf_write() when the write buffer was flushed.  Without
+ * conversion the buffer is doubled, up to BIGBUFSIZE, so that writing a big
+ * buffer doesn't take a write() call for every 8 Kbyte.  The buffer is empty,
+ * there is nothing to copy.  When out of memory the buffer is kept.
+ */
+static void buf_write_grow(struct bw_info *ip, char_u **bufferp, int *bufsizep)
+{
+  char_u      *p;
+
+  /* The conversion buffer size depends on the write buffer size. */
+  if (ip->bw_conv_buf != NULL || *bufsizep < BUFSIZE
+      || *bufsizep >= BIGBUFSIZE)
+    return;
+  p = lalloc((long_u)*bufsizep * 2, FALSE);
+  if (p == NULL)
+    return;
+  vim_free(*bufferp);
+  *bufferp = p;
+  *bufsizep *= 2;
+  ip->bw_buf = p;
+  ip->bw_len = *bufsizep;
+}
+
 /*
  * Call write() to write a number of bytes to the file.
  * Handles encryption and 'encoding' conversion.
@@ -5999,6 +7522,7 @@ static struct event_name {
   {"BufFilePre",      EVENT_BUFFILEPRE},
   {"BufHidden",       EVENT_BUFHIDDEN},
   {"BufLeave",        EVENT_BUFLEAVE},
+  {"BufLoadPost",     EVENT_BUFLOADPOST},
   {"BufNew",          EVENT_BUFNEW},
   {"BufNewFile",      EVENT_BUFNEWFILE},
   {"BufRead",         EVENT_BUFREADPOST},
@@ -6140,6 +7664,9 @@ static int apply_autocmds_group __ARGS((event_T event, char_u *fname, char_u *
                                         buf,
                                         exarg_T *eap));
 static void auto_next_pat __ARGS((AutoPatCmd *apc, int stop_at_last));
+static int has_autocmd_skip __ARGS((event_T event, char_u *sfname, buf_T *buf,
+                                    int skip_ftdetect));
+static int au_only_sets_filetype __ARGS((AutoCmd *ac, char_u *rt));
 
 
 static event_T last_event;
@@ -7806,10 +9333,28 @@ char_u *getnextac(int c, void *cookie, int indent)
  * in which buffer the file will be opened.
  */
 int has_autocmd(event_T event, char_u *sfname, buf_T *buf)
+{
+  return has_autocmd_skip(event, sfname, buf, FALSE);
+}
+
+/*
+ * Like has_autocmd(), but ignore autocommands in the "filetypedetect" group
+ * that only set the filetype, see au_only_sets_filetype().
+ */
+int has_autocmd_but_ftdetect(event_T event, char_u *sfname, buf_T *buf)
+{
+  return has_autocmd_skip(event, sfname, buf, TRUE);
+}
+
+static int has_autocmd_skip(event_T event, char_u *sfname, buf_T *buf,
+                            int skip_ftdetect)
 {
   AutoPat     *ap;
+  AutoCmd     *ac;
   char_u      *fname;
   char_u      *tail = gettail(sfname);
+  int ftdetect_group = AUGROUP_ERROR;
+  char_u      *rt = NULL;
   int retval = FALSE;
 
   fname = FullName_save(sfname, FALSE);
@@ -7827,6 +9372,9 @@ int has_autocmd(event_T event, char_u *sfname, buf_T *buf)
   forward_slash(fname);
 #endif
 
+  if (skip_ftdetect)
+    ftdetect_group = au_find_group((char_u *)"filetypedetect");
+
   for (ap = first_autopat[(int)event]; ap != NULL; ap = ap->next)
     if (ap->pat != NULL && ap->cmds != NULL
         && (ap->buflocal_nr == 0
@@ -7834,10 +9382,25 @@ int has_autocmd(event_T event, char_u *sfname, buf_T *buf)
                 fname, sfname, tail, ap->allow_dirs)
             : buf != NULL && ap->buflocal_nr == buf->b_fnum
             )) {
+      if (ap->group != AUGROUP_ERROR && ap->group == ftdetect_group) {
+        if (rt == NULL) {
+          rt = expand_env_save((char_u *)"$VIMRUNTIME");
+          if (rt == NULL) {
+            retval = TRUE;
+            break;
+          }
+        }
+        for (ac = ap->cmds; ac != NULL; ac = ac->next)
+          if (ac->cmd != NULL && !au_only_sets_filetype(ac, rt))
+            break;
+        if (ac == NULL)
+          continue;
+      }
       retval = TRUE;
       break;
     }
 
+  vim_free(rt);
   vim_free(fname);
 #ifdef BACKSLASH_IN_FILENAME
   vim_free(sfname);
@@ -7846,6 +9409,44 @@ int has_autocmd(event_T event, char_u *sfname, buf_T *buf)
   return retval;
 }
 
+/*
+ * Return TRUE when autocommand "ac" does nothing but set the filetype:
+ * ":setfiletype {name}" or ":set[local] ft={name}", or it was defined in a
+ * script below "rt", the expanded $VIMRUNTIME.  The distributed filetype.vim
+ * and scripts.vim only detect the filetype.
+ */
+static int au_only_sets_filetype(AutoCmd *ac, char_u *rt)
+{
+  char_u      *p;
+  char_u      *name;
+  size_t len = STRLEN(rt);
+
+  if (ac->scriptID > 0 && len > 0) {
+    name = get_scriptname(ac->scriptID);
+    if (fnamencmp(name, rt, len) == 0 && vim_ispathsep(name[len]))
+      return TRUE;
+  }
+
+  p = skipwhite(ac->cmd);
+  if (*p == ':')
+    p = skipwhite(p + 1);
+  if (!checkforcmd(&p, "setfiletype", 4)) {
+    if (!checkforcmd(&p, "setlocal", 4) && !checkforcmd(&p, "set", 3))
+      return FALSE;
+    if (STRNCMP(p, "ft=", 3) == 0)
+      p += 3;
+    else if (STRNCMP(p, "filetype=", 9) == 0)
+      p += 9;
+    else
+      return FALSE;
+  }
+  /* A single name, nothing else may follow. */
+  name = p;
+  while (ASCII_ISALNUM(*p) || *p == '_' || *p == '.' || *p == '-')
+    ++p;
+  return p > name && *skipwhite(p) == NUL;
+}
+
 /*
  * Function given to ExpandGeneric() to obtain the list of autocommand group
  * names.
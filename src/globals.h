@@ -778,6 +778,9 @@ EXTERN int maptick INIT(= 0);           /* tick for each non-mapped char */
 
 EXTERN char_u chartab[256];             /* table used in charset.c; See
                                            init_chartab() for explanation */
+EXTERN int chartab_tick INIT(= 0);      /* incremented when chartab[] or a
+                                           b_chartab[] is set or the locale
+                                           changes */
 
 EXTERN int must_redraw INIT(= 0);           /* type of redraw necessary */
 EXTERN int skip_redraw INIT(= FALSE);       /* skip redraw once */
@@ -1032,6 +1035,9 @@ EXTERN linenr_T spell_redraw_lnum INIT(= 0);
 /* Set when the cursor line needs to be redrawn. */
 EXTERN int need_cursor_line_redraw INIT(= FALSE);
 
+/* Set by test_override() to make flushing a swap file fail. */
+EXTERN int fail_swapflush_for_testing INIT(= FALSE);
+
 
 #ifdef USE_MCH_ERRMSG
 /* Grow array to collect error messages in until they can be displayed. */
@@ -1137,6 +1143,8 @@ EXTERN char_u e_screenmode[] INIT(= N_(
 EXTERN char_u e_scroll[] INIT(= N_("E49: Invalid scroll size"));
 EXTERN char_u e_shellempty[] INIT(= N_("E91: 'shell' option is empty"));
 EXTERN char_u e_swapclose[] INIT(= N_("E72: Close error on swap file"));
+EXTERN char_u e_swapflush[] INIT(= N_(
+      "E5910: Error while flushing swap file to disk"));
 EXTERN char_u e_tagstack[] INIT(= N_("E73: tag stack empty"));
 EXTERN char_u e_toocompl[] INIT(= N_("E74: Command too complex"));
 EXTERN char_u e_longname[] INIT(= N_("E75: Name too long"));
@@ -34,6 +34,8 @@
 
 #include "vim.h"
 
+#include <uv.h>                 /* for uv_thread_create() */
+
 /*
  * Some systems have the page size in statfs.f_bsize, some in stat.st_blksize
  */
@@ -54,30 +56,45 @@
  */
 
 #define MEMFILE_PAGE_SIZE 4096          /* default page size */
+#define MF_RUN_SIZE     0x40000         /* max bytes written at once by
+                                           mf_sync() */
+#define MF_ARENA_PAGES  64              /* nr of pages in an arena chunk */
 
 static long_u total_mem_used = 0;       /* total memory used for memfiles */
+static mfstats_T total_stats;           /* counters summed over all memfiles */
 
-static void mf_ins_hash __ARGS((memfile_T *, bhdr_T *));
+static int mf_ins_hash __ARGS((memfile_T *, bhdr_T *));
 static void mf_rem_hash __ARGS((memfile_T *, bhdr_T *));
 static bhdr_T *mf_find_hash __ARGS((memfile_T *, blocknr_T));
 static void mf_ins_used __ARGS((memfile_T *, bhdr_T *));
 static void mf_rem_used __ARGS((memfile_T *, bhdr_T *));
 static bhdr_T *mf_release __ARGS((memfile_T *, int));
 static bhdr_T *mf_alloc_bhdr __ARGS((memfile_T *, int));
-static void mf_free_bhdr __ARGS((bhdr_T *));
+static void mf_free_bhdr __ARGS((memfile_T *, bhdr_T *));
+static int mf_alloc_data __ARGS((memfile_T *, bhdr_T *, int));
+static void mf_free_data __ARGS((memfile_T *, bhdr_T *));
 static void mf_ins_free __ARGS((memfile_T *, bhdr_T *));
 static bhdr_T *mf_rem_free __ARGS((memfile_T *));
 static int mf_read __ARGS((memfile_T *, bhdr_T *));
 static int mf_write __ARGS((memfile_T *, bhdr_T *));
 static int mf_write_block __ARGS((memfile_T *mfp, bhdr_T *hp, off_t offset,
                                   unsigned size));
+static int mf_write_run __ARGS((memfile_T *mfp, bhdr_T **hpp, int count));
+static int mf_bnum_compare __ARGS((const void *s1, const void *s2));
+static int mf_sync_wanted __ARGS((bhdr_T *hp, int flags));
+static int mf_sync_stop __ARGS((int flags));
+#ifdef UNIX
+static int mf_flush_async __ARGS((memfile_T *mfp));
+static void mf_flush_wait __ARGS((memfile_T *mfp));
+static void mf_flush_thread __ARGS((void *arg));
+#endif
 static int mf_trans_add __ARGS((memfile_T *, bhdr_T *));
 static void mf_do_open __ARGS((memfile_T *, char_u *, int));
 static void mf_hash_init __ARGS((mf_hashtab_T *));
 static void mf_hash_free __ARGS((mf_hashtab_T *));
 static void mf_hash_free_all __ARGS((mf_hashtab_T *));
 static mf_hashitem_T *mf_hash_find __ARGS((mf_hashtab_T *, blocknr_T));
-static void mf_hash_add_item __ARGS((mf_hashtab_T *, mf_hashitem_T *));
+static int mf_hash_add_item __ARGS((mf_hashtab_T *, mf_hashitem_T *));
 static void mf_hash_rem_item __ARGS((mf_hashtab_T *, mf_hashitem_T *));
 static int mf_hash_grow __ARGS((mf_hashtab_T *));
 
@@ -140,6 +157,10 @@ memfile_T *mf_open(char_u *fname, int flags)
   mfp->mf_used_last = NULL;
   mfp->mf_dirty = FALSE;
   mfp->mf_used_count = 0;
+  mfp->mf_arena = NULL;
+  mfp->mf_arena_free = NULL;
+  mfp->mf_arena_used = 0;
+  vim_memset(&mfp->mf_stats, 0, sizeof(mfstats_T));
   mf_hash_init(&mfp->mf_hash);
   mf_hash_init(&mfp->mf_trans);
   mfp->mf_page_size = MEMFILE_PAGE_SIZE;
@@ -218,20 +239,34 @@ int mf_open_file(memfile_T *mfp, char_u *fname)
 void mf_close(memfile_T *mfp, int del_file)
 {
   bhdr_T      *hp, *nextp;
+  char_u      *p;
 
   if (mfp == NULL)                  /* safety check */
     return;
+#ifdef UNIX
+  mf_flush_wait(mfp);
+#endif
   if (mfp->mf_fd >= 0) {
     if (close(mfp->mf_fd) < 0)
       EMSG(_(e_swapclose));
   }
   if (del_file && mfp->mf_fname != NULL)
     mch_remove(mfp->mf_fname);
-  /* free entries in used list */
+  /* free entries in used list, the arena is freed at once below */
   for (hp = mfp->mf_used_first; hp != NULL; hp = nextp) {
     total_mem_used -= hp->bh_page_count * mfp->mf_page_size;
     nextp = hp->bh_next;
-    mf_free_bhdr(hp);
+    if (hp->bh_arena)
+      total_mem_used += mfp->mf_page_size;  /* counted with its chunk */
+    else
+      vim_free(hp->bh_data);
+    vim_free(hp);
+  }
+  while (mfp->mf_arena != NULL) {
+    p = mfp->mf_arena;
+    mfp->mf_arena = *(char_u **)(p + MF_ARENA_PAGES * mfp->mf_page_size);
+    vim_free(p);
+    total_mem_used -= MF_ARENA_PAGES * mfp->mf_page_size;
   }
   while (mfp->mf_free_first != NULL)        /* free entries in free list */
     vim_free(mf_rem_free(mfp));
@@ -267,6 +302,9 @@ mf_close_file (
     /* TODO: should check if all blocks are really in core */
   }
 
+#ifdef UNIX
+  mf_flush_wait(mfp);
+#endif
   if (close(mfp->mf_fd) < 0)                    /* close the file */
     EMSG(_(e_swapclose));
   mfp->mf_fd = -1;
@@ -301,7 +339,6 @@ bhdr_T *mf_new(memfile_T *mfp, int negative, int page_count)
 {
   bhdr_T      *hp;      /* new bhdr_T */
   bhdr_T      *freep;   /* first block in free list */
-  char_u      *p;
 
   /*
    * If we reached the maximum size for the used memory blocks, release one
@@ -334,10 +371,9 @@ bhdr_T *mf_new(memfile_T *mfp, int negative, int page_count)
       freep->bh_bnum += page_count;
       freep->bh_page_count -= page_count;
     } else if (hp == NULL)   {      /* need to allocate memory for this block */
-      if ((p = (char_u *)alloc(mfp->mf_page_size * page_count)) == NULL)
+      if (mf_alloc_data(mfp, freep, page_count) == FAIL)
         return NULL;
       hp = mf_rem_free(mfp);
-      hp->bh_data = p;
     } else   {              /* use the number, remove entry from free list */
       freep = mf_rem_free(mfp);
       hp->bh_bnum = freep->bh_bnum;
@@ -357,8 +393,13 @@ bhdr_T *mf_new(memfile_T *mfp, int negative, int page_count)
   hp->bh_flags = BH_LOCKED | BH_DIRTY;          /* new block is always dirty */
   mfp->mf_dirty = TRUE;
   hp->bh_page_count = page_count;
+  if (mf_ins_hash(mfp, hp) == FAIL) {
+    if (hp->bh_bnum < 0)
+      mfp->mf_neg_count--;
+    mf_free_bhdr(mfp, hp);
+    return NULL;
+  }
   mf_ins_used(mfp, hp);
-  mf_ins_hash(mfp, hp);
 
   /*
    * Init the data to all zero, to avoid reading uninitialized data.
@@ -386,7 +427,7 @@ bhdr_T *mf_get(memfile_T *mfp, blocknr_T nr, int page_count)
    * see if it is in the cache
    */
   hp = mf_find_hash(mfp, nr);
-  if (hp == NULL) {     /* not in the hash list */
+  if (hp == NULL) {     /* not in the hash table */
     if (nr < 0 || nr >= mfp->mf_infile_count)       /* can't be in the file */
       return NULL;
 
@@ -404,19 +445,23 @@ bhdr_T *mf_get(memfile_T *mfp, blocknr_T nr, int page_count)
     hp->bh_bnum = nr;
     hp->bh_flags = 0;
     hp->bh_page_count = page_count;
-    if (mf_read(mfp, hp) == FAIL) {         /* cannot read the block! */
-      mf_free_bhdr(hp);
+    if (mf_read(mfp, hp) == FAIL        /* cannot read the block! */
+        || mf_ins_hash(mfp, hp) == FAIL) {
+      mf_free_bhdr(mfp, hp);
       return NULL;
     }
+    ++mfp->mf_stats.mst_misses;
+    ++total_stats.mst_misses;
+    hp->bh_flags = BH_LOCKED;
+    mf_ins_used(mfp, hp);         /* put in front of used list */
   } else   {
-    mf_rem_used(mfp, hp);       /* remove from list, insert in front below */
-    mf_rem_hash(mfp, hp);
+    /* Don't move the block in the used list, only mark it as referenced.
+     * mf_release() gives it a second chance. */
+    ++mfp->mf_stats.mst_hits;
+    ++total_stats.mst_hits;
+    hp->bh_flags |= BH_LOCKED | BH_REF;
   }
 
-  hp->bh_flags |= BH_LOCKED;
-  mf_ins_used(mfp, hp);         /* put in front of used list */
-  mf_ins_hash(mfp, hp);         /* put in front of hash list */
-
   return hp;
 }
 
@@ -451,8 +496,8 @@ void mf_put(memfile_T *mfp, bhdr_T *hp, int dirty, int infile)
  */
 void mf_free(memfile_T *mfp, bhdr_T *hp)
 {
-  vim_free(hp->bh_data);        /* free the memory */
-  mf_rem_hash(mfp, hp);         /* get *hp out of the hash list */
+  mf_free_data(mfp, hp);        /* free the memory */
+  mf_rem_hash(mfp, hp);         /* get *hp out of the hash table */
   mf_rem_used(mfp, hp);         /* get *hp out of the used list */
   if (hp->bh_bnum < 0) {
     vim_free(hp);               /* don't want negative numbers in free list */
@@ -481,6 +526,10 @@ static unsigned long fdtofh(int filedescriptor)                          {
  *  MFS_FLUSH	Make sure buffers are flushed to disk, so they will survive a
  *		system crash.
  *  MFS_ZERO	Only write block 0.
+ *  MFS_ASYNC	With MFS_FLUSH: flush buffers to disk in another thread, don't
+ *		wait for it.  The blocks are written before returning.
+ *
+ * Neighbouring dirty blocks are written with one write() call.
  *
  * Return FAIL for failure, OK otherwise
  */
@@ -488,6 +537,12 @@ int mf_sync(memfile_T *mfp, int flags)
 {
   int status;
   bhdr_T      *hp;
+  bhdr_T      **blocks;
+  int count;
+  int i;
+  int n;
+  int pages;
+  int done;
 #if defined(SYNC_DUP_CLOSE) && !defined(MSDOS)
   int fd;
 #endif
@@ -503,43 +558,97 @@ int mf_sync(memfile_T *mfp, int flags)
   got_int = FALSE;
 
   /*
-   * sync from last to first (may reduce the probability of an inconsistent
-   * file) If a write fails, it is very likely caused by a full filesystem.
+   * Write the dirty blocks in the order of the file, neighbouring blocks with
+   * one write() call.  Negative blocks first get a number in the file.
+   * If a write fails, it is very likely caused by a full filesystem.
    * Then we only try to write blocks within the existing file. If that also
    * fails then we give up.
    */
   status = OK;
+  count = 0;
   for (hp = mfp->mf_used_last; hp != NULL; hp = hp->bh_prev)
-    if (((flags & MFS_ALL) || hp->bh_bnum >= 0)
-        && (hp->bh_flags & BH_DIRTY)
-        && (status == OK || (hp->bh_bnum >= 0
-                             && hp->bh_bnum < mfp->mf_infile_count))) {
-      if ((flags & MFS_ZERO) && hp->bh_bnum != 0)
+    if (mf_sync_wanted(hp, flags))
+      ++count;
+  blocks = NULL;
+  if (count > 0)
+    blocks = (bhdr_T **)lalloc((long_u)(count * sizeof(bhdr_T *)), FALSE);
+
+  if (blocks == NULL) {
+    /* Nothing to write or out of memory: sync from last to first, one block
+     * at a time. */
+    for (hp = mfp->mf_used_last; hp != NULL; hp = hp->bh_prev)
+      if (mf_sync_wanted(hp, flags)
+          && (status == OK || (hp->bh_bnum >= 0
+                               && hp->bh_bnum < mfp->mf_infile_count))) {
+        if (mf_write(mfp, hp) == FAIL) {
+          if (status == FAIL)           /* double error: quit syncing */
+            break;
+          status = FAIL;
+        }
+        if (mf_sync_stop(flags))
+          break;
+      }
+    done = (hp == NULL);
+  } else   {
+    n = 0;
+    for (hp = mfp->mf_used_last; hp != NULL; hp = hp->bh_prev)
+      if (mf_sync_wanted(hp, flags)) {
+        if (hp->bh_bnum < 0 && mf_trans_add(mfp, hp) == FAIL)
+          status = FAIL;
+        else
+          blocks[n++] = hp;
+      }
+    qsort((void *)blocks, (size_t)n, sizeof(bhdr_T *), mf_bnum_compare);
+
+    for (i = 0; i < n; i += count) {
+      hp = blocks[i];
+      count = 1;
+      /* May have been written by mf_write() to fill a gap.  After an error
+       * only write blocks within the existing file. */
+      if (!(hp->bh_flags & BH_DIRTY)
+          || (status == FAIL && hp->bh_bnum >= mfp->mf_infile_count))
         continue;
-      if (mf_write(mfp, hp) == FAIL) {
+      /* A block beyond the end of the file is written by mf_write(), it
+       * fills the gap. */
+      if (status == OK && hp->bh_bnum <= mfp->mf_infile_count) {
+        pages = hp->bh_page_count;
+        while (i + count < n
+               && blocks[i + count]->bh_bnum
+               == blocks[i + count - 1]->bh_bnum
+               + blocks[i + count - 1]->bh_page_count
+               && (blocks[i + count]->bh_flags & BH_DIRTY)
+               && (long)(pages + blocks[i + count]->bh_page_count)
+               * mfp->mf_page_size <= MF_RUN_SIZE) {
+          pages += blocks[i + count]->bh_page_count;
+          ++count;
+        }
+      }
+      if (mf_write_run(mfp, blocks + i, count) == FAIL) {
         if (status == FAIL)             /* double error: quit syncing */
           break;
         status = FAIL;
       }
-      if (flags & MFS_STOP) {
-        /* Stop when char available now. */
-        if (ui_char_avail())
-          break;
-      } else
-        ui_breakcheck();
-      if (got_int)
+      if (mf_sync_stop(flags)) {
+        i += count;
         break;
+      }
     }
+    done = (i >= n);
+    vim_free(blocks);
+  }
 
   /*
    * If the whole list is flushed, the memfile is not dirty anymore.
    * In case of an error this flag is also set, to avoid trying all the time.
    */
-  if (hp == NULL || status == FAIL)
+  if (done || status == FAIL)
     mfp->mf_dirty = FALSE;
 
   if ((flags & MFS_FLUSH) && *p_sws != NUL) {
 #if defined(UNIX)
+    if ((flags & MFS_ASYNC) && mf_flush_async(mfp) == OK) {
+      /* flushed by another thread */
+    } else
 # ifdef HAVE_FSYNC
     /*
      * most Unixes have the very useful fsync() function, just what we need.
@@ -551,7 +660,7 @@ int mf_sync(memfile_T *mfp, int flags)
      * sync from the system itself).
      */
     if (STRCMP(p_sws, "fsync") == 0) {
-      if (fsync(mfp->mf_fd))
+      if (fsync(mfp->mf_fd) != 0 || fail_swapflush_for_testing)
         status = FAIL;
     } else
 # endif
@@ -578,6 +687,239 @@ int mf_sync(memfile_T *mfp, int flags)
   return status;
 }
 
+/*
+ * Return TRUE if block "hp" is to be written by mf_sync() with "flags".
+ */
+static int mf_sync_wanted(bhdr_T *hp, int flags)
+{
+  return ((flags & MFS_ALL) || hp->bh_bnum >= 0)
+         && (hp->bh_flags & BH_DIRTY)
+         && (!(flags & MFS_ZERO) || hp->bh_bnum == 0);
+}
+
+/*
+ * Return TRUE if mf_sync() with "flags" is to stop writing blocks.
+ */
+static int mf_sync_stop(int flags)
+{
+  if (flags & MFS_STOP) {
+    /* Stop when char available now. */
+    if (ui_char_avail())
+      return TRUE;
+  } else
+    ui_breakcheck();
+  return got_int;
+}
+
+/*
+ * Compare the block numbers of two blocks, for qsort().
+ */
+static int mf_bnum_compare(const void *s1, const void *s2)
+{
+  blocknr_T n1 = (*(bhdr_T **)s1)->bh_bnum;
+  blocknr_T n2 = (*(bhdr_T **)s2)->bh_bnum;
+
+  return n1 == n2 ? 0 : n1 < n2 ? -1 : 1;
+}
+
+#ifdef UNIX
+/*
+ * Flushing a swap file to disk may take a long time on a slow or network
+ * filesystem.  For mf_sync() with MFS_ASYNC this is done by a thread, so
+ * that typing doesn't stall.  The blocks are written by the main thread
+ * before a job is queued, the thread only does fsync() or sync().  Thus
+ * after a crash of Vim the swap file is the same as before.
+ */
+# define MF_FLUSH_MAX   16      /* max nr of queued jobs */
+
+typedef struct {
+  memfile_T   *fj_mfp;          /* only compared */
+  int fj_fd;                    /* dup() of the swap file descriptor or -1
+                                 * for sync() */
+} mf_flushjob_T;
+
+static uv_thread_t flush_thread;
+static uv_mutex_t flush_mutex;  /* protects the items below */
+static uv_cond_t flush_cond;    /* signalled when a job was added */
+static uv_cond_t flush_done_cond;       /* signalled when a job was done */
+static int flush_started = FALSE;       /* thread is running */
+static mf_flushjob_T flush_jobs[MF_FLUSH_MAX];  /* queued jobs, the first
+                                                 * one may be in progress */
+static int flush_count = 0;     /* nr of items in flush_jobs[] */
+static int flush_busy = FALSE;  /* flush_jobs[0] is in progress */
+static int flush_failed = FALSE;        /* fsync() of a job failed */
+static int flush_stop = FALSE;  /* thread exits when the queue is empty */
+
+/*
+ * Queue flushing swap file "mfp" to disk.
+ * Returns FAIL when it must be done right away: an earlier flush failed,
+ * the queue is full or the thread can't be started.
+ */
+static int mf_flush_async(memfile_T *mfp)
+{
+  int i;
+  int fd = -1;
+  int retval = FAIL;
+
+  if (!flush_started) {
+    if (uv_mutex_init(&flush_mutex) != 0)
+      return FAIL;
+    if (uv_cond_init(&flush_cond) != 0) {
+      uv_mutex_destroy(&flush_mutex);
+      return FAIL;
+    }
+    if (uv_cond_init(&flush_done_cond) != 0) {
+      uv_cond_destroy(&flush_cond);
+      uv_mutex_destroy(&flush_mutex);
+      return FAIL;
+    }
+    if (uv_thread_create(&flush_thread, mf_flush_thread, NULL) != 0) {
+      uv_cond_destroy(&flush_done_cond);
+      uv_cond_destroy(&flush_cond);
+      uv_mutex_destroy(&flush_mutex);
+      return FAIL;
+    }
+    flush_started = TRUE;
+  }
+
+  uv_mutex_lock(&flush_mutex);
+  if (flush_failed) {
+    /* An earlier flush failed: report it and flush now. */
+    flush_failed = FALSE;
+    uv_mutex_unlock(&flush_mutex);
+    EMSG(_(e_swapflush));
+    return FAIL;
+  } else {
+    /* A job that was not started yet also flushes what was written now. */
+    for (i = flush_busy ? 1 : 0; i < flush_count; ++i)
+      if (flush_jobs[i].fj_mfp == mfp)
+        break;
+    if (i < flush_count)
+      retval = OK;
+    else if (flush_count < MF_FLUSH_MAX) {
+# ifdef HAVE_FSYNC
+      if (STRCMP(p_sws, "fsync") == 0)
+        fd = dup(mfp->mf_fd);
+      if (fd >= 0 || STRCMP(p_sws, "fsync") != 0)
+# endif
+      {
+        flush_jobs[flush_count].fj_mfp = mfp;
+        flush_jobs[flush_count].fj_fd = fd;
+        ++flush_count;
+        uv_cond_signal(&flush_cond);
+        retval = OK;
+      }
+    }
+  }
+  uv_mutex_unlock(&flush_mutex);
+  return retval;
+}
+
+/*
+ * Called when memfile "mfp" is closed: wait for its queued jobs to be done.
+ * Gives an error message when a flush failed.
+ */
+static void mf_flush_wait(memfile_T *mfp)
+{
+  int i;
+  int failed;
+
+  if (!flush_started)
+    return;
+  uv_mutex_lock(&flush_mutex);
+  for (;; ) {
+    for (i = 0; i < flush_count; ++i)
+      if (flush_jobs[i].fj_mfp == mfp)
+        break;
+    if (i == flush_count)
+      break;
+    uv_cond_wait(&flush_done_cond, &flush_mutex);
+  }
+  failed = flush_failed;
+  flush_failed = FALSE;
+  uv_mutex_unlock(&flush_mutex);
+  if (failed)
+    EMSG(_(e_swapflush));
+}
+
+/*
+ * The thread flushing swap files.  It must not use anything but the job
+ * queue.
+ */
+static void mf_flush_thread(void *arg)
+{
+  mf_flushjob_T job;
+  int failed;
+  sigset_t set;
+
+  /* Signals are handled by the main thread. */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  uv_mutex_lock(&flush_mutex);
+  for (;; ) {
+    while (flush_count == 0 && !flush_stop)
+      uv_cond_wait(&flush_cond, &flush_mutex);
+    if (flush_count == 0)
+      break;
+    job = flush_jobs[0];
+    flush_busy = TRUE;
+    uv_mutex_unlock(&flush_mutex);
+
+    failed = FALSE;
+    if (job.fj_fd >= 0) {
+# ifdef HAVE_FSYNC
+      failed = fsync(job.fj_fd) != 0;
+# endif
+      failed |= fail_swapflush_for_testing;
+      close(job.fj_fd);
+    } else {
+# if defined(__OPENNT) || defined(__TANDEM)
+      fflush(NULL);
+# else
+      sync();
+# endif
+    }
+
+    uv_mutex_lock(&flush_mutex);
+    if (failed)
+      flush_failed = TRUE;
+    --flush_count;
+    mch_memmove(flush_jobs, flush_jobs + 1,
+        (size_t)flush_count * sizeof(mf_flushjob_T));
+    flush_busy = FALSE;
+    uv_cond_broadcast(&flush_done_cond);
+  }
+  uv_mutex_unlock(&flush_mutex);
+}
+#endif
+
+/*
+ * Called before exiting: wait for the swap files queued by mf_sync() with
+ * MFS_ASYNC to be flushed and stop the thread doing that.
+ * Gives an error message when a flush failed.
+ */
+void mf_flush_stop(void)
+{
+#ifdef UNIX
+  if (!flush_started)
+    return;
+  uv_mutex_lock(&flush_mutex);
+  flush_stop = TRUE;
+  uv_cond_signal(&flush_cond);
+  uv_mutex_unlock(&flush_mutex);
+  uv_thread_join(&flush_thread);
+  uv_cond_destroy(&flush_done_cond);
+  uv_cond_destroy(&flush_cond);
+  uv_mutex_destroy(&flush_mutex);
+  flush_started = FALSE;
+  flush_stop = FALSE;
+  if (flush_failed)
+    EMSG(_(e_swapflush));
+  flush_failed = FALSE;
+#endif
+}
+
 /*
  * For all blocks in memory file *mfp that have a positive block number set
  * the dirty flag.  These are blocks that need to be written to a newly
@@ -594,15 +936,16 @@ void mf_set_dirty(memfile_T *mfp)
 }
 
 /*
- * insert block *hp in front of hashlist of memfile *mfp
+ * insert block *hp in the hash table of memfile *mfp
+ * Returns FAIL when out of memory.
  */
-static void mf_ins_hash(memfile_T *mfp, bhdr_T *hp)
+static int mf_ins_hash(memfile_T *mfp, bhdr_T *hp)
 {
-  mf_hash_add_item(&mfp->mf_hash, (mf_hashitem_T *)hp);
+  return mf_hash_add_item(&mfp->mf_hash, (mf_hashitem_T *)hp);
 }
 
 /*
- * remove block *hp from hashlist of memfile list *mfp
+ * remove block *hp from the hash table of memfile *mfp
  */
 static void mf_rem_hash(memfile_T *mfp, bhdr_T *hp)
 {
@@ -610,7 +953,7 @@ static void mf_rem_hash(memfile_T *mfp, bhdr_T *hp)
 }
 
 /*
- * look in hash lists of memfile *mfp for block header with number 'nr'
+ * look in the hash table of memfile *mfp for block header with number 'nr'
  */
 static bhdr_T *mf_find_hash(memfile_T *mfp, blocknr_T nr)
 {
@@ -651,8 +994,9 @@ static void mf_rem_used(memfile_T *mfp, bhdr_T *hp)
 }
 
 /*
- * Release the least recently used block from the used list if the number
- * of used memory blocks gets to big.
+ * Release the oldest unreferenced block from the used list if the number
+ * of used memory blocks gets to big.  A block that was referenced since it
+ * was put in the used list is moved to the front and gets a second chance.
  *
  * Return the block header to the caller, including the memory block, so
  * it can be re-used. Make sure the page_count is right.
@@ -660,6 +1004,7 @@ static void mf_rem_used(memfile_T *mfp, bhdr_T *hp)
 static bhdr_T *mf_release(memfile_T *mfp, int page_count)
 {
   bhdr_T      *hp;
+  bhdr_T      *prev;
   int need_release;
   buf_T       *buf;
 
@@ -698,9 +1043,21 @@ static bhdr_T *mf_release(memfile_T *mfp, int page_count)
   if (mfp->mf_fd < 0 || !need_release)
     return NULL;
 
-  for (hp = mfp->mf_used_last; hp != NULL; hp = hp->bh_prev)
-    if (!(hp->bh_flags & BH_LOCKED))
+  for (hp = mfp->mf_used_last; hp != NULL; hp = prev) {
+    prev = hp->bh_prev;
+    if (hp->bh_flags & BH_LOCKED)
+      continue;
+    if (!(hp->bh_flags & BH_REF))
+      break;
+    /* Referenced: clear the flag and move it to the front.  The scan
+     * reaches it again if nothing else can be released.  When it already is
+     * the first block use it right away. */
+    hp->bh_flags &= ~BH_REF;
+    if (prev == NULL)
       break;
+    mf_rem_used(mfp, hp);
+    mf_ins_used(mfp, hp);
+  }
   if (hp == NULL)       /* not a single one that can be released */
     return NULL;
 
@@ -713,14 +1070,16 @@ static bhdr_T *mf_release(memfile_T *mfp, int page_count)
 
   mf_rem_used(mfp, hp);
   mf_rem_hash(mfp, hp);
+  ++mfp->mf_stats.mst_evictions;
+  ++total_stats.mst_evictions;
 
   /*
    * If a bhdr_T is returned, make sure that the page_count of bh_data is
    * right
    */
   if (hp->bh_page_count != page_count) {
-    vim_free(hp->bh_data);
-    if ((hp->bh_data = alloc(mfp->mf_page_size * page_count)) == NULL) {
+    mf_free_data(mfp, hp);
+    if (mf_alloc_data(mfp, hp, page_count) == FAIL) {
       vim_free(hp);
       return NULL;
     }
@@ -756,7 +1115,9 @@ int mf_release_all(void)         {
                   || mf_write(mfp, hp) != FAIL)) {
             mf_rem_used(mfp, hp);
             mf_rem_hash(mfp, hp);
-            mf_free_bhdr(hp);
+            mf_free_bhdr(mfp, hp);
+            ++mfp->mf_stats.mst_evictions;
+            ++total_stats.mst_evictions;
             hp = mfp->mf_used_last;             /* re-start, list was changed */
             retval = TRUE;
           } else
@@ -776,8 +1137,7 @@ static bhdr_T *mf_alloc_bhdr(memfile_T *mfp, int page_count)
   bhdr_T      *hp;
 
   if ((hp = (bhdr_T *)alloc((unsigned)sizeof(bhdr_T))) != NULL) {
-    if ((hp->bh_data = (char_u *)alloc(mfp->mf_page_size * page_count))
-        == NULL) {
+    if (mf_alloc_data(mfp, hp, page_count) == FAIL) {
       vim_free(hp);                 /* not enough memory */
       return NULL;
     }
@@ -789,12 +1149,76 @@ static bhdr_T *mf_alloc_bhdr(memfile_T *mfp, int page_count)
 /*
  * Free a block header and the block of memory for it
  */
-static void mf_free_bhdr(bhdr_T *hp)
+static void mf_free_bhdr(memfile_T *mfp, bhdr_T *hp)
 {
-  vim_free(hp->bh_data);
+  mf_free_data(mfp, hp);
   vim_free(hp);
 }
 
+/*
+ * Allocate the memory for "page_count" pages of block "hp".
+ *
+ * A buffer without a swap file, because 'swapfile' is off or 'updatecount'
+ * is zero, keeps all blocks in memory.  Its single page blocks are taken
+ * from chunks of MF_ARENA_PAGES pages, freed pages are reused and the chunks
+ * are only freed by mf_close().  This avoids an alloc() and vim_free() for
+ * every block when filling and wiping out such a buffer.  Freed pages are
+ * also reused after a swap file was opened.
+ * A whole chunk is counted in total_mem_used when it is allocated.  A page
+ * taken from it is subtracted, it is counted again by mf_ins_used().
+ * Returns FAIL when out of memory.
+ */
+static int mf_alloc_data(memfile_T *mfp, bhdr_T *hp, int page_count)
+{
+  char_u      *p;
+
+  hp->bh_arena = FALSE;
+  if (page_count != 1 || (mfp->mf_arena_free == NULL
+                          && (mfp->mf_fd >= 0 || mfp->mf_buffer == NULL
+                              || (mfp->mf_buffer->b_p_swf && p_uc != 0)))) {
+    hp->bh_data = (char_u *)alloc(mfp->mf_page_size * page_count);
+    return hp->bh_data == NULL ? FAIL : OK;
+  }
+
+  if (mfp->mf_arena_free != NULL) {     /* reuse a freed page */
+    hp->bh_data = mfp->mf_arena_free;
+    mfp->mf_arena_free = *(char_u **)hp->bh_data;
+  } else   {
+    if (mfp->mf_arena == NULL || mfp->mf_arena_used == MF_ARENA_PAGES) {
+      /* The chunks are linked with a pointer after the last page. */
+      p = lalloc((long_u)(MF_ARENA_PAGES * mfp->mf_page_size
+                          + sizeof(char_u *)), TRUE);
+      if (p == NULL)
+        return FAIL;
+      *(char_u **)(p + MF_ARENA_PAGES * mfp->mf_page_size) = mfp->mf_arena;
+      mfp->mf_arena = p;
+      mfp->mf_arena_used = 0;
+      total_mem_used += MF_ARENA_PAGES * mfp->mf_page_size;
+    }
+    hp->bh_data = mfp->mf_arena
+                  + mfp->mf_arena_used++ * mfp->mf_page_size;
+  }
+  hp->bh_arena = TRUE;
+  total_mem_used -= mfp->mf_page_size;
+  return OK;
+}
+
+/*
+ * Free the memory of block "hp".  A page of the arena stays allocated, thus
+ * it is still counted in total_mem_used.
+ */
+static void mf_free_data(memfile_T *mfp, bhdr_T *hp)
+{
+  if (hp->bh_arena) {
+    *(char_u **)hp->bh_data = mfp->mf_arena_free;
+    mfp->mf_arena_free = hp->bh_data;
+    hp->bh_arena = FALSE;
+    total_mem_used += mfp->mf_page_size;
+  } else
+    vim_free(hp->bh_data);
+  hp->bh_data = NULL;
+}
+
 /*
  * insert entry *hp in the free list
  */
@@ -876,7 +1300,7 @@ static int mf_write(memfile_T *mfp, bhdr_T *hp)
   /*
    * We don't want gaps in the file. Write the blocks in front of *hp
    * to extend the file.
-   * If block 'mf_infile_count' is not in the hash list, it has been
+   * If block 'mf_infile_count' is not in the hash table, it has been
    * freed. Fill the space in the file with data from the current block.
    */
   for (;; ) {
@@ -940,6 +1364,12 @@ static int mf_write_block(memfile_T *mfp, bhdr_T *hp, off_t offset, unsigned siz
 
   if ((unsigned)write_eintr(mfp->mf_fd, data, size) != size)
     result = FAIL;
+  else {
+    mfp->mf_stats.mst_written += size;
+    total_stats.mst_written += size;
+    ++mfp->mf_stats.mst_writes;
+    ++total_stats.mst_writes;
+  }
 
   if (data != hp->bh_data)
     vim_free(data);
@@ -947,6 +1377,80 @@ static int mf_write_block(memfile_T *mfp, bhdr_T *hp, off_t offset, unsigned siz
   return result;
 }
 
+/*
+ * Write "count" blocks "hpp" that follow each other in the file with one
+ * write() call.  The first block must not be beyond the end of the file.
+ * Return FAIL or OK.
+ */
+static int mf_write_run(memfile_T *mfp, bhdr_T **hpp, int count)
+{
+  off_t offset;
+  unsigned page_size = mfp->mf_page_size;
+  unsigned size = 0;
+  unsigned len;
+  char_u      *buf;
+  char_u      *data;
+  blocknr_T end;
+  int i;
+  int result = OK;
+
+  if (count == 1)
+    return mf_write(mfp, hpp[0]);
+
+  for (i = 0; i < count; ++i)
+    size += page_size * hpp[i]->bh_page_count;
+  buf = lalloc((long_u)size, FALSE);
+  if (buf == NULL) {
+    /* out of memory: write the blocks one by one */
+    for (i = 0; i < count; ++i)
+      if (mf_write(mfp, hpp[i]) == FAIL)
+        return FAIL;
+    return OK;
+  }
+
+  offset = (off_t)page_size * hpp[0]->bh_bnum;
+  size = 0;
+  for (i = 0; i < count; ++i) {
+    len = page_size * hpp[i]->bh_page_count;
+    data = hpp[i]->bh_data;
+    /* Encrypt if 'key' is set and this is a data block. */
+    if (*mfp->mf_buffer->b_p_key != NUL) {
+      data = ml_encrypt_data(mfp, data, offset + size, len);
+      if (data == NULL) {
+        vim_free(buf);
+        return FAIL;
+      }
+    }
+    mch_memmove(buf + size, data, (size_t)len);
+    if (data != hpp[i]->bh_data)
+      vim_free(data);
+    size += len;
+  }
+
+  if (lseek(mfp->mf_fd, offset, SEEK_SET) != offset) {
+    PERROR(_("E296: Seek error in swap file write"));
+    result = FAIL;
+  } else if ((unsigned)write_eintr(mfp->mf_fd, buf, size) != size) {
+    if (!did_swapwrite_msg)
+      EMSG(_("E297: Write error in swap file"));
+    did_swapwrite_msg = TRUE;
+    result = FAIL;
+  } else {
+    did_swapwrite_msg = FALSE;
+    mfp->mf_stats.mst_written += size;
+    total_stats.mst_written += size;
+    ++mfp->mf_stats.mst_writes;
+    ++total_stats.mst_writes;
+    for (i = 0; i < count; ++i)
+      hpp[i]->bh_flags &= ~BH_DIRTY;
+    end = hpp[0]->bh_bnum + (blocknr_T)(size / page_size);
+    if (end > mfp->mf_infile_count)
+      mfp->mf_infile_count = end;
+  }
+  vim_free(buf);
+  return result;
+}
+
 /*
  * Make block number for *hp positive and add it to the translation list
  *
@@ -965,6 +1469,13 @@ static int mf_trans_add(memfile_T *mfp, bhdr_T *hp)
   if ((np = (NR_TRANS *)alloc((unsigned)sizeof(NR_TRANS))) == NULL)
     return FAIL;
 
+  /* Insert "np" into "mf_trans" hashtable with key "np->nt_old_bnum" */
+  np->nt_old_bnum = hp->bh_bnum;
+  if (mf_hash_add_item(&mfp->mf_trans, (mf_hashitem_T *)np) == FAIL) {
+    vim_free(np);
+    return FAIL;
+  }
+
   /*
    * Get a new number for the block.
    * If the first item in the free list has sufficient pages, use its number
@@ -990,21 +1501,18 @@ static int mf_trans_add(memfile_T *mfp, bhdr_T *hp)
     mfp->mf_blocknr_max += page_count;
   }
 
-  np->nt_old_bnum = hp->bh_bnum;            /* adjust number */
   np->nt_new_bnum = new_bnum;
 
-  mf_rem_hash(mfp, hp);                     /* remove from old hash list */
+  /* Removing from the hash table leaves room, inserting can't fail. */
+  mf_rem_hash(mfp, hp);
   hp->bh_bnum = new_bnum;
-  mf_ins_hash(mfp, hp);                     /* insert in new hash list */
-
-  /* Insert "np" into "mf_trans" hashtable with key "np->nt_old_bnum" */
-  mf_hash_add_item(&mfp->mf_trans, (mf_hashitem_T *)np);
+  (void)mf_ins_hash(mfp, hp);
 
   return OK;
 }
 
 /*
- * Lookup a translation from the trans lists and delete the entry
+ * Lookup a translation from the trans table and delete the entry
  *
  * Return the positive new number when found, the old number when not found
  */
@@ -1021,7 +1529,7 @@ blocknr_T mf_trans_del(memfile_T *mfp, blocknr_T old_nr)
   mfp->mf_neg_count--;
   new_bnum = np->nt_new_bnum;
 
-  /* remove entry from the trans list */
+  /* remove entry from the trans table */
   mf_hash_rem_item(&mfp->mf_trans, (mf_hashitem_T *)np);
 
   vim_free(np);
@@ -1060,6 +1568,21 @@ int mf_need_trans(memfile_T *mfp)
   return mfp->mf_fname != NULL && mfp->mf_neg_count > 0;
 }
 
+/*
+ * Get the block cache counters of memfile "mfp" in "stats", or the counters
+ * of all memfiles when "mfp" is NULL.
+ * Returns the number of bytes of memory used for blocks.
+ */
+long_u mf_get_stats(memfile_T *mfp, mfstats_T *stats)
+{
+  if (mfp == NULL) {
+    *stats = total_stats;
+    return total_mem_used;
+  }
+  *stats = mfp->mf_stats;
+  return (long_u)mfp->mf_used_count * mfp->mf_page_size;
+}
+
 /*
  * Open a swap file for a memfile.
  * The "fname" must be in allocated memory, and is consumed (also when an
@@ -1126,14 +1649,17 @@ mf_do_open (
 
 /*
  * Implementation of mf_hashtab_T follows.
+ *
+ * The table uses open addressing with linear probing: an item is stored in
+ * the first free slot at or after "key & mht_mask".  Block numbers are mostly
+ * consecutive, thus they end up in consecutive slots and a lookup touches
+ * only one or two cache lines, without following pointers.
  */
 
 /*
- * The number of buckets in the hashtable is increased by a factor of
- * MHT_GROWTH_FACTOR when the average number of items per bucket
- * exceeds 2 ^ MHT_LOG_LOAD_FACTOR.
+ * The number of slots in the hashtable is increased by a factor of
+ * MHT_GROWTH_FACTOR when more than half of them are used.
  */
-#define MHT_LOG_LOAD_FACTOR 6
 #define MHT_GROWTH_FACTOR   2   /* must be a power of two */
 
 /*
@@ -1162,14 +1688,9 @@ static void mf_hash_free(mf_hashtab_T *mht)
 static void mf_hash_free_all(mf_hashtab_T *mht)
 {
   long_u idx;
-  mf_hashitem_T   *mhi;
-  mf_hashitem_T   *next;
 
   for (idx = 0; idx <= mht->mht_mask; idx++)
-    for (mhi = mht->mht_buckets[idx]; mhi != NULL; mhi = next) {
-      next = mhi->mhi_next;
-      vim_free(mhi);
-    }
+    vim_free(mht->mht_buckets[idx]);
 
   mf_hash_free(mht);
 }
@@ -1181,42 +1702,43 @@ static void mf_hash_free_all(mf_hashtab_T *mht)
 static mf_hashitem_T *mf_hash_find(mf_hashtab_T *mht, blocknr_T key)
 {
   mf_hashitem_T   *mhi;
+  long_u idx;
 
-  mhi = mht->mht_buckets[key & mht->mht_mask];
-  while (mhi != NULL && mhi->mhi_key != key)
-    mhi = mhi->mhi_next;
-
-  return mhi;
+  for (idx = key & mht->mht_mask; (mhi = mht->mht_buckets[idx]) != NULL;
+       idx = (idx + 1) & mht->mht_mask)
+    if (mhi->mhi_key == key)
+      return mhi;
+  return NULL;
 }
 
 /*
  * Add item "mhi" to hashtable "mht".
  * "mhi" must not be NULL.
+ * Returns FAIL when the table is full and can't grow, out of memory.
  */
-static void mf_hash_add_item(mf_hashtab_T *mht, mf_hashitem_T *mhi)
+static int mf_hash_add_item(mf_hashtab_T *mht, mf_hashitem_T *mhi)
 {
   long_u idx;
 
-  idx = mhi->mhi_key & mht->mht_mask;
-  mhi->mhi_next = mht->mht_buckets[idx];
-  mhi->mhi_prev = NULL;
-  if (mhi->mhi_next != NULL)
-    mhi->mhi_next->mhi_prev = mhi;
-  mht->mht_buckets[idx] = mhi;
-
-  mht->mht_count++;
-
   /*
-   * Grow hashtable when we have more thank 2^MHT_LOG_LOAD_FACTOR
-   * items per bucket on average
+   * Grow hashtable when more than half of the slots are used, probing gets
+   * slow when the table gets full.  When growing fails keep one slot free,
+   * it ends every probe sequence.
    */
-  if (mht->mht_fixed == 0
-      && (mht->mht_count >> MHT_LOG_LOAD_FACTOR) > mht->mht_mask) {
-    if (mf_hash_grow(mht) == FAIL) {
-      /* stop trying to grow after first failure to allocate memory */
-      mht->mht_fixed = 1;
-    }
+  if ((mht->mht_count + 1) * 2 > mht->mht_mask + 1
+      && (mht->mht_fixed || mf_hash_grow(mht) == FAIL)) {
+    /* stop trying to grow after first failure to allocate memory */
+    mht->mht_fixed = 1;
+    if (mht->mht_count + 1 > mht->mht_mask)
+      return FAIL;
   }
+
+  for (idx = mhi->mhi_key & mht->mht_mask; mht->mht_buckets[idx] != NULL;
+       idx = (idx + 1) & mht->mht_mask)
+    ;
+  mht->mht_buckets[idx] = mhi;
+  mht->mht_count++;
+  return OK;
 }
 
 /*
@@ -1225,31 +1747,45 @@ static void mf_hash_add_item(mf_hashtab_T *mht, mf_hashitem_T *mhi)
  */
 static void mf_hash_rem_item(mf_hashtab_T *mht, mf_hashitem_T *mhi)
 {
-  if (mhi->mhi_prev == NULL)
-    mht->mht_buckets[mhi->mhi_key & mht->mht_mask] = mhi->mhi_next;
-  else
-    mhi->mhi_prev->mhi_next = mhi->mhi_next;
-
-  if (mhi->mhi_next != NULL)
-    mhi->mhi_next->mhi_prev = mhi->mhi_prev;
+  long_u idx;
+  long_u next;
+  long_u home;
 
+  for (idx = mhi->mhi_key & mht->mht_mask; mht->mht_buckets[idx] != mhi;
+       idx = (idx + 1) & mht->mht_mask)
+    ;
+  mht->mht_buckets[idx] = NULL;
   mht->mht_count--;
 
+  /*
+   * Move items after the hole back when the hole is between their home slot
+   * and their slot, otherwise a lookup would stop at the hole.
+   */
+  for (next = (idx + 1) & mht->mht_mask; mht->mht_buckets[next] != NULL;
+       next = (next + 1) & mht->mht_mask) {
+    home = mht->mht_buckets[next]->mhi_key & mht->mht_mask;
+    if (((next - home) & mht->mht_mask) >= ((next - idx) & mht->mht_mask)) {
+      mht->mht_buckets[idx] = mht->mht_buckets[next];
+      mht->mht_buckets[next] = NULL;
+      idx = next;
+    }
+  }
+
   /* We could shrink the table here, but it typically takes little memory,
    * so why bother?  */
 }
 
 /*
- * Increase number of buckets in the hashtable by MHT_GROWTH_FACTOR and
+ * Increase number of slots in the hashtable by MHT_GROWTH_FACTOR and
  * rehash items.
  * Returns FAIL when out of memory.
  */
 static int mf_hash_grow(mf_hashtab_T *mht)
 {
-  long_u i, j;
-  int shift;
+  long_u i;
+  long_u idx;
+  long_u mask;
   mf_hashitem_T   *mhi;
-  mf_hashitem_T   *tails[MHT_GROWTH_FACTOR];
   mf_hashitem_T   **buckets;
   size_t size;
 
@@ -1258,47 +1794,22 @@ static int mf_hash_grow(mf_hashtab_T *mht)
   if (buckets == NULL)
     return FAIL;
 
-  shift = 0;
-  while ((mht->mht_mask >> shift) != 0)
-    shift++;
-
+  mask = (mht->mht_mask + 1) * MHT_GROWTH_FACTOR - 1;
   for (i = 0; i <= mht->mht_mask; i++) {
-    /*
-     * Traverse the items in the i-th original bucket and move them into
-     * MHT_GROWTH_FACTOR new buckets, preserving their relative order
-     * within each new bucket.  Preserving the order is important because
-     * mf_get() tries to keep most recently used items at the front of
-     * each bucket.
-     *
-     * Here we strongly rely on the fact the hashes are computed modulo
-     * a power of two.
-     */
-
-    vim_memset(tails, 0, sizeof(tails));
-
-    for (mhi = mht->mht_buckets[i]; mhi != NULL; mhi = mhi->mhi_next) {
-      j = (mhi->mhi_key >> shift) & (MHT_GROWTH_FACTOR - 1);
-      if (tails[j] == NULL) {
-        buckets[i + (j << shift)] = mhi;
-        tails[j] = mhi;
-        mhi->mhi_prev = NULL;
-      } else   {
-        tails[j]->mhi_next = mhi;
-        mhi->mhi_prev = tails[j];
-        tails[j] = mhi;
-      }
-    }
-
-    for (j = 0; j < MHT_GROWTH_FACTOR; j++)
-      if (tails[j] != NULL)
-        tails[j]->mhi_next = NULL;
+    mhi = mht->mht_buckets[i];
+    if (mhi == NULL)
+      continue;
+    for (idx = mhi->mhi_key & mask; buckets[idx] != NULL;
+         idx = (idx + 1) & mask)
+      ;
+    buckets[idx] = mhi;
   }
 
   if (mht->mht_buckets != mht->mht_small_buckets)
     vim_free(mht->mht_buckets);
 
   mht->mht_buckets = buckets;
-  mht->mht_mask = (mht->mht_mask + 1) * MHT_GROWTH_FACTOR - 1;
+  mht->mht_mask = mask;
 
   return OK;
 }
@@ -52,6 +52,10 @@
 # include <proto/dos.h>     /* for Open() and Close() */
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>          /* for munmap() */
+#endif
+
 typedef struct block0 ZERO_BL;              /* contents of the first block */
 typedef struct pointer_block PTR_BL;        /* contents of a pointer block */
 typedef struct data_block DATA_BL;          /* contents of a data block */
@@ -230,12 +234,18 @@ static void add_b0_fenc __ARGS((ZERO_BL *b0p, buf_T *buf));
 static time_t swapfile_info __ARGS((char_u *));
 static int recov_file_names __ARGS((char_u **, char_u *, int prepend_dot));
 static int ml_append_int __ARGS((buf_T *, linenr_T, char_u *, colnr_T, int, int));
+static void ml_copy_line __ARGS((char_u *to, char_u *line, colnr_T len));
 static int ml_delete_int __ARGS((buf_T *, linenr_T, int));
 static char_u *findswapname __ARGS((buf_T *, char_u **, char_u *));
 static void ml_flush_line __ARGS((buf_T *));
 static bhdr_T *ml_new_data __ARGS((memfile_T *, int, int));
 static bhdr_T *ml_new_ptr __ARGS((memfile_T *));
 static bhdr_T *ml_find_line __ARGS((buf_T *, linenr_T, int));
+static bhdr_T *ml_cache_find __ARGS((buf_T *buf, linenr_T lnum));
+static void ml_cache_add __ARGS((buf_T *buf, blocknr_T bnum, int page_count,
+                                 linenr_T low, linenr_T high));
+static void ml_cache_shift __ARGS((buf_T *buf, linenr_T lnum, int count));
+static void ml_cache_clear __ARGS((buf_T *buf));
 static int ml_add_stack __ARGS((buf_T *));
 static void ml_lineadd __ARGS((buf_T *, int));
 static int b0_magic_wrong __ARGS((ZERO_BL *));
@@ -249,6 +259,18 @@ static char_u *make_percent_swname __ARGS((char_u *dir, char_u *name));
 #endif
 static void ml_crypt_prepare __ARGS((memfile_T *mfp, off_t offset, int reading));
 static void ml_updatechunk __ARGS((buf_T *buf, long line, long len, int updtype));
+static int ml_chunktree_build __ARGS((buf_T *buf));
+static void ml_chunktree_add __ARGS((buf_T *buf, int curix, int lines,
+                                     long size));
+static int ml_chunktree_find __ARGS((buf_T *buf, linenr_T lnum, long offset,
+                                     int ffdos, linenr_T *curlinep,
+                                     long *sizep));
+#ifdef HAVE_SYS_MMAN_H
+static char_u *ml_map_get __ARGS((mlmap_T *mm, linenr_T lnum));
+static size_t ml_map_offset __ARGS((mlmap_T *mm, linenr_T lnum));
+static long ml_map_size __ARGS((mlmap_T *mm, linenr_T lnum, linenr_T count));
+static void ml_map_free __ARGS((mlmap_T *mm));
+#endif
 
 /*
  * Open a new memline for "buf".
@@ -271,7 +293,12 @@ int ml_open(buf_T *buf)
   buf->b_ml.ml_stack_top = 0;   /* nothing in the stack */
   buf->b_ml.ml_locked = NULL;   /* no cached block */
   buf->b_ml.ml_line_lnum = 0;   /* no cached line */
+  buf->b_ml.ml_cache = NULL;    /* no cached data blocks */
+  buf->b_ml.ml_cache_used = 0;
   buf->b_ml.ml_chunksize = NULL;
+  buf->b_ml.ml_chunktree = NULL;
+  buf->b_ml.ml_chunktree_len = 0;
+  buf->b_ml.ml_chunktree_size = 0;
 
   /*
    * When 'updatecount' is non-zero swap file may be opened later.
@@ -447,6 +474,7 @@ void ml_set_crypt_key(buf_T *buf, char_u *old_key, int old_cm)
      */
     ml_flush_line(buf);                     /* flush buffered line */
     (void)ml_find_line(buf, (linenr_T)0, ML_FLUSH);     /* flush locked block */
+    ml_cache_clear(buf);
 
     hp = NULL;
     bnum = 1;                   /* start with block 1 */
@@ -706,11 +734,23 @@ void ml_close(buf_T *buf, int del_file)
   if (buf->b_ml.ml_mfp == NULL)                 /* not open */
     return;
   mf_close(buf->b_ml.ml_mfp, del_file);         /* close the .swp file */
+#ifdef HAVE_SYS_MMAN_H
+  readfile_bg_cancel(buf);
+  ml_map_free(buf->b_ml.ml_map);
+  buf->b_ml.ml_map = NULL;
+#endif
   if (buf->b_ml.ml_line_lnum != 0 && (buf->b_ml.ml_flags & ML_LINE_DIRTY))
     vim_free(buf->b_ml.ml_line_ptr);
   vim_free(buf->b_ml.ml_stack);
+  vim_free(buf->b_ml.ml_cache);
+  buf->b_ml.ml_cache = NULL;
+  buf->b_ml.ml_cache_used = 0;
   vim_free(buf->b_ml.ml_chunksize);
   buf->b_ml.ml_chunksize = NULL;
+  vim_free(buf->b_ml.ml_chunktree);
+  buf->b_ml.ml_chunktree = NULL;
+  buf->b_ml.ml_chunktree_len = 0;
+  buf->b_ml.ml_chunktree_size = 0;
   buf->b_ml.ml_mfp = NULL;
 
   /* Reset the "recovered" flag, give the ATTENTION prompt the next time
@@ -1000,6 +1040,8 @@ void ml_recover(void)          {
   buf->b_ml.ml_stack_top = 0;           /* nothing in the stack */
   buf->b_ml.ml_line_lnum = 0;           /* no cached line */
   buf->b_ml.ml_locked = NULL;           /* no locked block */
+  buf->b_ml.ml_cache = NULL;            /* no cached data blocks */
+  buf->b_ml.ml_cache_used = 0;
   buf->b_ml.ml_flags = 0;
   buf->b_p_key = empty_option;
   buf->b_p_cm = empty_option;
@@ -1450,6 +1492,7 @@ theend:
       free_string_option(buf->b_p_key);
     free_string_option(buf->b_p_cm);
     vim_free(buf->b_ml.ml_stack);
+    vim_free(buf->b_ml.ml_cache);
     vim_free(buf);
   }
   if (serious_error && called_from_main)
@@ -1914,7 +1957,7 @@ void ml_sync_all(int check_file, int check_char)
     }
     if (buf->b_ml.ml_mfp->mf_dirty) {
       (void)mf_sync(buf->b_ml.ml_mfp, (check_char ? MFS_STOP : 0)
-          | (bufIsChanged(buf) ? MFS_FLUSH : 0));
+          | (bufIsChanged(buf) ? MFS_FLUSH | MFS_ASYNC : 0));
       if (check_char && ui_char_avail())        /* character available now */
         break;
     }
@@ -2073,6 +2116,15 @@ errorret:
   if (buf->b_ml.ml_mfp == NULL)         /* there are no lines */
     return (char_u *)"";
 
+#ifdef HAVE_SYS_MMAN_H
+  if (buf->b_ml.ml_map != NULL) {
+    if (!will_change)
+      return ml_map_get(buf->b_ml.ml_map, lnum);
+    if (ml_unmap(buf) == FAIL)
+      goto errorret;
+  }
+#endif
+
   /*
    * See if it is the same line as requested last time.
    * Otherwise may need to flush last used line.
@@ -2124,6 +2176,8 @@ int ml_line_alloced(void)         {
  * Append a line after lnum (may be 0 to insert a line in front of the file).
  * "line" does not need to be allocated, but can't be another line in a
  * buffer, unlocking may make it invalid.
+ * When "len" is not zero "line" does not need to be NUL terminated, the
+ * byte at "line[len - 1]" is not used.
  *
  *   newfile: TRUE when starting to edit a new file, meaning that pe_old_lnum
  *		will be set for recovery
@@ -2198,6 +2252,9 @@ ml_append_int (
   if (lnum > buf->b_ml.ml_line_count || buf->b_ml.ml_mfp == NULL)
     return FAIL;
 
+  if (buf->b_ml.ml_map != NULL && ml_unmap(buf) == FAIL)
+    return FAIL;
+
   if (lowest_marked && lowest_marked > lnum)
     lowest_marked = lnum + 1;
 
@@ -2244,6 +2301,7 @@ ml_append_int (
      */
     --(buf->b_ml.ml_locked_lineadd);
     --(buf->b_ml.ml_locked_high);
+    ml_cache_clear(buf);
     if ((hp = ml_find_line(buf, lnum + 1, ML_INSERT)) == NULL)
       return FAIL;
 
@@ -2290,7 +2348,7 @@ ml_append_int (
     /*
      * copy the text into the block
      */
-    mch_memmove((char *)dp + dp->db_index[db_idx + 1], line, (size_t)len);
+    ml_copy_line((char_u *)dp + dp->db_index[db_idx + 1], line, len);
     if (mark)
       dp->db_index[db_idx + 1] |= DB_MARKED;
 
@@ -2327,6 +2385,9 @@ ml_append_int (
     int pb_idx;
     PTR_BL      *pp_new;
 
+    /* The blocks are rearranged, cached positions become invalid. */
+    ml_cache_clear(buf);
+
     /*
      * We are going to allocate a new data block. Depending on the
      * situation it will be put to the left or right of the existing
@@ -2393,8 +2454,7 @@ ml_append_int (
       if (mark)
         dp_right->db_index[0] |= DB_MARKED;
 
-      mch_memmove((char *)dp_right + dp_right->db_txt_start,
-          line, (size_t)len);
+      ml_copy_line((char_u *)dp_right + dp_right->db_txt_start, line, len);
       ++line_count_right;
     }
     /*
@@ -2431,8 +2491,7 @@ ml_append_int (
       dp_left->db_index[line_count_left] = dp_left->db_txt_start;
       if (mark)
         dp_left->db_index[line_count_left] |= DB_MARKED;
-      mch_memmove((char *)dp_left + dp_left->db_txt_start,
-          line, (size_t)len);
+      ml_copy_line((char_u *)dp_left + dp_left->db_txt_start, line, len);
       ++line_count_left;
     }
 
@@ -2624,6 +2683,18 @@ ml_append_int (
   return OK;
 }
 
+/*
+ * Copy the text of a new line into a data block.  "len" includes the NUL,
+ * which is stored here instead of being copied from "line".  This allows
+ * appending text that is not NUL terminated, such as a line in a segment
+ * of a file decoded by readfile().
+ */
+static void ml_copy_line(char_u *to, char_u *line, colnr_T len)
+{
+  mch_memmove(to, line, (size_t)(len - 1));
+  to[len - 1] = NUL;
+}
+
 /*
  * Replace line lnum, with buffering, in current buffer.
  *
@@ -2646,6 +2717,11 @@ int ml_replace(linenr_T lnum, char_u *line, int copy)
 
   if (copy && (line = vim_strsave(line)) == NULL)   /* allocate memory */
     return FAIL;
+  if (curbuf->b_ml.ml_map != NULL && ml_unmap(curbuf) == FAIL) {
+    if (copy)
+      vim_free(line);
+    return FAIL;
+  }
   if (curbuf->b_ml.ml_line_lnum != lnum)            /* other line buffered */
     ml_flush_line(curbuf);                          /* flush it */
   else if (curbuf->b_ml.ml_flags & ML_LINE_DIRTY)   /* same line allocated */
@@ -2689,6 +2765,9 @@ static int ml_delete_int(buf_T *buf, linenr_T lnum, int message)
   if (lnum < 1 || lnum > buf->b_ml.ml_line_count)
     return FAIL;
 
+  if (buf->b_ml.ml_map != NULL && ml_unmap(buf) == FAIL)
+    return FAIL;
+
   if (lowest_marked && lowest_marked > lnum)
     lowest_marked--;
 
@@ -2745,6 +2824,7 @@ static int ml_delete_int(buf_T *buf, linenr_T lnum, int message)
   if (count == 1) {
     mf_free(mfp, hp);           /* free the data block */
     buf->b_ml.ml_locked = NULL;
+    ml_cache_clear(buf);
 
     for (stack_idx = buf->b_ml.ml_stack_top - 1; stack_idx >= 0;
          --stack_idx) {
@@ -2810,6 +2890,106 @@ static int ml_delete_int(buf_T *buf, linenr_T lnum, int message)
   return OK;
 }
 
+static int ml_line_has_text_ic __ARGS((char_u *p, char_u *end, char_u *text,
+                                       int len));
+
+/*
+ * Return TRUE if the NUL terminated line "p" contains the "len" bytes at
+ * "text" before "end", ignoring the case of ASCII letters.
+ */
+static int ml_line_has_text_ic(char_u *p, char_u *end, char_u *text, int len)
+{
+  char_u two[3];
+  int i;
+
+  two[0] = TOLOWER_ASC(*text);
+  two[1] = TOUPPER_ASC(*text);
+  two[2] = NUL;
+  while (p < end && (p = (char_u *)strpbrk((char *)p, (char *)two)) != NULL
+         && p < end) {
+    for (i = 1; i < len && TOLOWER_ASC(p[i]) == TOLOWER_ASC(text[i]); ++i)
+      ;
+    if (i == len)
+      return TRUE;
+    ++p;
+  }
+  return FALSE;
+}
+
+/*
+ * Find the first line from "lnum" in direction "dir" up to and including
+ * "lnum_end" that contains the "len" bytes at "text".  The text of each data
+ * block is searched directly, without getting the lines one by one.  "text"
+ * must not contain a NUL.
+ * When "ic" is TRUE the case of ASCII letters is ignored, "text" must be
+ * ASCII then.  The letters i, k and s also match a non-ASCII character (e.g.,
+ * the Kelvin sign), when "text" contains one of them every line with a
+ * non-ASCII byte is used.
+ * Returns the line number, zero when no line contains the text.  When the
+ * lines can't be searched this way returns "lnum", the caller must check it.
+ */
+linenr_T ml_find_text(buf_T *buf, linenr_T lnum, linenr_T lnum_end, int dir,
+                      char_u *text, int len, int ic)
+{
+  bhdr_T      *hp;
+  DATA_BL     *dp;
+  char_u      *p;
+  char_u      *end;
+  int idx;
+  int last;
+  int c = *text;
+  int nonascii = ic && vim_strpbrk(text, (char_u *)"iIkKsS") != NULL;
+
+  /* The lines of a mapped file are not in blocks. */
+  if (buf->b_ml.ml_mfp == NULL || buf->b_ml.ml_map != NULL || len <= 0)
+    return lnum;
+
+  /* A changed line may only be in ml_line_ptr, put it in its block. */
+  ml_flush_line(buf);
+
+  while (dir == FORWARD ? lnum <= lnum_end : lnum >= lnum_end) {
+    if ((hp = ml_find_line(buf, lnum, ML_FIND)) == NULL)
+      return lnum;
+    dp = (DATA_BL *)(hp->bh_data);
+    idx = lnum - buf->b_ml.ml_locked_low;
+    if (dir == FORWARD)
+      last = (lnum_end < buf->b_ml.ml_locked_high ? lnum_end
+              : buf->b_ml.ml_locked_high) - buf->b_ml.ml_locked_low;
+    else
+      last = (lnum_end > buf->b_ml.ml_locked_low ? lnum_end
+              : buf->b_ml.ml_locked_low) - buf->b_ml.ml_locked_low;
+
+    for (;; idx += dir, lnum += dir) {
+      /* The lines are stored from the end of the block backwards, the text
+       * of a line ends where the text of the previous line starts. */
+      p = (char_u *)dp + (dp->db_index[idx] & DB_INDEX_MASK);
+      end = (char_u *)dp + (idx == 0 ? dp->db_txt_end
+                            : (dp->db_index[idx - 1] & DB_INDEX_MASK));
+      if (nonascii && has_non_ascii_len(p, (size_t)(end - p)))
+        return lnum;
+      end -= len;               /* last position where "text" can start */
+      if (ic) {
+        if (ml_line_has_text_ic(p, end, text, len))
+          return lnum;
+      } else
+        while (p < end
+               && (p = memchr(p, c, (size_t)(end - p))) != NULL) {
+          if (memcmp(p, text, (size_t)len) == 0)
+            return lnum;
+          ++p;
+        }
+      if (idx == last)
+        break;
+    }
+    lnum += dir;
+
+    fast_breakcheck();
+    if (got_int)
+      return lnum;
+  }
+  return (linenr_T)0;
+}
+
 /*
  * set the B_MARKED flag for line 'lnum'
  */
@@ -2825,6 +3005,22 @@ void ml_setmarked(linenr_T lnum)
   if (lowest_marked == 0 || lowest_marked > lnum)
     lowest_marked = lnum;
 
+  if (curbuf->b_ml.ml_map != NULL) {
+    mlmap_T *mm = curbuf->b_ml.ml_map;
+
+    /* The marks are for all lines, wait for the file to be loaded. */
+    if (mm->mm_load != NULL && mm->mm_marks == NULL)
+      readfile_bg_wait(curbuf);
+    if (mm->mm_marks == NULL) {
+      mm->mm_marks = alloc_clear(
+          (unsigned)(curbuf->b_ml.ml_line_count / 8 + 1));
+      if (mm->mm_marks == NULL)
+        return;
+    }
+    mm->mm_marks[(lnum - 1) / 8] |= 1 << ((lnum - 1) & 7);
+    return;
+  }
+
   /*
    * find the data block containing the line
    * This also fills the stack with the blocks from the root to the data block
@@ -2850,6 +3046,20 @@ linenr_T ml_firstmarked(void)              {
   if (curbuf->b_ml.ml_mfp == NULL)
     return (linenr_T) 0;
 
+  if (curbuf->b_ml.ml_map != NULL) {
+    char_u  *marks = curbuf->b_ml.ml_map->mm_marks;
+
+    if (marks == NULL || lowest_marked == 0)
+      return (linenr_T)0;
+    for (lnum = lowest_marked; lnum <= curbuf->b_ml.ml_line_count; ++lnum)
+      if (marks[(lnum - 1) / 8] & (1 << ((lnum - 1) & 7))) {
+        marks[(lnum - 1) / 8] &= ~(1 << ((lnum - 1) & 7));
+        lowest_marked = lnum + 1;
+        return lnum;
+      }
+    return (linenr_T)0;
+  }
+
   /*
    * The search starts with lowest_marked line. This is the last line where
    * a mark was found, adjusted by inserting/deleting lines.
@@ -2890,6 +3100,13 @@ void ml_clearmarked(void)          {
   if (curbuf->b_ml.ml_mfp == NULL)          /* nothing to do */
     return;
 
+  if (curbuf->b_ml.ml_map != NULL) {
+    vim_free(curbuf->b_ml.ml_map->mm_marks);
+    curbuf->b_ml.ml_map->mm_marks = NULL;
+    lowest_marked = 0;
+    return;
+  }
+
   /*
    * The search starts with line lowest_marked.
    */
@@ -2916,6 +3133,215 @@ void ml_clearmarked(void)          {
   return;
 }
 
+/*
+ * Make the empty buffer "buf" use the "count" lines in the file mapped by
+ * readfile(), described by "mm".  The mapping is used until the buffer is
+ * changed, "mm" is freed when the memline is closed.
+ */
+void ml_map_attach(buf_T *buf, mlmap_T *mm, linenr_T count)
+{
+  ml_flush_line(buf);
+  buf->b_ml.ml_map = mm;
+  buf->b_ml.ml_line_count = count;
+  buf->b_ml.ml_flags &= ~ML_EMPTY;
+}
+
+/*
+ * Put the lines of buffer "buf" that are in a mapped file in the memline, so
+ * that they can be changed.  The mapping is not used after this.  Lines
+ * marked with ml_setmarked() remain marked.
+ * Returns FAIL when out of memory, the buffer keeps using the mapping then.
+ */
+int ml_unmap(buf_T *buf)
+{
+#ifdef HAVE_SYS_MMAN_H
+  mlmap_T     *mm = buf->b_ml.ml_map;
+  linenr_T count = buf->b_ml.ml_line_count;
+  linenr_T save_lowest_marked = lowest_marked;
+  linenr_T lnum;
+  int mark;
+
+  if (mm == NULL)
+    return OK;
+
+  /* A file that is still being loaded is changed: all lines are needed. */
+  if (mm->mm_load != NULL) {
+    readfile_bg_wait(buf);
+    count = buf->b_ml.ml_line_count;
+  }
+
+  /* The memline still has the empty line it was created with, the lines are
+   * inserted before it. */
+  buf->b_ml.ml_map = NULL;
+  buf->b_ml.ml_line_count = 1;
+  for (lnum = 1; lnum <= count; ++lnum) {
+    mark = mm->mm_marks != NULL
+           && (mm->mm_marks[(lnum - 1) / 8] & (1 << ((lnum - 1) & 7)));
+    if (ml_append_int(buf, lnum - 1, ml_map_get(mm, lnum), (colnr_T)0,
+            TRUE, mark) == FAIL)
+      break;
+  }
+  if (lnum <= count) {
+    while (buf->b_ml.ml_line_count > 1)
+      ml_delete_int(buf, (linenr_T)1, FALSE);
+    buf->b_ml.ml_map = mm;
+    buf->b_ml.ml_line_count = count;
+    lowest_marked = save_lowest_marked;
+    return FAIL;
+  }
+  ml_delete_int(buf, buf->b_ml.ml_line_count, FALSE);
+  lowest_marked = save_lowest_marked;
+  ml_map_free(mm);
+#endif
+  return OK;
+}
+
+/*
+ * Make buffer "buf" empty again when it uses a mapped file, without copying
+ * the lines.  Used to read the file again.
+ */
+void ml_map_drop(buf_T *buf)
+{
+#ifdef HAVE_SYS_MMAN_H
+  mlmap_T     *mm = buf->b_ml.ml_map;
+
+  if (mm == NULL)
+    return;
+  buf->b_ml.ml_map = NULL;
+  buf->b_ml.ml_line_count = 1;
+  buf->b_ml.ml_flags |= ML_EMPTY;
+  ml_map_free(mm);
+#endif
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Get line "lnum" from mapped file "mm".  The text is copied, NULs are
+ * replaced with NLs.  The copy remains valid for a few more calls.
+ * When the file was truncated the text is gone and an empty line is
+ * returned.
+ */
+static char_u *ml_map_get(mlmap_T *mm, linenr_T lnum)
+{
+  JMP_BUF env;
+  char_u      *p;
+  char_u      *end;
+  char_u      *nl;
+  char_u      *text;
+  size_t len;
+  int i;
+
+  for (i = 0; i < MLMAP_LINES; ++i)
+    if (mm->mm_lines[i].mml_lnum == lnum)
+      return mm->mm_lines[i].mml_text;
+  i = mm->mm_lines_next;
+  mm->mm_lines_next = (i + 1) % MLMAP_LINES;
+  mm->mm_lines[i].mml_lnum = 0;
+
+  if (SETJMP(env) != 0) {
+    /* Got a SIGBUS, the file was truncated. */
+    mch_map_guard(0, NULL);
+    mm->mm_find_lnum = 0;
+    return (char_u *)"";
+  }
+  mch_map_guard(0, &env);
+
+  p = mm->mm_start + ml_map_offset(mm, lnum);
+  end = mm->mm_start + mm->mm_len;
+  nl = memchr(p, NL, (size_t)(end - p));
+  len = (size_t)((nl == NULL ? end : nl) - p);
+  if (nl != NULL && mm->mm_dos && len > 0 && p[len - 1] == CAR)
+    --len;                              /* remove CR */
+  if (len >= mm->mm_lines[i].mml_size) {
+    vim_free(mm->mm_lines[i].mml_text);
+    mm->mm_lines[i].mml_size = 0;
+    mm->mm_lines[i].mml_text = lalloc((long_u)len + 1, TRUE);
+    if (mm->mm_lines[i].mml_text == NULL) {
+      mch_map_guard(0, NULL);
+      return (char_u *)"";
+    }
+    mm->mm_lines[i].mml_size = len + 1;
+  }
+  text = mm->mm_lines[i].mml_text;
+  mch_memmove(text, p, len);
+  mch_map_guard(0, NULL);
+
+  text[len] = NUL;
+  for (p = text; (p = memchr(p, NUL, (size_t)(text + len - p))) != NULL; ++p)
+    *p = NL;                            /* NULs are replaced by newlines! */
+  mm->mm_lines[i].mml_lnum = lnum;
+  return text;
+}
+
+/*
+ * Return the offset of line "lnum" in mapped file "mm".  Must be called with
+ * mch_map_guard() set.
+ */
+static size_t ml_map_offset(mlmap_T *mm, linenr_T lnum)
+{
+  linenr_T l = (lnum - 1) / MLMAP_STEP * MLMAP_STEP + 1;
+  size_t off = mm->mm_index[(lnum - 1) / MLMAP_STEP];
+  char_u      *p;
+
+  /* Lines are often used one after another, continue from the line found
+   * last time when possible. */
+  if (mm->mm_find_lnum > l && mm->mm_find_lnum <= lnum) {
+    l = mm->mm_find_lnum;
+    off = mm->mm_find_off;
+  }
+  for (; l < lnum; ++l) {
+    p = memchr(mm->mm_start + off, NL, mm->mm_len - off);
+    if (p == NULL)
+      break;                            /* file was changed */
+    off = (size_t)(p - mm->mm_start) + 1;
+  }
+  mm->mm_find_lnum = l;
+  mm->mm_find_off = off;
+  return off;
+}
+
+/*
+ * Return the number of bytes in the lines before line "lnum" of mapped file
+ * "mm", which has "count" lines and no CRs to remove.
+ * Returns -1 when the file was truncated.
+ */
+static long ml_map_size(mlmap_T *mm, linenr_T lnum, linenr_T count)
+{
+  JMP_BUF env;
+  size_t off;
+
+  if (lnum > count)
+    return (long)(mm->mm_end - mm->mm_index[0]) + (mm->mm_eol ? 0 : 1);
+  if (SETJMP(env) != 0) {
+    /* Got a SIGBUS, the file was truncated. */
+    mch_map_guard(0, NULL);
+    mm->mm_find_lnum = 0;
+    return -1;
+  }
+  mch_map_guard(0, &env);
+  off = ml_map_offset(mm, lnum);
+  mch_map_guard(0, NULL);
+  return (long)(off - mm->mm_index[0]);
+}
+
+/*
+ * Remove mapping "mm" and free it.
+ */
+static void ml_map_free(mlmap_T *mm)
+{
+  int i;
+
+  if (mm == NULL)
+    return;
+  munmap(mm->mm_start, mm->mm_len);
+  vim_free(mm->mm_index);
+  vim_free(mm->mm_marks);
+  for (i = 0; i < MLMAP_LINES; ++i)
+    vim_free(mm->mm_lines[i].mml_text);
+  vim_free(mm);
+}
+#endif
+
 /*
  * flush ml_line if necessary
  */
@@ -3084,6 +3510,12 @@ static bhdr_T *ml_find_line(buf_T *buf, linenr_T lnum, int action)
 
   mfp = buf->b_ml.ml_mfp;
 
+  /* Lines after "lnum" move, also in cached blocks. */
+  if (action == ML_INSERT)
+    ml_cache_shift(buf, lnum, 1);
+  else if (action == ML_DELETE)
+    ml_cache_shift(buf, lnum, -1);
+
   /*
    * If there is a locked block check if the wanted line is in it.
    * If not, flush and release the locked block.
@@ -3122,6 +3554,12 @@ static bhdr_T *ml_find_line(buf_T *buf, linenr_T lnum, int action)
   if (action == ML_FLUSH)           /* nothing else to do */
     return NULL;
 
+  /* Try a recently found data block.  Not when 'swapfile' is reset, all the
+   * pointer blocks must be loaded then. */
+  if (action == ML_FIND && !mf_dont_release
+      && (hp = ml_cache_find(buf, lnum)) != NULL)
+    return hp;
+
   bnum = 1;                         /* start at the root of the tree */
   page_count = 1;
   low = 1;
@@ -3165,6 +3603,8 @@ static bhdr_T *ml_find_line(buf_T *buf, linenr_T lnum, int action)
       buf->b_ml.ml_locked_high = high;
       buf->b_ml.ml_locked_lineadd = 0;
       buf->b_ml.ml_flags &= ~(ML_LOCKED_DIRTY | ML_LOCKED_POS);
+      if (action == ML_FIND)
+        ml_cache_add(buf, bnum, page_count, low, high);
       return hp;
     }
 
@@ -3240,9 +3680,146 @@ error_noblock:
   else if (action == ML_INSERT)
     ml_lineadd(buf, -1);
   buf->b_ml.ml_stack_top = 0;
+  ml_cache_clear(buf);
   return NULL;
 }
 
+/*
+ * Find line "lnum" in the cache of data blocks of "buf".
+ * When found lock the block, set ml_stack to the pointer blocks above it and
+ * return it.  Otherwise return NULL.
+ */
+static bhdr_T *ml_cache_find(buf_T *buf, linenr_T lnum)
+{
+  mlcache_T   *mc;
+  bhdr_T      *hp;
+  int i;
+
+  if (buf->b_ml.ml_cache_used == 0)
+    return NULL;
+  for (i = 0; i < ML_CACHE_SIZE; ++i) {
+    mc = &buf->b_ml.ml_cache[i];
+    if (mc->mc_bnum != 0 && mc->mc_low <= lnum && mc->mc_high >= lnum)
+      break;
+  }
+  if (i == ML_CACHE_SIZE)
+    return NULL;
+
+  /* A negative block number may have been changed, then the block is found
+   * by going down the tree, which updates the pointer block. */
+  hp = mf_get(buf->b_ml.ml_mfp, mc->mc_bnum, mc->mc_page_count);
+  if (hp == NULL || ((DATA_BL *)(hp->bh_data))->db_id != DATA_ID) {
+    if (hp != NULL)
+      mf_put(buf->b_ml.ml_mfp, hp, FALSE, FALSE);
+    mc->mc_bnum = 0;
+    --buf->b_ml.ml_cache_used;
+    return NULL;
+  }
+
+  buf->b_ml.ml_stack_top = 0;
+  for (i = 0; i < mc->mc_depth; ++i) {
+    if (ml_add_stack(buf) < 0) {
+      buf->b_ml.ml_stack_top = 0;
+      mf_put(buf->b_ml.ml_mfp, hp, FALSE, FALSE);
+      return NULL;
+    }
+    buf->b_ml.ml_stack[i] = mc->mc_path[i];
+  }
+
+  buf->b_ml.ml_locked = hp;
+  buf->b_ml.ml_locked_low = mc->mc_low;
+  buf->b_ml.ml_locked_high = mc->mc_high;
+  buf->b_ml.ml_locked_lineadd = 0;
+  buf->b_ml.ml_flags &= ~(ML_LOCKED_DIRTY | ML_LOCKED_POS);
+  return hp;
+}
+
+/*
+ * Remember that lines "low" to "high" of "buf" are in data block "bnum",
+ * below the pointer blocks in ml_stack.
+ */
+static void ml_cache_add(buf_T *buf, blocknr_T bnum, int page_count,
+                         linenr_T low, linenr_T high)
+{
+  mlcache_T   *mc;
+  int i;
+
+  if (buf->b_ml.ml_stack_top > ML_CACHE_DEPTH)
+    return;
+  if (buf->b_ml.ml_cache == NULL) {
+    buf->b_ml.ml_cache = (mlcache_T *)lalloc_clear(
+        (long_u)(ML_CACHE_SIZE * sizeof(mlcache_T)), FALSE);
+    if (buf->b_ml.ml_cache == NULL)
+      return;
+    buf->b_ml.ml_cache_used = 0;
+    buf->b_ml.ml_cache_next = 0;
+  }
+
+  /* Reuse an entry for the same block, otherwise replace the oldest one. */
+  for (i = 0; i < ML_CACHE_SIZE; ++i)
+    if (buf->b_ml.ml_cache[i].mc_bnum == bnum)
+      break;
+  if (i == ML_CACHE_SIZE) {
+    i = buf->b_ml.ml_cache_next;
+    buf->b_ml.ml_cache_next = (i + 1) % ML_CACHE_SIZE;
+  }
+  mc = &buf->b_ml.ml_cache[i];
+  if (mc->mc_bnum == 0)
+    ++buf->b_ml.ml_cache_used;
+  mc->mc_bnum = bnum;
+  mc->mc_page_count = page_count;
+  mc->mc_low = low;
+  mc->mc_high = high;
+  mc->mc_depth = buf->b_ml.ml_stack_top;
+  mch_memmove(mc->mc_path, buf->b_ml.ml_stack,
+      (size_t)mc->mc_depth * sizeof(infoptr_T));
+}
+
+/*
+ * Adjust the cached line numbers of "buf" for "count" lines inserted after
+ * line "lnum" (1) or line "lnum" deleted (-1).
+ */
+static void ml_cache_shift(buf_T *buf, linenr_T lnum, int count)
+{
+  mlcache_T   *mc;
+  infoptr_T   *ip;
+  int i;
+  int j;
+
+  if (buf->b_ml.ml_cache_used == 0)
+    return;
+  for (i = 0; i < ML_CACHE_SIZE; ++i) {
+    mc = &buf->b_ml.ml_cache[i];
+    if (mc->mc_bnum == 0)
+      continue;
+    if (mc->mc_low > lnum)
+      mc->mc_low += count;
+    if (mc->mc_high >= lnum)
+      mc->mc_high += count;
+    for (j = 0; j < mc->mc_depth; ++j) {
+      ip = &mc->mc_path[j];
+      if (ip->ip_low > lnum)
+        ip->ip_low += count;
+      if (ip->ip_high >= lnum)
+        ip->ip_high += count;
+    }
+  }
+}
+
+/*
+ * Forget all cached data blocks of "buf", used when the tree changes.
+ */
+static void ml_cache_clear(buf_T *buf)
+{
+  int i;
+
+  if (buf->b_ml.ml_cache_used == 0)
+    return;
+  for (i = 0; i < ML_CACHE_SIZE; ++i)
+    buf->b_ml.ml_cache[i].mc_bnum = 0;
+  buf->b_ml.ml_cache_used = 0;
+}
+
 /*
  * add an entry to the info pointer stack
  *
@@ -4259,6 +4836,115 @@ static void ml_crypt_prepare(memfile_T *mfp, off_t offset, int reading)
 #define MLCS_MAXL 800   /* max no of lines in chunk */
 #define MLCS_MINL 400   /* should be half of MLCS_MAXL */
 
+/*
+ * The chunk sizes are also kept in a Fenwick tree, so that the chunk for a
+ * line number or byte offset is found in O(log n) steps instead of walking
+ * over all chunks before it.  Entry "i" (one based) holds the sum of the
+ * chunks (i - (i & -i)) to i - 1.  Splitting, merging and removing chunks
+ * sets ml_chunktree_len to zero, the tree is then rebuilt when needed.
+ * Returns FAIL when out of memory.
+ */
+static int ml_chunktree_build(buf_T *buf)
+{
+  int n = buf->b_ml.ml_usedchunks;
+  int i;
+  int j;
+  chunksize_T *tree;
+
+  if (n <= 0)
+    return FAIL;
+  if (buf->b_ml.ml_chunktree_size < n + 1) {
+    int size = buf->b_ml.ml_numchunks + 1;
+
+    if (size < n + 1)
+      size = n + 1;
+    tree = (chunksize_T *)alloc((unsigned)(sizeof(chunksize_T) * size));
+    if (tree == NULL)
+      return FAIL;
+    vim_free(buf->b_ml.ml_chunktree);
+    buf->b_ml.ml_chunktree = tree;
+    buf->b_ml.ml_chunktree_size = size;
+  }
+  tree = buf->b_ml.ml_chunktree;
+  for (i = 1; i <= n; ++i)
+    tree[i] = buf->b_ml.ml_chunksize[i - 1];
+  for (i = 1; i <= n; ++i) {
+    j = i + (i & -i);
+    if (j <= n) {
+      tree[j].mlcs_numlines += tree[i].mlcs_numlines;
+      tree[j].mlcs_totalsize += tree[i].mlcs_totalsize;
+    }
+  }
+  buf->b_ml.ml_chunktree_len = n;
+  return OK;
+}
+
+/*
+ * Add "lines" and "size" to chunk "curix" in the Fenwick tree.  Does nothing
+ * when the tree is to be rebuilt anyway.
+ */
+static void ml_chunktree_add(buf_T *buf, int curix, int lines, long size)
+{
+  int n = buf->b_ml.ml_chunktree_len;
+  int i;
+
+  if (n == 0 || n != buf->b_ml.ml_usedchunks)
+    return;
+  for (i = curix + 1; i <= n; i += i & -i) {
+    buf->b_ml.ml_chunktree[i].mlcs_numlines += lines;
+    buf->b_ml.ml_chunktree[i].mlcs_totalsize += size;
+  }
+}
+
+/*
+ * Find the chunk that line "lnum" or byte "offset" is in, like the loop in
+ * ml_find_line_or_offset() does: skip chunks that end before "lnum" or end
+ * before "offset", never skipping the last chunk.  When "ffdos" is TRUE a CR
+ * is counted for each line when looking for "offset".
+ * Sets "*curlinep" to the first line of the chunk and "*sizep" to the number
+ * of bytes before it.
+ * Returns the index of the chunk, -1 when the tree could not be built.
+ */
+static int ml_chunktree_find(buf_T *buf, linenr_T lnum, long offset,
+                             int ffdos, linenr_T *curlinep, long *sizep)
+{
+  chunksize_T *tree;
+  int last = buf->b_ml.ml_usedchunks - 1;
+  int step;
+  int pos = 0;
+  linenr_T lines = 0;
+  long size = 0;
+
+  if (buf->b_ml.ml_chunktree_len != buf->b_ml.ml_usedchunks
+      || buf->b_ml.ml_chunktree_len == 0)
+    if (ml_chunktree_build(buf) == FAIL)
+      return -1;
+  tree = buf->b_ml.ml_chunktree;
+
+  for (step = 1; step * 2 <= last; step *= 2)
+    ;
+  for (; step > 0; step /= 2) {
+    chunksize_T *cp;
+
+    if (pos + step > last)
+      continue;
+    cp = tree + pos + step;
+    if ((lnum != 0 && lnum >= 1 + lines + cp->mlcs_numlines)
+        || (offset != 0 && offset > size + cp->mlcs_totalsize
+            + ffdos * (lines + cp->mlcs_numlines))) {
+      pos += step;
+      lines += cp->mlcs_numlines;
+      size += cp->mlcs_totalsize;
+    }
+  }
+
+  *curlinep = 1 + lines;
+  *sizep = size;
+  if (offset != 0 && ffdos)
+    *sizep += lines;
+  return pos;
+}
+
 /*
  * Keep information for finding byte offset of a line, updtype may be one of:
  * ML_CHNK_ADDLINE: Add len to parent chunk, possibly splitting it
@@ -4294,6 +4980,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
     buf->b_ml.ml_usedchunks = 1;
     buf->b_ml.ml_chunksize[0].mlcs_numlines = 1;
     buf->b_ml.ml_chunksize[0].mlcs_totalsize = 1;
+    buf->b_ml.ml_chunktree_len = 0;
   }
 
   if (updtype == ML_CHNK_UPDLINE && buf->b_ml.ml_line_count == 1) {
@@ -4304,6 +4991,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
     buf->b_ml.ml_chunksize[0].mlcs_numlines = 1;
     buf->b_ml.ml_chunksize[0].mlcs_totalsize =
       (long)STRLEN(buf->b_ml.ml_line_ptr) + 1;
+    buf->b_ml.ml_chunktree_len = 0;
     return;
   }
 
@@ -4313,13 +5001,15 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
    */
   if (buf != ml_upd_lastbuf || line != ml_upd_lastline + 1
       || updtype != ML_CHNK_ADDLINE) {
-    for (curline = 1, curix = 0;
-         curix < buf->b_ml.ml_usedchunks - 1
-                 && line >= curline +
-                             buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-         curix++) {
-      curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-    }
+    curix = ml_chunktree_find(buf, line, 0L, FALSE, &curline, &size);
+    if (curix < 0)
+      for (curline = 1, curix = 0;
+           curix < buf->b_ml.ml_usedchunks - 1
+           && line >= curline +
+           buf->b_ml.ml_chunksize[curix].mlcs_numlines;
+           curix++) {
+        curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
+      }
   } else if (line >= curline + buf->b_ml.ml_chunksize[curix].mlcs_numlines
              && curix < buf->b_ml.ml_usedchunks - 1) {
     /* Adjust cached curix & curline */
@@ -4331,6 +5021,8 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
   if (updtype == ML_CHNK_DELLINE)
     len = -len;
   curchnk->mlcs_totalsize += len;
+  ml_chunktree_add(buf, curix, updtype == ML_CHNK_ADDLINE ? 1
+      : updtype == ML_CHNK_DELLINE ? -1 : 0, len);
   if (updtype == ML_CHNK_ADDLINE) {
     curchnk->mlcs_numlines++;
 
@@ -4353,6 +5045,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
       int text_end;
       int linecnt;
 
+      buf->b_ml.ml_chunktree_len = 0;       /* chunks move, rebuild tree */
       mch_memmove(buf->b_ml.ml_chunksize + curix + 1,
           buf->b_ml.ml_chunksize + curix,
           (buf->b_ml.ml_usedchunks - curix) *
@@ -4402,6 +5095,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
        */
       curchnk = buf->b_ml.ml_chunksize + curix + 1;
       buf->b_ml.ml_usedchunks++;
+      buf->b_ml.ml_chunktree_len = 0;
       if (line == buf->b_ml.ml_line_count) {
         curchnk->mlcs_numlines = 0;
         curchnk->mlcs_totalsize = 0;
@@ -4437,6 +5131,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
       curix++;
       curchnk = buf->b_ml.ml_chunksize + curix;
     } else if (curix == 0 && curchnk->mlcs_numlines <= 0)   {
+      buf->b_ml.ml_chunktree_len = 0;
       buf->b_ml.ml_usedchunks--;
       mch_memmove(buf->b_ml.ml_chunksize, buf->b_ml.ml_chunksize + 1,
           buf->b_ml.ml_usedchunks * sizeof(chunksize_T));
@@ -4449,6 +5144,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
     }
 
     /* Collapse chunks */
+    buf->b_ml.ml_chunktree_len = 0;
     curchnk[-1].mlcs_numlines += curchnk->mlcs_numlines;
     curchnk[-1].mlcs_totalsize += curchnk->mlcs_totalsize;
     buf->b_ml.ml_usedchunks--;
@@ -4491,6 +5187,22 @@ long ml_find_line_or_offset(buf_T *buf, linenr_T lnum, long *offp)
   /* take care of cached line first */
   ml_flush_line(curbuf);
 
+#ifdef HAVE_SYS_MMAN_H
+  /* Without CRs the offset of a line in a mapped file is what is needed.
+   * Otherwise the lines are put in the memline to count them. */
+  if (buf->b_ml.ml_map != NULL && lnum > 0 && !ffdos
+      && !buf->b_ml.ml_map->mm_dos) {
+    size = ml_map_size(buf->b_ml.ml_map, lnum, buf->b_ml.ml_line_count);
+    /* Don't count the last line break if 'bin' and 'noeol'. */
+    if (size > 0 && buf->b_p_bin && !buf->b_p_eol)
+      --size;
+    return size;
+  }
+  if (buf->b_ml.ml_map != NULL && (lnum > 0 || (offp != NULL && *offp > 0))
+      && ml_unmap(buf) == FAIL)
+    return -1;
+#endif
+
   if (buf->b_ml.ml_usedchunks == -1
       || buf->b_ml.ml_chunksize == NULL
       || lnum < 0)
@@ -4508,19 +5220,21 @@ long ml_find_line_or_offset(buf_T *buf, linenr_T lnum, long *offp)
    */
   curline = 1;
   curix = size = 0;
-  while (curix < buf->b_ml.ml_usedchunks - 1
-         && ((lnum != 0
-              && lnum >= curline + buf->b_ml.ml_chunksize[curix].mlcs_numlines)
-             || (offset != 0
-                 && offset > size +
-                 buf->b_ml.ml_chunksize[curix].mlcs_totalsize
-                 + ffdos * buf->b_ml.ml_chunksize[curix].mlcs_numlines))) {
-    curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-    size += buf->b_ml.ml_chunksize[curix].mlcs_totalsize;
-    if (offset && ffdos)
-      size += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-    curix++;
-  }
+  if (ml_chunktree_find(buf, lnum, offset, ffdos, &curline, &size) < 0)
+    while (curix < buf->b_ml.ml_usedchunks - 1
+           && ((lnum != 0
+                && lnum >= curline +
+                buf->b_ml.ml_chunksize[curix].mlcs_numlines)
+               || (offset != 0
+                   && offset > size +
+                   buf->b_ml.ml_chunksize[curix].mlcs_totalsize
+                   + ffdos * buf->b_ml.ml_chunksize[curix].mlcs_numlines))) {
+      curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
+      size += buf->b_ml.ml_chunksize[curix].mlcs_totalsize;
+      if (offset && ffdos)
+        size += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
+      curix++;
+    }
 
   while ((lnum != 0 && curline < lnum) || (offset != 0 && size < offset)) {
     if (curline > buf->b_ml.ml_line_count
@@ -2487,6 +2487,9 @@ static void changed_common(linenr_T lnum, colnr_T col, linenr_T lnume, long xtra
   /* mark the buffer as modified */
   changed();
 
+  /* lines without a 'hlsearch' or match highlight may have changed */
+  hlcache_changed(curbuf, lnum, lnume, xtra);
+
   /* set the '. mark */
   if (!cmdmod.keepjumps) {
     curbuf->b_last_change.lnum = lnum;
@@ -1999,6 +1999,7 @@ static struct key_name_entry {
   {K_ZERO,            (char_u *)"Nul"},
   {K_SNR,             (char_u *)"SNR"},
   {K_PLUG,            (char_u *)"Plug"},
+  {K_CURSORHOLD,      (char_u *)"CursorHold"},
   {0,                 NULL}
 };
 
@@ -5347,3 +5348,23 @@ int has_non_ascii(char_u *s)
   return FALSE;
 }
 #endif
+
+/*
+ * Return TRUE if one of the "len" bytes at "p" is not ASCII (128 or higher).
+ * Looks at a long at a time, a run of ASCII text is skipped quickly.
+ */
+int has_non_ascii_len(char_u *p, size_t len)
+{
+  long_u w;
+  long_u mask = (long_u)-1 / 0xff * 0x80;       /* 0x80 in every byte */
+
+  for (; len >= sizeof(long_u); p += sizeof(long_u), len -= sizeof(long_u)) {
+    memcpy(&w, p, sizeof(long_u));
+    if (w & mask)
+      return TRUE;
+  }
+  for (; len > 0; ++p, --len)
+    if (*p >= 128)
+      return TRUE;
+  return FALSE;
+}
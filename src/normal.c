@@ -6981,6 +6981,10 @@ static void nv_goto(cmdarg_T *cap)
 {
   linenr_T lnum;
 
+  /* Going to the end of a file loaded in the background waits for it, like
+   * "G" in less. */
+  if (cap->arg || cap->count0 > curbuf->b_ml.ml_line_count)
+    readfile_bg_wait(curbuf);
   if (cap->arg)
     lnum = curbuf->b_ml.ml_line_count;
   else
@@ -7457,9 +7461,13 @@ static void nv_open(cmdarg_T *cap)
  * Trigger CursorHold event.
  * When waiting for a character for 'updatetime' K_CURSORHOLD is put in the
  * input buffer.  "did_cursorhold" is set to avoid retriggering.
+ * Syntax attributes below the window are computed like while waiting, for
+ * when the key was not typed, e.g. feedkeys("\<CursorHold>").  After waiting
+ * they were already done.
  */
 static void nv_cursorhold(cmdarg_T *cap)
 {
+  syntax_idle(FALSE);
   apply_autocmds(EVENT_CURSORHOLD, NULL, NULL, FALSE, curbuf);
   did_cursorhold = TRUE;
   cap->retval |= CA_COMMAND_BUSY;       /* don't call edit() now */
@@ -370,6 +370,9 @@ static struct vimoption
    (char_u *)&p_ambw, PV_NONE,
    {(char_u *)"single", (char_u *)0L}
    SCRIPTID_INIT},
+  {"asyncload",  "asl",   P_BOOL|P_VI_DEF,
+   (char_u *)&p_asl, PV_NONE,
+   {(char_u *)FALSE, (char_u *)0L} SCRIPTID_INIT},
   {"autochdir",  "acd",   P_BOOL|P_VI_DEF,
    (char_u *)&p_acd, PV_NONE,
    {(char_u *)FALSE, (char_u *)0L} SCRIPTID_INIT},
@@ -280,6 +280,7 @@
  */
 
 EXTERN long p_aleph;            /* 'aleph' */
+EXTERN int p_asl;               /* 'asyncload' */
 EXTERN int p_acd;               /* 'autochdir' */
 EXTERN char_u   *p_ambw;        /* 'ambiwidth' */
 EXTERN int p_ar;                /* 'autoread' */
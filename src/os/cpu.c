@@ -0,0 +1,29 @@
+/* vi:set ts=8 sts=4 sw=4:
+ *
+ * VIM - Vi IMproved	by Bram Moolenaar
+ *
+ * Do ":help uganda"  in Vim to read copying and usage conditions.
+ * Do ":help credits" in Vim to see a list of people who contributed.
+ * See README.txt for an overview of the Vim source code.
+ */
+
+/*
+ * cpu.c -- query the processors
+ */
+
+#include <uv.h>
+
+#include "os.h"
+
+/*
+ * Return the number of processors, at least one.
+ */
+int mch_cpu_count(void) {
+  uv_cpu_info_t *cpu_infos;
+  int count;
+
+  if (uv_cpu_info(&cpu_infos, &count) != 0)
+    return 1;
+  uv_free_cpu_info(cpu_infos, count);
+  return count > 0 ? count : 1;
+}
@@ -5,5 +5,6 @@
 
 long_u mch_total_mem(int special);
 int mch_chdir(char *path);
+int mch_cpu_count(void);
 
 #endif
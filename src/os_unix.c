@@ -33,6 +33,10 @@
 
 #include "os_unixx.h"       /* unix includes for os_unix.c only */
 
+#if defined(HAVE_SETJMP_H) && defined(HAVE_SYS_MMAN_H)
+# include <pthread.h>           /* for pthread_self() */
+#endif
+
 #ifdef HAVE_SELINUX
 # include <selinux/selinux.h>
 static int selinux_enabled = -1;
@@ -108,6 +112,9 @@ static void catch_int_signal __ARGS((void));
 static void set_signals __ARGS((void));
 static void catch_signals __ARGS(
     (RETSIGTYPE (*func_deadly)(), RETSIGTYPE (*func_other)()));
+#if defined(HAVE_SETJMP_H) && defined(HAVE_SYS_MMAN_H)
+static void map_guard_jump __ARGS((void));
+#endif
 static int have_wildcard __ARGS((int, char_u **));
 static int have_dollars __ARGS((int, char_u **));
 
@@ -261,6 +268,19 @@ int mch_inchar(
             handle_resize();
         }
     } else   {    /* wtime == -1 */
+        /* While no character is available add the lines of files that are
+         * loaded in the background. */
+        while (readfile_bg_busy() && WaitForChar(BGLOAD_WAIT) == 0) {
+            while (do_resize)
+                handle_resize();
+            readfile_bg_poll();
+        }
+
+        /* While no character is available compute syntax highlighting
+         * for the lines below the window. */
+        if (WaitForChar(0L) == 0)
+            syntax_idle(TRUE);
+
         /*
          * If there is no character available within 'updatetime' seconds
          * flush all the swap files to disk.
@@ -605,6 +625,75 @@ void mch_didjmp()          {
 
 #endif
 
+#if (defined(HAVE_SETJMP_H) && defined(HAVE_SYS_MMAN_H)) || defined(PROTO)
+# define MAP_GUARD_MAX  8       /* max nr of threads reading a mapping */
+
+/* Where to jump to when a thread gets a SIGBUS while reading a mapped file,
+ * by thread.  volatile because it is used in signal handler deathtrap(). */
+static struct {
+  pthread_t mg_thread;
+  JMP_BUF           *volatile mg_env;
+  volatile int mg_jumped;       /* jumped, SIGBUS is still blocked */
+} map_guards[MAP_GUARD_MAX];
+
+/*
+ * Protect reading a mapped file against a SIGBUS, which happens when the file
+ * is truncated by another process.  "idx" is zero for the main thread and a
+ * different number for each other thread reading the mapping.
+ * Usage:
+ *	if (SETJMP(env) != 0)
+ *	{
+ *	    mch_map_guard(idx, NULL);
+ *	    the file was truncated;
+ *	}
+ *	else
+ *	{
+ *	    mch_map_guard(idx, &env);
+ *	    read the mapping;
+ *	    mch_map_guard(idx, NULL);
+ *	}
+ */
+void mch_map_guard(int idx, JMP_BUF *env)
+{
+  sigset_t set;
+
+  if (idx < 0 || idx >= MAP_GUARD_MAX)
+    return;
+  if (env != NULL)
+    map_guards[idx].mg_thread = pthread_self();
+  map_guards[idx].mg_env = env;
+
+  /* LONGJMP() may not restore the signal mask, SIGBUS would remain blocked
+   * and the next one kills Vim. */
+  if (map_guards[idx].mg_jumped) {
+    map_guards[idx].mg_jumped = FALSE;
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  }
+}
+
+/*
+ * Called by deathtrap() for a SIGBUS: when the current thread is reading a
+ * mapped file jump back to where it set the guard.  Otherwise return.
+ */
+static void map_guard_jump(void)
+{
+  JMP_BUF     *env;
+  int i;
+
+  for (i = 0; i < MAP_GUARD_MAX; ++i) {
+    env = map_guards[i].mg_env;
+    if (env != NULL && pthread_equal(map_guards[i].mg_thread, pthread_self())) {
+      map_guards[i].mg_env = NULL;      /* don't jump again */
+      map_guards[i].mg_jumped = TRUE;
+      LONGJMP(*env, 1);
+      /* NOTREACHED */
+    }
+  }
+}
+#endif
+
 /*
  * This function handles deadly signals.
  * It tries to preserve any swap files and exit properly.
@@ -636,6 +725,11 @@ deathtrap SIGDEFARG(sigarg) {
     /* NOTREACHED */
   }
 #endif
+#if defined(HAVE_SETJMP_H) && defined(HAVE_SYS_MMAN_H) && defined(SIGHASARG)
+  /* A mapped file was truncated. */
+  if (sigarg == SIGBUS)
+    map_guard_jump();
+#endif
 
 #ifdef SIGHASARG
 # ifdef SIGQUIT
@@ -1763,6 +1857,7 @@ void mch_exit(int r)
   }
   out_flush();
   ml_close_all(TRUE);           /* remove all memfiles */
+  mf_flush_stop();              /* wait for swap files to be flushed */
   may_core_dump();
 
 #ifdef MACOS_CONVERT
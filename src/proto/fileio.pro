@@ -4,6 +4,11 @@ int readfile __ARGS((char_u *fname, char_u *sfname, linenr_T from,
                      linenr_T lines_to_skip, linenr_T lines_to_read, exarg_T *
                      eap,
                      int flags));
+int readfile_bg_busy __ARGS((void));
+void readfile_bg_poll __ARGS((void));
+void readfile_bg_wait __ARGS((buf_T *buf));
+void readfile_bg_cancel __ARGS((buf_T *buf));
+int readfile_bg_percent __ARGS((buf_T *buf));
 int prep_exarg __ARGS((exarg_T *eap, buf_T *buf));
 void set_file_options __ARGS((int set_options, exarg_T *eap));
 void set_forced_fenc __ARGS((exarg_T *eap));
@@ -65,6 +70,8 @@ void unblock_autocmds __ARGS((void));
 int is_autocmd_blocked __ARGS((void));
 char_u *getnextac __ARGS((int c, void *cookie, int indent));
 int has_autocmd __ARGS((event_T event, char_u *sfname, buf_T *buf));
+int has_autocmd_but_ftdetect __ARGS((event_T event, char_u *sfname,
+                                     buf_T *buf));
 char_u *get_augroup_name __ARGS((expand_T *xp, int idx));
 char_u *set_context_in_autocmd __ARGS((expand_T *xp, char_u *arg, int doautocmd));
 char_u *get_event_name __ARGS((expand_T *xp, int idx));
@@ -9,10 +9,12 @@ bhdr_T *mf_get __ARGS((memfile_T *mfp, blocknr_T nr, int page_count));
 void mf_put __ARGS((memfile_T *mfp, bhdr_T *hp, int dirty, int infile));
 void mf_free __ARGS((memfile_T *mfp, bhdr_T *hp));
 int mf_sync __ARGS((memfile_T *mfp, int flags));
+void mf_flush_stop __ARGS((void));
 void mf_set_dirty __ARGS((memfile_T *mfp));
 int mf_release_all __ARGS((void));
 blocknr_T mf_trans_del __ARGS((memfile_T *mfp, blocknr_T old_nr));
 void mf_set_ffname __ARGS((memfile_T *mfp));
 void mf_fullname __ARGS((memfile_T *mfp));
 int mf_need_trans __ARGS((memfile_T *mfp));
+long_u mf_get_stats __ARGS((memfile_T *mfp, mfstats_T *stats));
 /* vim: set ft=c : */
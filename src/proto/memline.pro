@@ -24,9 +24,14 @@ int ml_append_buf __ARGS((buf_T *buf, linenr_T lnum, char_u *line, colnr_T len,
                           int newfile));
 int ml_replace __ARGS((linenr_T lnum, char_u *line, int copy));
 int ml_delete __ARGS((linenr_T lnum, int message));
+linenr_T ml_find_text __ARGS((buf_T *buf, linenr_T lnum, linenr_T lnum_end,
+                               int dir, char_u *text, int len, int ic));
 void ml_setmarked __ARGS((linenr_T lnum));
 linenr_T ml_firstmarked __ARGS((void));
 void ml_clearmarked __ARGS((void));
+void ml_map_attach __ARGS((buf_T *buf, mlmap_T *mm, linenr_T count));
+int ml_unmap __ARGS((buf_T *buf));
+void ml_map_drop __ARGS((buf_T *buf));
 int resolve_symlink __ARGS((char_u *fname, char_u *buf));
 char_u *makeswapname __ARGS((char_u *fname, char_u *ffname, buf_T *buf,
                              char_u *dir_name));
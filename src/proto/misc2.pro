@@ -130,4 +130,5 @@ char_u *read_string __ARGS((FILE *fd, int cnt));
 int put_bytes __ARGS((FILE *fd, long_u nr, int len));
 void put_time __ARGS((FILE *fd, time_t the_time));
 int has_non_ascii __ARGS((char_u *s));
+int has_non_ascii_len __ARGS((char_u *p, size_t len));
 /* vim: set ft=c : */
@@ -7,6 +7,7 @@ int mch_stackcheck __ARGS((char *p));
 void mch_startjmp __ARGS((void));
 void mch_endjmp __ARGS((void));
 void mch_didjmp __ARGS((void));
+void mch_map_guard __ARGS((int idx, JMP_BUF *env));
 void mch_suspend __ARGS((void));
 void mch_init __ARGS((void));
 void reset_signals __ARGS((void));
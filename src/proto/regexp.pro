@@ -1,6 +1,7 @@
 /* regexp.c */
 int re_multiline __ARGS((regprog_T *prog));
 int re_lookbehind __ARGS((regprog_T *prog));
+int re_posdep __ARGS((regprog_T *prog));
 char_u *skip_regexp __ARGS((char_u *startp, int dirc, int magic, char_u **newp));
 int vim_regcomp_had_eol __ARGS((void));
 void free_regexp_stuff __ARGS((void));
@@ -14,11 +15,14 @@ int vim_regsub_multi __ARGS((regmmatch_T *rmp, linenr_T lnum, char_u *source,
                              char_u *dest, int copy, int magic,
                              int backslash));
 char_u *reg_submatch __ARGS((int no));
+void ex_regexpcache __ARGS((exarg_T *eap));
 regprog_T *vim_regcomp __ARGS((char_u *expr_arg, int re_flags));
+regprog_T *vim_regref __ARGS((regprog_T *prog));
 void vim_regfree __ARGS((regprog_T *prog));
 int vim_regexec __ARGS((regmatch_T *rmp, char_u *line, colnr_T col));
 int vim_regexec_nl __ARGS((regmatch_T *rmp, char_u *line, colnr_T col));
 long vim_regexec_multi __ARGS((regmmatch_T *rmp, win_T *win, buf_T *buf,
                                linenr_T lnum, colnr_T col,
-                               proftime_T *tm));
+                               proftime_T *tm, int *timed_out));
+char_u *vim_regmust __ARGS((regprog_T *prog, int *icp, int *lenp));
 /* vim: set ft=c : */
@@ -1,5 +1,8 @@
 /* syntax.c */
+void syn_set_timeout __ARGS((proftime_T *tm));
 void syntax_start __ARGS((win_T *wp, linenr_T lnum));
+void syntax_idle __ARGS((int typeahead));
+int *syntax_line_attrs __ARGS((win_T *wp, linenr_T lnum, int *lenp));
 void syn_stack_free_all __ARGS((synblock_T *block));
 void syn_stack_apply_changes __ARGS((buf_T *buf));
 void syntax_end_parsing __ARGS((linenr_T lnum));
@@ -12,7 +12,9 @@
  */
 
 #include "vim.h"
+#include "os/os.h"
 
+#include <uv.h>                 /* for uv_thread_create() */
 
 struct dir_stack_T {
   struct dir_stack_T  *next;
@@ -71,6 +73,37 @@ struct qf_info_S {
 
 static qf_info_T ql_info;       /* global quickfix list */
 
+#define VGR_READ_MAX    0x1000000L      /* max size of a file read ahead */
+#define VGR_AHEAD       8               /* max nr of files read ahead */
+#define VGR_THREADS     4               /* max nr of reading threads */
+
+/*
+ * A file read ahead for ":vimgrep".
+ */
+typedef struct {
+  char_u      *vt_text;         /* file text plus a NUL, NULL when the file
+                                   must be loaded into a buffer */
+  long vt_len;                  /* length of vt_text */
+  int vt_done;                  /* TRUE when reading the file finished */
+} vgrtext_T;
+
+/*
+ * Threads reading the files for ":vimgrep" ahead of matching them.
+ */
+typedef struct {
+  char_u      **vr_fnames;      /* full names of the files */
+  int vr_fcount;                /* nr of files */
+  int vr_check_utf8;            /* files must be valid UTF-8 */
+  int vr_nthreads;              /* nr of threads started */
+  uv_thread_t vr_threads[VGR_THREADS];
+  uv_mutex_t vr_mutex;          /* protects the items below */
+  uv_cond_t vr_cond;            /* signalled when the items below change */
+  int vr_next;                  /* file the next thread reads */
+  int vr_get;                   /* file vgr_get() returns next */
+  vgrtext_T vr_done[VGR_AHEAD]; /* files read, by number */
+  int vr_cancel;                /* threads must stop */
+} vgrread_T;
+
 #define FMT_PATTERNS 10         /* maximum number of % recognized */
 
 /*
@@ -135,6 +168,17 @@ static buf_T    *load_dummy_buffer __ARGS((char_u *fname, char_u *dirname_start,
                                            char_u *resulting_dir));
 static void wipe_dummy_buffer __ARGS((buf_T *buf, char_u *dirname_start));
 static void unload_dummy_buffer __ARGS((buf_T *buf, char_u *dirname_start));
+static int vgr_can_read __ARGS((regprog_T *prog));
+static int vgr_can_match_text __ARGS((char_u *fname));
+static char_u *vgr_read_file __ARGS((char_u *fname, int check_utf8,
+                                     long *lenp));
+static void vgr_start __ARGS((vgrread_T *vr, char_u **fnames, int fcount));
+static void vgr_thread __ARGS((void *arg));
+static char_u *vgr_get __ARGS((vgrread_T *vr, int fi, long *lenp));
+static void vgr_stop __ARGS((vgrread_T *vr));
+static void vgr_match_text __ARGS((qf_info_T *qi, qfline_T **prevp,
+                                   char_u *fname, regmatch_T *rmp, int flags,
+                                   char_u *text, long len, long *tomatchp));
 static qf_info_T *ll_get_or_alloc_list __ARGS((win_T *));
 
 /* Quickfix window check helper macro */
@@ -2718,8 +2762,13 @@ void ex_cfile(exarg_T *eap)
 void ex_vimgrep(exarg_T *eap)
 {
   regmmatch_T regmatch;
+  regmatch_T rm;
   int fcount;
   char_u      **fnames;
+  char_u      **fullnames = NULL;
+  vgrread_T vr;
+  char_u      *text;
+  long textlen = 0;
   char_u      *fname;
   char_u      *s;
   char_u      *p;
@@ -2835,6 +2884,25 @@ void ex_vimgrep(exarg_T *eap)
    * ":lcd %:p:h" changes the meaning of short path names. */
   mch_dirname(dirname_start, MAXPATHL);
 
+  /* When possible read the files in other threads and match their text,
+   * instead of loading each file into a buffer. */
+  if (vgr_can_read(regmatch.regprog)) {
+    fullnames = (char_u **)alloc_clear((unsigned)(fcount * sizeof(char_u *)));
+    if (fullnames != NULL) {
+      for (fi = 0; fi < fcount; ++fi)
+        if ((fullnames[fi] = FullName_save(fnames[fi], FALSE)) == NULL)
+          break;
+      if (fi < fcount) {
+        FreeWild(fcount, fullnames);
+        fullnames = NULL;
+      } else {
+        rm.regprog = regmatch.regprog;
+        rm.rm_ic = p_ic;
+        vgr_start(&vr, fullnames, fcount);
+      }
+    }
+  }
+
   /* Remember the value of qf_start, so that we can check for autocommands
    * changing the current quickfix list. */
   cur_qf_start = qi->qf_lists[qi->qf_curlist].qf_start;
@@ -2862,6 +2930,19 @@ void ex_vimgrep(exarg_T *eap)
     }
 
     buf = buflist_findname_exp(fnames[fi]);
+    if (fullnames != NULL) {
+      text = vgr_get(&vr, fi, &textlen);
+      if (text != NULL && (buf == NULL || buf->b_ml.ml_mfp == NULL)
+          && vgr_can_match_text(fname)) {
+        vgr_match_text(qi, &prevp, fname, &rm, flags, text, textlen,
+            &tomatch);
+        free(text);
+        cur_qf_start = qi->qf_lists[qi->qf_curlist].qf_start;
+        continue;
+      }
+      free(text);
+    }
+
     if (buf == NULL || buf->b_ml.ml_mfp == NULL) {
       /* Remember that a buffer with this name already exists. */
       duplicate_name = (buf != NULL);
@@ -2913,7 +2994,7 @@ void ex_vimgrep(exarg_T *eap)
            ++lnum) {
         col = 0;
         while (vim_regexec_multi(&regmatch, curwin, buf, lnum,
-                   col, NULL) > 0) {
+                   col, NULL, NULL) > 0) {
           ;
           if (qf_add_entry(qi, &prevp,
                   NULL,                     /* dir */
@@ -2998,6 +3079,10 @@ void ex_vimgrep(exarg_T *eap)
     }
   }
 
+  if (fullnames != NULL) {
+    vgr_stop(&vr);
+    FreeWild(fcount, fullnames);
+  }
   FreeWild(fcount, fnames);
 
   qi->qf_lists[qi->qf_curlist].qf_nonevalid = FALSE;
@@ -3240,6 +3325,343 @@ static void unload_dummy_buffer(buf_T *buf, char_u *dirname_start)
   }
 }
 
+/*
+ * Return TRUE when ":vimgrep" can read files itself instead of loading them
+ * into a buffer and matching "prog" against the buffer lines.  This requires
+ * that matching doesn't depend on the buffer, a match does not include a line
+ * break and reading a file does not change the text, apart from the checks
+ * done by vgr_read_file().
+ */
+static int vgr_can_read(regprog_T *prog)
+{
+  char_u      *p = p_fencs;
+  char_u      *fenc;
+  char_u      *enc;
+  char_u      *isk = NULL;
+  long n;
+  int r;
+
+  if (re_multiline(prog) || re_posdep(prog))
+    return FALSE;
+
+  /* A buffer gets the global 'iskeyword', matching uses the current one. */
+  get_option_value((char_u *)"isk", &n, &isk, OPT_GLOBAL);
+  r = isk != NULL && STRCMP(isk, curbuf->b_p_isk) == 0;
+  vim_free(isk);
+  if (!r)
+    return FALSE;
+
+  /* Lines must be split at a NL only, double-byte text is not checked. */
+  if (vim_strchr(p_ffs, 'u') == NULL)
+    return FALSE;
+  if (has_mbyte && !enc_utf8)
+    return FALSE;
+
+  /* The first encoding tried after "ucs-bom" must be 'encoding'. */
+  if (*p == NUL)
+    return TRUE;
+  if (STRNCMP(p, "ucs-bom", 7) == 0 && (p[7] == ',' || p[7] == NUL))
+    p += p[7] == ',' ? 8 : 7;
+  if (*p == NUL)
+    return TRUE;
+  fenc = vim_strchr(p, ',');
+  fenc = vim_strnsave(p, fenc == NULL ? (int)STRLEN(p) : (int)(fenc - p));
+  if (fenc == NULL)
+    return FALSE;
+  enc = enc_canonize(fenc);
+  r = enc != NULL && STRCMP(enc, p_enc) == 0;
+  vim_free(enc);
+  vim_free(fenc);
+  return r;
+}
+
+/*
+ * Return TRUE when the text of file "fname" read by vgr_read_file() can be
+ * matched, because there are no autocommands that loading it into a buffer
+ * would trigger.  Filetype detection that only sets 'filetype' is ignored:
+ * it would only change the dummy buffer, Filetype autocommands are disabled
+ * while loading it.
+ */
+static int vgr_can_match_text(char_u *fname)
+{
+  static event_T events[] = {EVENT_BUFREADCMD, EVENT_BUFREADPRE,
+                             EVENT_BUFREADPOST, EVENT_SWAPEXISTS,
+                             EVENT_BUFUNLOAD, EVENT_BUFDELETE,
+                             EVENT_BUFWIPEOUT};
+  int i;
+
+  for (i = 0; i < (int)(sizeof(events) / sizeof(events[0])); ++i)
+    if (has_autocmd_but_ftdetect(events[i], fname, NULL))
+      return FALSE;
+  return TRUE;
+}
+
+/*
+ * Read file "fname" for ":vimgrep".  May run in a reading thread, thus it
+ * uses malloc() instead of alloc(), which may give messages.
+ * Returns the text followed by a NUL and sets "*lenp" to its length.
+ * Returns NULL when the file must be loaded into a buffer: it can't be read,
+ * is not a regular file or is big, or readfile() would change the text: it
+ * contains a NUL or CR, starts with a byte order mark or is encrypted, or
+ * "check_utf8" is TRUE and it contains an illegal UTF-8 byte.
+ */
+static char_u *vgr_read_file(char_u *fname, int check_utf8, long *lenp)
+{
+  int fd;
+  struct stat st;
+  char_u      *text;
+  char_u      *p;
+  char_u      *end;
+  long len = 0;
+  long n;
+
+  fd = mch_open((char *)fname, O_RDONLY | O_EXTRA, 0);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+      || st.st_size > VGR_READ_MAX
+      || (text = (char_u *)malloc((size_t)st.st_size + 1)) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  while (len < (long)st.st_size) {
+    n = read(fd, text + len, (size_t)(st.st_size - len));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len += n;
+  }
+  close(fd);
+  text[len] = NUL;
+
+  end = text + len;
+  if (memchr(text, NUL, (size_t)len) != NULL
+      || memchr(text, CAR, (size_t)len) != NULL
+      || (len >= 2 && ((text[0] == 0xfe && text[1] == 0xff)
+                       || (text[0] == 0xff && text[1] == 0xfe)))
+      || (len >= 3 && text[0] == 0xef && text[1] == 0xbb && text[2] == 0xbf)
+      || STRNCMP(text, "VimCrypt~", 9) == 0) {
+    free(text);
+    return NULL;
+  }
+  if (check_utf8)
+    for (p = text; p < end; ) {
+      if (*p < 0x80)
+        ++p;
+      else {
+        int l = utf_ptr2len_len(p, (int)(end - p));
+
+        if (l == 1 || l > end - p) {
+          free(text);
+          return NULL;
+        }
+        p += l;
+      }
+    }
+
+  *lenp = len;
+  return text;
+}
+
+/*
+ * Start threads that read the "fcount" files "fnames" ahead of matching
+ * them.  The names must be full paths, the current directory may change
+ * while the threads are running.  Use vgr_get() to obtain the text of each
+ * file in order and vgr_stop() when done.
+ * When no thread can be started vgr_get() reads the files itself.
+ */
+static void vgr_start(vgrread_T *vr, char_u **fnames, int fcount)
+{
+  int nthreads;
+  int i;
+
+  vr->vr_fnames = fnames;
+  vr->vr_fcount = fcount;
+  vr->vr_check_utf8 = enc_utf8;
+  vr->vr_nthreads = 0;
+  vr->vr_next = 0;
+  vr->vr_get = 0;
+  for (i = 0; i < VGR_AHEAD; ++i) {
+    vr->vr_done[i].vt_text = NULL;
+    vr->vr_done[i].vt_done = FALSE;
+  }
+  vr->vr_cancel = FALSE;
+  if (fcount < 2)
+    return;
+  if (uv_mutex_init(&vr->vr_mutex) != 0)
+    return;
+  if (uv_cond_init(&vr->vr_cond) != 0) {
+    uv_mutex_destroy(&vr->vr_mutex);
+    return;
+  }
+
+  /* Leave one processor for matching. */
+  nthreads = mch_cpu_count() - 1;
+  if (nthreads < 1)
+    nthreads = 1;
+  else if (nthreads > VGR_THREADS)
+    nthreads = VGR_THREADS;
+  for (i = 0; i < nthreads; ++i) {
+    if (uv_thread_create(&vr->vr_threads[i], vgr_thread, vr) != 0)
+      break;
+    ++vr->vr_nthreads;
+  }
+  if (vr->vr_nthreads == 0) {
+    uv_cond_destroy(&vr->vr_cond);
+    uv_mutex_destroy(&vr->vr_mutex);
+  }
+}
+
+/*
+ * A reading thread.  It must not use anything but "vr" and the file system.
+ */
+static void vgr_thread(void *arg)
+{
+  vgrread_T   *vr = (vgrread_T *)arg;
+  vgrtext_T   *vt;
+  char_u      *text;
+  long len = 0;
+  int fi;
+  sigset_t set;
+
+  /* Signals are handled by the main thread. */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  for (;; ) {
+    /* Take the next file, unless too many are waiting to be matched. */
+    uv_mutex_lock(&vr->vr_mutex);
+    while (!vr->vr_cancel && vr->vr_next < vr->vr_fcount
+           && vr->vr_next >= vr->vr_get + VGR_AHEAD)
+      uv_cond_wait(&vr->vr_cond, &vr->vr_mutex);
+    if (vr->vr_cancel || vr->vr_next >= vr->vr_fcount) {
+      uv_mutex_unlock(&vr->vr_mutex);
+      break;
+    }
+    fi = vr->vr_next++;
+    uv_mutex_unlock(&vr->vr_mutex);
+
+    text = vgr_read_file(vr->vr_fnames[fi], vr->vr_check_utf8, &len);
+
+    uv_mutex_lock(&vr->vr_mutex);
+    vt = &vr->vr_done[fi % VGR_AHEAD];
+    vt->vt_text = text;
+    vt->vt_len = len;
+    vt->vt_done = TRUE;
+    uv_cond_broadcast(&vr->vr_cond);
+    uv_mutex_unlock(&vr->vr_mutex);
+  }
+}
+
+/*
+ * Return the text of file "fi", as vgr_read_file() does.  Must be called for
+ * every file, in order.  The caller must free() the text.
+ */
+static char_u *vgr_get(vgrread_T *vr, int fi, long *lenp)
+{
+  vgrtext_T   *vt = &vr->vr_done[fi % VGR_AHEAD];
+  char_u      *text;
+
+  if (vr->vr_nthreads == 0)
+    return vgr_read_file(vr->vr_fnames[fi], vr->vr_check_utf8, lenp);
+
+  uv_mutex_lock(&vr->vr_mutex);
+  while (!vt->vt_done)
+    uv_cond_wait(&vr->vr_cond, &vr->vr_mutex);
+  text = vt->vt_text;
+  *lenp = vt->vt_len;
+  vt->vt_text = NULL;
+  vt->vt_done = FALSE;
+  vr->vr_get = fi + 1;
+  uv_cond_broadcast(&vr->vr_cond);
+  uv_mutex_unlock(&vr->vr_mutex);
+  return text;
+}
+
+/*
+ * Stop the reading threads and free the text of the files that were read but
+ * not obtained with vgr_get().
+ */
+static void vgr_stop(vgrread_T *vr)
+{
+  int i;
+
+  if (vr->vr_nthreads == 0)
+    return;
+  uv_mutex_lock(&vr->vr_mutex);
+  vr->vr_cancel = TRUE;
+  uv_cond_broadcast(&vr->vr_cond);
+  uv_mutex_unlock(&vr->vr_mutex);
+  for (i = 0; i < vr->vr_nthreads; ++i)
+    uv_thread_join(&vr->vr_threads[i]);
+  for (i = 0; i < VGR_AHEAD; ++i)
+    free(vr->vr_done[i].vt_text);
+  uv_cond_destroy(&vr->vr_cond);
+  uv_mutex_destroy(&vr->vr_mutex);
+  vr->vr_nthreads = 0;
+}
+
+/*
+ * Match "rmp" against the lines in "text", the "len" bytes of file "fname"
+ * read by vgr_read_file(), like ex_vimgrep() does for the lines of a buffer.
+ * The NLs in "text" are replaced with NULs.  Matches are added to list "qi"
+ * after "*prevp", at most "*tomatchp", which is decremented for each match.
+ */
+static void vgr_match_text(qf_info_T *qi, qfline_T **prevp, char_u *fname,
+                           regmatch_T *rmp, int flags, char_u *text, long len,
+                           long *tomatchp)
+{
+  char_u      *end = text + len;
+  char_u      *p;
+  char_u      *nl;
+  linenr_T lnum;
+  colnr_T col;
+  colnr_T endcol;
+
+  /* An empty file has one empty line, like a buffer. */
+  for (p = text, lnum = 1; *tomatchp > 0; p = nl + 1, ++lnum) {
+    nl = memchr(p, NL, (size_t)(end - p));
+    if (nl == NULL) {
+      if (p == end && lnum > 1)
+        break;
+      nl = end;
+    }
+    *nl = NUL;
+
+    col = 0;
+    while (vim_regexec(rmp, p, col)) {
+      if (qf_add_entry(qi, prevp,
+              NULL,                     /* dir */
+              fname,
+              0,
+              p,
+              lnum,
+              (int)(rmp->startp[0] - p) + 1,
+              FALSE,                    /* vis_col */
+              NULL,                     /* search pattern */
+              0,                        /* nr */
+              0,                        /* type */
+              TRUE                      /* valid */
+              ) == FAIL) {
+        got_int = TRUE;
+        break;
+      }
+      if (--*tomatchp == 0)
+        break;
+      if ((flags & VGR_GLOBAL) == 0)
+        break;
+      endcol = (colnr_T)(rmp->endp[0] - p);
+      col = endcol + (col == endcol);
+      if (col > (colnr_T)(nl - p))
+        break;
+    }
+    line_breakcheck();
+    if (got_int || nl == end)
+      break;
+  }
+}
+
 /*
  * Add each quickfix error to list "list" as a dictionary.
  */
@@ -69,12 +69,10 @@
  *
  * Regstart and reganch permit very fast decisions on suitable starting points
  * for a match, cutting down the work a lot.  Regmust permits fast rejection
- * of lines that cannot possibly match.  The regmust tests are costly enough
- * that vim_regcomp() supplies a regmust only if the r.e. contains something
- * potentially expensive (at present, the only such thing detected is * or +
- * at the start of the r.e., which can involve a lot of backup).  Regmlen is
- * supplied because the test in vim_regexec() needs it and vim_regcomp() is
- * computing it anyway.
+ * of lines that cannot possibly match.  Without 'ignorecase' the regmust test
+ * is a strstr(), which is cheap enough to do for every r.e. that can't match
+ * a line break.  Regmlen is supplied because the test in vim_regexec() needs
+ * it and vim_regcomp() is computing it anyway.
  */
 
 /*
@@ -349,6 +347,7 @@ static int toggle_Magic(int x)
 
 static int re_multi_type __ARGS((int));
 static int cstrncmp __ARGS((char_u *s1, char_u *s2, int *n));
+static int reg_utf_strnicmp __ARGS((char_u *s1, char_u *s2, int n));
 static char_u *cstrchr __ARGS((char_u *, int));
 
 #ifdef BT_REGEXP_DUMP
@@ -427,6 +426,7 @@ static void reg_equi_class __ARGS((int c));
 static int get_coll_element __ARGS((char_u **pp));
 static char_u   *skip_anyof __ARGS((char_u *p));
 static void init_class_tab __ARGS((void));
+static void init_lower_tab __ARGS((void));
 
 /*
  * Translate '\x' to its control character, except "\n", which is Magic.
@@ -553,12 +553,42 @@ static void init_class_tab(void)                 {
 # define ri_upper(c)    (c < 0x100 && (class_tab[c] & RI_UPPER))
 # define ri_white(c)    (c < 0x100 && (class_tab[c] & RI_WHITE))
 
+/*
+ * The lower case of characters below 0x100, for 'ignorecase'.  Avoids
+ * calling MB_TOLOWER() for every character of the text.  What MB_TOLOWER()
+ * returns depends on 'encoding', 'casemap' and the locale, "lower_tab_key"
+ * and "lower_tab_tick" tell what the table was made for.
+ */
+static int lower_tab[256];
+static int lower_tab_key = -1;
+static int lower_tab_tick;
+
+#define reg_tolower(c)  ((c) < 0x100 ? lower_tab[c] : MB_TOLOWER(c))
+
+/*
+ * Fill lower_tab[] if it isn't valid for the current settings.
+ */
+static void init_lower_tab(void)
+{
+  int key = has_mbyte + (enc_utf8 << 1) + (enc_latin1like << 2)
+            + (cmp_flags << 3);
+  int i;
+
+  if (key == lower_tab_key && lower_tab_tick == chartab_tick)
+    return;
+  for (i = 0; i < 256; ++i)
+    lower_tab[i] = MB_TOLOWER(i);
+  lower_tab_key = key;
+  lower_tab_tick = chartab_tick;
+}
+
 /* flags for regflags */
 #define RF_ICASE    1   /* ignore case */
 #define RF_NOICASE  2   /* don't ignore case */
 #define RF_HASNL    4   /* can match a NL */
 #define RF_ICOMBINE 8   /* ignore combining characters */
 #define RF_LOOKBH   16  /* uses "\@<=" or "\@<!" */
+#define RF_POSDEP   32  /* uses the cursor, Visual area, marks, etc. */
 
 /*
  * Global work variables for vim_regcomp().
@@ -696,6 +726,16 @@ int re_lookbehind(regprog_T *prog)
   return prog->regflags & RF_LOOKBH;
 }
 
+/*
+ * Return TRUE if whether compiled regular expression "prog" matches depends
+ * on more than the text of the line: the cursor, the Visual area, marks, the
+ * line number, the virtual column or the start or end of the buffer.
+ */
+int re_posdep(regprog_T *prog)
+{
+  return prog->regflags & RF_POSDEP;
+}
+
 /*
  * Check for an equivalence class name "[=a=]".  "pp" points to the '['.
  * Returns a character representing the class. Zero means that no item was
@@ -1263,19 +1303,13 @@ static regprog_T *bt_regcomp(char_u *expr, int re_flags)
     }
 
     /*
-     * If there's something expensive in the r.e., find the longest
-     * literal string that must appear and make it the regmust.  Resolve
-     * ties in favor of later strings, since the regstart check works
-     * with the beginning of the r.e. and avoiding duplication
-     * strengthens checking.  Not a strong reason, but sufficient in the
-     * absence of others.
-     */
-    /*
-     * When the r.e. starts with BOW, it is faster to look for a regmust
-     * first. Used a lot for "#" and "*" commands. (Added by mool).
+     * Find the longest literal string that must appear and make it the
+     * regmust.  Resolve ties in favor of later strings, since the
+     * regstart check works with the beginning of the r.e. and avoiding
+     * duplication strengthens checking.  Not a strong reason, but
+     * sufficient in the absence of others.
      */
-    if ((flags & SPSTART || OP(scan) == BOW || OP(scan) == EOW)
-        && !(flags & HASNL)) {
+    if (!(flags & HASNL)) {
       longest = NULL;
       len = 0;
       for (; scan != NULL; scan = regnext(scan))
@@ -1960,18 +1994,22 @@ static char_u *regatom(int *flagp)
      * pattern -- regardless of whether or not it makes sense. */
     case '^':
       ret = regnode(RE_BOF);
+      regflags |= RF_POSDEP;
       break;
 
     case '$':
       ret = regnode(RE_EOF);
+      regflags |= RF_POSDEP;
       break;
 
     case '#':
       ret = regnode(CURSOR);
+      regflags |= RF_POSDEP;
       break;
 
     case 'V':
       ret = regnode(RE_VISUAL);
+      regflags |= RF_POSDEP;
       break;
 
     /* \%[abc]: Emit as a list of branches, all ending at the last
@@ -2075,6 +2113,7 @@ static char_u *regatom(int *flagp)
           /* "\%'m", "\%<'m" and "\%>'m": Mark */
           c = getchr();
           ret = regnode(RE_MARK);
+          regflags |= RF_POSDEP;
           if (ret == JUST_CALC_SIZE)
             regsize += 2;
           else {
@@ -2089,6 +2128,8 @@ static char_u *regatom(int *flagp)
             ret = regnode(RE_COL);
           else
             ret = regnode(RE_VCOL);
+          if (c != 'c')
+            regflags |= RF_POSDEP;
           if (ret == JUST_CALC_SIZE)
             regsize += 5;
           else {
@@ -3124,6 +3165,44 @@ static int ireg_icombine;
  */
 static colnr_T ireg_maxcol;
 
+/*
+ * Time limit for one match, NULL when there is none.  The matchers count
+ * their steps and only look at the clock every REG_CHECK_STEPS steps, the
+ * clock is too slow to read on each one.  "reg_timed_out" is set when the
+ * limit was passed, the match is then abandoned.
+ */
+#define REG_CHECK_STEPS 100
+static proftime_T *reg_tm;
+static int reg_tm_steps;
+static int reg_timed_out;
+
+static int reg_check_time __ARGS((void));
+static void reg_start_time __ARGS((proftime_T *tm));
+
+/*
+ * Count a step of the matcher.  Returns TRUE when the time limit has been
+ * passed and matching must stop.
+ */
+static int reg_check_time(void)
+{
+  if (reg_tm != NULL && !reg_timed_out && ++reg_tm_steps >= REG_CHECK_STEPS) {
+    reg_tm_steps = 0;
+    if (profile_passed_limit(reg_tm))
+      reg_timed_out = TRUE;
+  }
+  return reg_timed_out;
+}
+
+/*
+ * Start counting steps against time limit "tm", which may be NULL.
+ */
+static void reg_start_time(proftime_T *tm)
+{
+  reg_tm = tm;
+  reg_tm_steps = 0;
+  reg_timed_out = FALSE;
+}
+
 /*
  * Sometimes need to save a copy of a line.  Since alloc()/free() is very
  * slow, we keep one allocated piece of memory and only re-allocate it when
@@ -3240,6 +3319,7 @@ static garray_T backpos = {0, 0, 0, 0, NULL};
 
 #if defined(EXITFREE) || defined(PROTO)
 void free_regexp_stuff(void)          {
+  regcache_clear();
   ga_clear(&regstack);
   ga_clear(&backpos);
   vim_free(reg_tofree);
@@ -3380,6 +3460,8 @@ proftime_T  *tm;         /* timeout limit or NULL */
   char_u      *s;
   long retval = 0L;
 
+  reg_start_time(tm);
+
   /* Create "regstack" and "backpos" if they are not allocated yet.
    * We allocate *_INITIAL amount of bytes first and then set the grow size
    * to much bigger value to avoid many malloc calls in case of deep regular
@@ -3433,8 +3515,12 @@ proftime_T  *tm;         /* timeout limit or NULL */
   if (prog->regflags & RF_ICOMBINE)
     ireg_icombine = TRUE;
 
-  /* If there is a "must appear" string, look for it. */
-  if (prog->regmust != NULL) {
+  if (ireg_ic)
+    init_lower_tab();
+
+  /* If there is a "must appear" string, look for it.  With "\Z" composing
+   * characters in the text are skipped, it may be split up. */
+  if (prog->regmust != NULL && !ireg_icombine) {
     int c;
 
     if (has_mbyte)
@@ -3445,17 +3531,13 @@ proftime_T  *tm;         /* timeout limit or NULL */
 
     /*
      * This is used very often, esp. for ":global".  Use three versions of
-     * the loop to avoid overhead of conditions.
+     * the loop to avoid overhead of conditions.  Without 'ignorecase'
+     * strstr() finds the bytes of regmust, in a double-byte encoding it
+     * may find them halfway a character, then trying to match fails.
      */
-    if (!ireg_ic
-        && !has_mbyte
-        )
-      while ((s = vim_strbyte(s, c)) != NULL) {
-        if (cstrncmp(s, prog->regmust, &prog->regmlen) == 0)
-          break;                        /* Found it. */
-        ++s;
-      }
-    else if (!ireg_ic || (!enc_utf8 && mb_char2len(c) > 1))
+    if (!ireg_ic)
+      s = (char_u *)strstr((char *)s, (char *)prog->regmust);
+    else if (!enc_utf8 && mb_char2len(c) > 1)
       while ((s = vim_strchr(s, c)) != NULL) {
         if (cstrncmp(s, prog->regmust, &prog->regmlen) == 0)
           break;                        /* Found it. */
@@ -3493,7 +3575,6 @@ proftime_T  *tm;         /* timeout limit or NULL */
     else
       retval = 0;
   } else   {
-    int tm_count = 0;
     /* Messy cases:  unanchored match. */
     while (!got_int) {
       if (prog->regstart != NUL) {
@@ -3519,7 +3600,7 @@ proftime_T  *tm;         /* timeout limit or NULL */
       }
 
       retval = regtry(prog, col);
-      if (retval > 0)
+      if (retval > 0 || reg_timed_out)
         break;
 
       /* if not currently on the first line, get it again */
@@ -3533,12 +3614,6 @@ proftime_T  *tm;         /* timeout limit or NULL */
         col += (*mb_ptr2len)(regline + col);
       else
         ++col;
-      /* Check for timeout once in a twenty times to avoid overhead. */
-      if (tm != NULL && ++tm_count == 20) {
-        tm_count = 0;
-        if (profile_passed_limit(tm))
-          break;
-      }
     }
   }
 
@@ -3785,8 +3860,9 @@ regmatch (
    */
   for (;; ) {
     /* Some patterns may take a long time to match, e.g., "\([a-z]\+\)\+Q".
-     * Allow interrupting them with CTRL-C. */
+     * Allow interrupting them with CTRL-C and stop at the time limit. */
     fast_breakcheck();
+    reg_check_time();
 
 #ifdef REGEXP_DEBUG
     if (scan != NULL && regnarrate) {
@@ -3800,7 +3876,7 @@ regmatch (
      * regstack.
      */
     for (;; ) {
-      if (got_int || scan == NULL) {
+      if (got_int || reg_timed_out || scan == NULL) {
         status = RA_FAIL;
         break;
       }
@@ -4158,7 +4234,7 @@ regmatch (
           if (*opnd != *reginput
               && (!ireg_ic || (
                     !enc_utf8 &&
-                    MB_TOLOWER(*opnd) != MB_TOLOWER(*reginput))))
+                    reg_tolower(*opnd) != reg_tolower(*reginput))))
             status = RA_NOMATCH;
           else if (*opnd == NUL) {
             /* match empty string always works; happens when "~" is
@@ -5047,7 +5123,7 @@ regmatch (
         printf("Premature EOL\n");
 #endif
       }
-      if (status == RA_FAIL)
+      if (status == RA_FAIL && !reg_timed_out)
         got_int = TRUE;
       return status == RA_MATCH;
     }
@@ -5340,7 +5416,7 @@ do_class:
      * characters, such as latin1. */
     if (ireg_ic) {
       cu = MB_TOUPPER(*opnd);
-      cl = MB_TOLOWER(*opnd);
+      cl = reg_tolower(*opnd);
       while (count < maxcount && (*scan == cu || *scan == cl)) {
         count++;
         scan++;
@@ -6253,6 +6329,8 @@ static int cstrncmp(char_u *s1, char_u *s2, int *n)
 
   if (!ireg_ic)
     result = STRNCMP(s1, s2, *n);
+  else if (enc_utf8)
+    result = reg_utf_strnicmp(s1, s2, *n);
   else
     result = MB_STRNICMP(s1, s2, *n);
 
@@ -6292,6 +6370,37 @@ static int cstrncmp(char_u *s1, char_u *s2, int *n)
   return result;
 }
 
+/*
+ * Like MB_STRNICMP() for UTF-8, but compares ASCII characters directly.  The
+ * multi-byte compare is only used from the first non-ASCII byte.  For ASCII
+ * utf_fold() is the same as TOLOWER_ASC().
+ */
+static int reg_utf_strnicmp(char_u *s1, char_u *s2, int n)
+{
+  int i;
+  int c1, c2;
+
+  for (i = 0; i < n; ++i) {
+    c1 = s1[i];
+    c2 = s2[i];
+    if (c1 >= 0x80 || c2 >= 0x80)
+      return MB_STRNICMP(s1 + i, s2 + i, n - i);
+    if (c1 == NUL || c2 == NUL) {
+      /* some string ended, the shorter string is smaller */
+      if (c1 == c2)
+        return 0;
+      return c1 == NUL ? -1 : 1;
+    }
+    if (c1 != c2) {
+      c1 = TOLOWER_ASC(c1);
+      c2 = TOLOWER_ASC(c2);
+      if (c1 != c2)
+        return c1 - c2;
+    }
+  }
+  return 0;
+}
+
 /*
  * cstrchr: This function is used a lot for simple searches, keep it fast!
  */
@@ -6317,19 +6426,26 @@ static char_u *cstrchr(char_u *s, int c)
   else
     return vim_strchr(s, c);
 
-  if (has_mbyte) {
-    for (p = s; *p != NUL; p += (*mb_ptr2len)(p)) {
-      if (enc_utf8 && c > 0x80) {
-        if (utf_fold(utf_ptr2char(p)) == cc)
-          return p;
-      } else if (*p == c || *p == cc)
-        return p;
-    }
-  } else
-    /* Faster version for when there are no multi-byte characters. */
-    for (p = s; *p != NUL; ++p)
-      if (*p == c || *p == cc)
+  /* Without multi-byte characters, or for an ASCII character in UTF-8,
+   * looking at the bytes is sufficient: an ASCII byte is never part of a
+   * UTF-8 multi-byte character.  strpbrk() is usually much faster than a
+   * loop. */
+  if (!has_mbyte || (enc_utf8 && c < 0x80)) {
+    char_u two[3];
+
+    two[0] = c;
+    two[1] = cc;
+    two[2] = NUL;
+    return (char_u *)strpbrk((char *)s, (char *)two);
+  }
+
+  for (p = s; *p != NUL; p += (*mb_ptr2len)(p)) {
+    if (enc_utf8 && c > 0x80) {
+      if (utf_fold(utf_ptr2char(p)) == cc)
         return p;
+    } else if (*p == c || *p == cc)
+      return p;
+  }
 
   return NULL;
 }
@@ -6956,16 +7072,219 @@ static char_u regname[][30] = {
 };
 #endif
 
+/*
+ * Cache of compiled patterns.  The same patterns are compiled over and over,
+ * by match() in a loop, for every ":s" and search command, for syntax items,
+ * etc.  A cached program is shared: "refcount" in the program counts its
+ * users, including the cache, vim_regfree() frees it when it drops to zero.
+ * When the cache is full the least recently used entry is dropped.
+ */
+#define REGCACHE_SIZE 32
+
+typedef struct {
+  regprog_T   *rc_prog;         /* NULL when the entry is not used */
+  char_u      *rc_expr;         /* pattern as passed to vim_regcomp() */
+  unsigned rc_hash;             /* hash of rc_expr */
+  int rc_flags;                 /* "re_flags" passed to vim_regcomp() */
+  int rc_state;                 /* options etc. used when compiling */
+  int rc_chartab_tick;          /* chartab_tick when compiled, [[:print:]]
+                                   etc. depend on 'isprint' */
+  int rc_had_eol;               /* vim_regcomp_had_eol() result */
+  long rc_hits;                 /* nr of times found in the cache */
+  long rc_lastused;             /* value of regcache_tick when last used */
+} regcache_T;
+
+static regcache_T regcache[REGCACHE_SIZE];
+static long regcache_tick = 0;
+static long regcache_hits = 0;
+static long regcache_misses = 0;
+static long regcache_evictions = 0;
+
+static int regcache_state __ARGS((void));
+static unsigned regcache_hash __ARGS((char_u *expr));
+static regprog_T *regcache_find __ARGS((char_u *expr, int re_flags,
+                                        int *cacheable));
+static void regcache_add __ARGS((char_u *expr, int re_flags, regprog_T *prog));
+static void regcache_clear __ARGS((void));
+
+/*
+ * Return a number for everything besides the pattern and "re_flags" that
+ * compiling depends on: 'regexpengine', 'cpoptions', \z() handling and
+ * 'encoding'.
+ */
+static int regcache_state(void)
+{
+  get_cpo_flags();
+  return p_re
+         + (reg_cpo_lit << 2)
+         + (reg_cpo_bsl << 3)
+         + (reg_do_extmatch << 4)
+         + (has_mbyte << 6)
+         + (enc_utf8 << 7)
+         + (enc_dbcs << 8);
+}
+
+static unsigned regcache_hash(char_u *expr)
+{
+  unsigned hash = 0;
+
+  while (*expr != NUL)
+    hash = hash * 101 + *expr++;
+  return hash;
+}
+
+/*
+ * Find "expr" compiled with "re_flags" in the cache.  Returns the program
+ * with its reference count incremented, NULL if it isn't there.
+ * A program that is being executed can't be used recursively, the NFA state
+ * lists would get mixed up.  Then "*cacheable" is reset, the caller compiles
+ * a private copy.
+ */
+static regprog_T *regcache_find(char_u *expr, int re_flags, int *cacheable)
+{
+  unsigned hash = regcache_hash(expr);
+  int state = regcache_state();
+  regcache_T  *rc;
+
+  for (rc = regcache; rc < regcache + REGCACHE_SIZE; ++rc)
+    if (rc->rc_prog != NULL
+        && rc->rc_hash == hash
+        && rc->rc_flags == re_flags
+        && rc->rc_state == state
+        && rc->rc_chartab_tick == chartab_tick
+        && STRCMP(rc->rc_expr, expr) == 0) {
+      if (rc->rc_prog->re_in_use > 0) {
+        *cacheable = FALSE;
+        break;
+      }
+      ++rc->rc_hits;
+      ++regcache_hits;
+      rc->rc_lastused = ++regcache_tick;
+      ++rc->rc_prog->refcount;
+      had_eol = rc->rc_had_eol;
+      return rc->rc_prog;
+    }
+  ++regcache_misses;
+  return NULL;
+}
+
+/*
+ * Add program "prog", just compiled from "expr" with "re_flags", to the
+ * cache.
+ */
+static void regcache_add(char_u *expr, int re_flags, regprog_T *prog)
+{
+  regcache_T  *rc;
+  regcache_T  *lru = regcache;
+  char_u      *p;
+
+  p = vim_strsave(expr);
+  if (p == NULL)
+    return;
+  for (rc = regcache; rc < regcache + REGCACHE_SIZE; ++rc) {
+    if (rc->rc_prog == NULL) {
+      lru = rc;
+      break;
+    }
+    if (rc->rc_lastused < lru->rc_lastused)
+      lru = rc;
+  }
+  if (lru->rc_prog != NULL) {
+    vim_regfree(lru->rc_prog);
+    vim_free(lru->rc_expr);
+    ++regcache_evictions;
+  }
+  lru->rc_prog = prog;
+  lru->rc_expr = p;
+  lru->rc_hash = regcache_hash(expr);
+  lru->rc_flags = re_flags;
+  lru->rc_state = regcache_state();
+  lru->rc_chartab_tick = chartab_tick;
+  lru->rc_had_eol = had_eol;
+  lru->rc_hits = 0;
+  lru->rc_lastused = ++regcache_tick;
+  ++prog->refcount;
+}
+
+/*
+ * Drop all entries from the cache.  Programs still in use are freed when
+ * their users are done with them.
+ */
+static void regcache_clear(void)
+{
+  regcache_T  *rc;
+
+  for (rc = regcache; rc < regcache + REGCACHE_SIZE; ++rc)
+    if (rc->rc_prog != NULL) {
+      vim_regfree(rc->rc_prog);
+      vim_free(rc->rc_expr);
+      rc->rc_prog = NULL;
+      rc->rc_expr = NULL;
+    }
+}
+
+/*
+ * ":regexpcache": list the compiled pattern cache.
+ * ":regexpcache!": empty the cache and reset the counters.
+ */
+void ex_regexpcache(exarg_T *eap)
+{
+  regcache_T  *rc;
+  int used = 0;
+
+  if (eap->forceit) {
+    regcache_clear();
+    regcache_hits = 0;
+    regcache_misses = 0;
+    regcache_evictions = 0;
+    return;
+  }
+
+  for (rc = regcache; rc < regcache + REGCACHE_SIZE; ++rc)
+    if (rc->rc_prog != NULL)
+      ++used;
+  MSG_PUTS_TITLE(_("\n--- Regexp cache ---"));
+  vim_snprintf((char *)IObuff, IOSIZE,
+      _("\nhits: %ld  misses: %ld  evictions: %ld  entries: %d/%d"),
+      regcache_hits, regcache_misses, regcache_evictions,
+      used, REGCACHE_SIZE);
+  msg_puts(IObuff);
+  if (used > 0)
+    MSG_PUTS_TITLE(_("\n users    hits pattern"));
+  for (rc = regcache; rc < regcache + REGCACHE_SIZE && !got_int; ++rc) {
+    if (rc->rc_prog == NULL)
+      continue;
+    /* the cache itself is not counted as a user */
+    vim_snprintf((char *)IObuff, IOSIZE, "\n%6d %7ld ",
+        rc->rc_prog->refcount - 1, rc->rc_hits);
+    msg_puts(IObuff);
+    msg_outtrans(rc->rc_expr);
+    out_flush();
+    ui_breakcheck();
+  }
+}
+
 /*
  * Compile a regular expression into internal code.
- * Returns the program in allocated memory.
- * Use vim_regfree() to free the memory.
+ * Returns the program in allocated memory, or a program from the cache that
+ * is shared with other users.
+ * Use vim_regfree() when done with it.
  * Returns NULL for an error.
  */
 regprog_T *vim_regcomp(char_u *expr_arg, int re_flags)
 {
   regprog_T   *prog = NULL;
   char_u      *expr = expr_arg;
+  int cacheable;
+
+  /* A "~" is replaced with the previous substitute string, which may have
+   * changed since the pattern was compiled. */
+  cacheable = vim_strchr(expr_arg, '~') == NULL;
+  if (cacheable) {
+    prog = regcache_find(expr_arg, re_flags, &cacheable);
+    if (prog != NULL)
+      return prog;
+  }
 
   regexp_engine = p_re;
 
@@ -6986,6 +7305,7 @@ regprog_T *vim_regcomp(char_u *expr_arg, int re_flags)
       EMSG(_(
               "E864: \\%#= can only be followed by 0, 1, or 2. The automatic engine will be used "));
       regexp_engine = AUTOMATIC_ENGINE;
+      cacheable = FALSE;        /* give the error again next time */
     }
   }
 #ifdef REGEXP_DEBUG
@@ -7020,17 +7340,33 @@ regprog_T *vim_regcomp(char_u *expr_arg, int re_flags)
        if (regexp_engine == AUTOMATIC_ENGINE)
         prog = bt_regengine.regcomp(expr, re_flags);
      */
+  } else   {
+    prog->refcount = 1;
+    prog->re_in_use = 0;
+    if (cacheable)
+      regcache_add(expr_arg, re_flags, prog);
   }
 
   return prog;
 }
 
 /*
- * Free a compiled regexp program, returned by vim_regcomp().
+ * Add a user to compiled regexp program "prog".  It must be freed with
+ * vim_regfree() one more time.  Returns "prog".
+ */
+regprog_T *vim_regref(regprog_T *prog)
+{
+  ++prog->refcount;
+  return prog;
+}
+
+/*
+ * Free a compiled regexp program, returned by vim_regcomp().  When it is
+ * shared, only drops this user.
  */
 void vim_regfree(regprog_T *prog)
 {
-  if (prog != NULL)
+  if (prog != NULL && --prog->refcount <= 0)
     prog->engine->regfree(prog);
 }
 
@@ -7048,7 +7384,13 @@ vim_regexec (
     colnr_T col            /* column to start looking for match */
 )
 {
-  return rmp->regprog->engine->regexec(rmp, line, col);
+  regprog_T   *prog = rmp->regprog;
+  int r;
+
+  ++prog->re_in_use;
+  r = prog->engine->regexec(rmp, line, col);
+  --prog->re_in_use;
+  return r;
 }
 
 #if defined(FEAT_MODIFY_FNAME) || defined(FEAT_EVAL) \
@@ -7058,7 +7400,13 @@ vim_regexec (
  */
 int vim_regexec_nl(regmatch_T *rmp, char_u *line, colnr_T col)
 {
-  return rmp->regprog->engine->regexec_nl(rmp, line, col);
+  regprog_T   *prog = rmp->regprog;
+  int r;
+
+  ++prog->re_in_use;
+  r = prog->engine->regexec_nl(rmp, line, col);
+  --prog->re_in_use;
+  return r;
 }
 #endif
 
@@ -7069,14 +7417,66 @@ int vim_regexec_nl(regmatch_T *rmp, char_u *line, colnr_T col)
  *
  * Return zero if there is no match.  Return number of lines contained in the
  * match otherwise.
+ * When "tm" is passed while matching, matching is abandoned and zero is
+ * returned, "*timed_out" is then set to TRUE if "timed_out" isn't NULL.
  */
-long vim_regexec_multi(rmp, win, buf, lnum, col, tm)
+long vim_regexec_multi(rmp, win, buf, lnum, col, tm, timed_out)
 regmmatch_T *rmp;
 win_T       *win;               /* window in which to search or NULL */
 buf_T       *buf;               /* buffer in which to search */
 linenr_T lnum;                  /* nr of line to start looking for match */
 colnr_T col;                    /* column to start looking for match */
 proftime_T  *tm;                /* timeout limit or NULL */
+int         *timed_out;         /* set to TRUE when timed out or NULL */
 {
-  return rmp->regprog->engine->regexec_multi(rmp, win, buf, lnum, col, tm);
+  regprog_T   *prog = rmp->regprog;
+  long r;
+
+  ++prog->re_in_use;
+  r = prog->engine->regexec_multi(rmp, win, buf, lnum, col, tm);
+  --prog->re_in_use;
+  if (reg_timed_out) {
+    r = 0;
+    if (timed_out != NULL)
+      *timed_out = TRUE;
+  }
+  return r;
+}
+
+/*
+ * Return the text that any match of "prog" must contain in the line where
+ * the match starts, for quickly skipping lines without it.  "*icp" is the
+ * 'ignorecase' value used for matching, it is set to TRUE when the case of
+ * ASCII letters must be ignored when looking for the text, see
+ * ml_find_text().  The length is stored in "*lenp".
+ * Returns NULL when there is no such text or comparing bytes isn't enough
+ * to find it.
+ */
+char_u *vim_regmust(regprog_T *prog, int *icp, int *lenp)
+{
+  char_u      *must;
+  char_u      *p;
+  int ic = *icp;
+
+  if (prog->regflags & RF_ICOMBINE)
+    return NULL;
+  if (prog->regflags & RF_ICASE)
+    ic = TRUE;
+  else if (prog->regflags & RF_NOICASE)
+    ic = FALSE;
+
+  if (prog->engine == &nfa_regengine)
+    must = ((nfa_regprog_T *)prog)->regmust;
+  else
+    must = ((bt_regprog_T *)prog)->regmust;
+  if (must == NULL)
+    return NULL;
+  /* With 'ignorecase' only ASCII text can be compared. */
+  if (ic)
+    for (p = must; *p != NUL; ++p)
+      if (*p >= 0x80)
+        return NULL;
+  *icp = ic;
+  *lenp = (int)STRLEN(must);
+  return must;
 }
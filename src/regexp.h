@@ -37,6 +37,8 @@ typedef struct regengine regengine_T;
 typedef struct regprog {
   regengine_T         *engine;
   unsigned regflags;
+  int refcount;                 /* nr of users, incl. the regprog cache */
+  int re_in_use;                /* nr of active vim_regexec() calls */
 } regprog_T;
 
 /*
@@ -45,9 +47,11 @@ typedef struct regprog {
  * See regexp.c for an explanation.
  */
 typedef struct {
-  /* These two members implement regprog_T */
+  /* These four members implement regprog_T */
   regengine_T         *engine;
   unsigned regflags;
+  int refcount;
+  int re_in_use;
 
   int regstart;
   char_u reganch;
@@ -71,23 +75,38 @@ struct nfa_state {
   int val;
 };
 
+/* Lazily built DFA, used by the NFA matcher, see regexp_nfa.c. */
+typedef struct nfa_dfa_S nfa_dfa_T;
+
+/* Bitmap for a [] collection, used by the NFA matcher, see regexp_nfa.c. */
+typedef struct nfa_coll_S nfa_coll_T;
+
 /*
  * Structure used by the NFA matcher.
  */
 typedef struct {
-  /* These two members implement regprog_T */
+  /* These four members implement regprog_T */
   regengine_T         *engine;
   unsigned regflags;
+  int refcount;
+  int re_in_use;
 
   nfa_state_T         *start;           /* points into state[] */
 
   int reganch;                          /* pattern starts with ^ */
   int regstart;                         /* char at start of pattern */
   char_u              *match_text;      /* plain text to match with */
+  char_u              *regmust;         /* text any match must contain */
+  int regmlen;                          /* length of regmust */
+  int regmust_anycase;                  /* regmust can be used with
+                                           'ignorecase' */
 
   int has_zend;                         /* pattern contains \ze */
   int has_backref;                      /* pattern contains \1 .. \9 */
   int reghasz;
+  int dfa_ok;                           /* can use the DFA */
+  nfa_dfa_T           *dfa;             /* DFA states, NULL when not used yet */
+  nfa_coll_T          *coll;            /* bitmaps for [] collections */
 #ifdef DEBUG
   char_u              *pattern;
 #endif
@@ -277,6 +277,7 @@ static int nfa_regcomp_start __ARGS((char_u *expr, int re_flags));
 static int nfa_get_reganch __ARGS((nfa_state_T *start, int depth));
 static int nfa_get_regstart __ARGS((nfa_state_T *start, int depth));
 static char_u *nfa_get_match_text __ARGS((nfa_state_T *start));
+static char_u *nfa_get_regmust __ARGS((int *postfix, int *end));
 static int realloc_post_list __ARGS((void));
 static int nfa_recognize_char_class __ARGS((char_u *start, char_u *end,
                                             int extra_newl));
@@ -306,7 +307,8 @@ static void nfa_save_listids __ARGS((nfa_regprog_T *prog, int *list));
 static void nfa_restore_listids __ARGS((nfa_regprog_T *prog, int *list));
 static int nfa_re_num_cmp __ARGS((long_u val, int op, long_u pos));
 static long nfa_regtry __ARGS((nfa_regprog_T *prog, colnr_T col));
-static long nfa_regexec_both __ARGS((char_u *line, colnr_T col));
+static long nfa_regexec_both __ARGS((char_u *line, colnr_T col,
+                                     proftime_T *tm));
 static regprog_T *nfa_regcomp __ARGS((char_u *expr, int re_flags));
 static void nfa_regfree __ARGS((regprog_T *prog));
 static int nfa_regexec __ARGS((regmatch_T *rmp, char_u *line, colnr_T col));
@@ -315,6 +317,21 @@ static long nfa_regexec_multi __ARGS((regmmatch_T *rmp, win_T *win, buf_T *buf,
                                       proftime_T *tm));
 static int match_follows __ARGS((nfa_state_T *startstate, int depth));
 static int failure_chance __ARGS((nfa_state_T *state, int depth));
+static void nfa_coll_setup __ARGS((nfa_regprog_T *prog));
+static void nfa_coll_fill __ARGS((nfa_coll_T *coll, nfa_state_T *state));
+
+/*
+ * Matching a [] collection means going through the list of its items for
+ * every character.  For characters below 256 the result is looked up in a
+ * bitmap instead.  The bitmap of a collection is filled when it is first
+ * used, and again when 'ignorecase' or 'isprint' changed.
+ */
+struct nfa_coll_S {
+  char_u nc_map[32];            /* bit set for each matching character */
+  int nc_valid;                 /* nc_map was filled */
+  int nc_ic;                    /* ireg_ic when nc_map was filled */
+  int nc_chartab_tick;          /* chartab_tick when nc_map was filled */
+};
 
 /* helper functions used when doing re2post() ... regatom() parsing */
 #define EMIT(c) do {                            \
@@ -536,6 +553,254 @@ static char_u *nfa_get_match_text(nfa_state_T *start)
   return ret;
 }
 
+/*
+ * Literal text information about a part of the postfix form, used by
+ * nfa_get_regmust().
+ */
+#define NFA_MUST_MAX 40         /* max bytes kept for each literal */
+
+typedef struct {
+  int exact;                    /* always matches exactly "pre" */
+  char_u pre[NFA_MUST_MAX + 1];   /* text each match starts with */
+  char_u suf[NFA_MUST_MAX + 1];   /* text each match ends with */
+  char_u must[NFA_MUST_MAX + 1];  /* longest text each match contains */
+} nfa_lit_T;
+
+static void nfa_lit_concat __ARGS((nfa_lit_T *r, nfa_lit_T *a, nfa_lit_T *b));
+
+/*
+ * Set "r" to the information for two concatenated items "a" and "b".
+ * "r" may be the same as "a".
+ */
+static void nfa_lit_concat(nfa_lit_T *r, nfa_lit_T *a, nfa_lit_T *b)
+{
+  char_u buf[NFA_MUST_MAX * 2 + 1];
+  size_t len;
+  nfa_lit_T l;
+
+  l.exact = FALSE;
+
+  /* Prefix: all of "a" when it is exact, keep the start. */
+  STRCPY(buf, a->pre);
+  if (a->exact)
+    STRCAT(buf, b->pre);
+  len = STRLEN(buf);
+  if (a->exact && b->exact && len <= NFA_MUST_MAX)
+    l.exact = TRUE;
+  vim_strncpy(l.pre, buf, NFA_MUST_MAX);
+
+  /* Suffix: all of "b" when it is exact, keep the end. */
+  STRCPY(buf, b->exact ? a->suf : (char_u *)"");
+  STRCAT(buf, b->suf);
+  len = STRLEN(buf);
+  STRCPY(l.suf, len > NFA_MUST_MAX ? buf + len - NFA_MUST_MAX : buf);
+
+  /* Required text: the longest of what is inside "a" and "b" and the
+   * text where they meet. */
+  STRCPY(buf, a->suf);
+  STRCAT(buf, b->pre);
+  vim_strncpy(l.must, buf, NFA_MUST_MAX);
+  if (STRLEN(a->must) > STRLEN(l.must))
+    STRCPY(l.must, a->must);
+  if (STRLEN(b->must) > STRLEN(l.must))
+    STRCPY(l.must, b->must);
+  if (STRLEN(l.pre) > STRLEN(l.must))
+    STRCPY(l.must, l.pre);
+  if (STRLEN(l.suf) > STRLEN(l.must))
+    STRCPY(l.must, l.suf);
+
+  *r = l;
+}
+
+/*
+ * Find the longest literal text that every match of the postfix form from
+ * "postfix" to "end" must contain.  This can be used to skip lines where it
+ * doesn't appear without trying to match.
+ * Returns the text in allocated memory, NULL when there is none or when the
+ * pattern may match a line break.
+ */
+static char_u *nfa_get_regmust(int *postfix, int *end)
+{
+  nfa_lit_T   *stack;
+  nfa_lit_T   *sp;
+  nfa_lit_T   *stack_end;
+  nfa_lit_T   *lit;
+  int         *p;
+  int n;
+  char_u      *ret = NULL;
+
+  stack = (nfa_lit_T *)lalloc((long_u)(sizeof(nfa_lit_T)
+                                       * (end - postfix + 1)), TRUE);
+  if (stack == NULL)
+    return NULL;
+  sp = stack;
+  stack_end = stack + (end - postfix + 1);
+
+/* Pop one item, give up when the stack is empty. */
+#define LIT_POP(n) if (sp - stack < (n)) goto theend; else sp -= (n)
+#define LIT_PUSH_UNKNOWN() do { \
+    sp->exact = FALSE; \
+    sp->pre[0] = sp->suf[0] = sp->must[0] = NUL; \
+    ++sp; \
+} while (0)
+#define LIT_PUSH_EMPTY() do { \
+    sp->exact = TRUE; \
+    sp->pre[0] = sp->suf[0] = sp->must[0] = NUL; \
+    ++sp; \
+} while (0)
+
+  for (p = postfix; p < end; ++p) {
+    if (sp >= stack_end)
+      goto theend;
+    switch (*p) {
+    case NFA_CONCAT:
+      LIT_POP(2);
+      nfa_lit_concat(sp, sp, sp + 1);
+      ++sp;
+      break;
+
+    case NFA_OR:
+      LIT_POP(2);
+      /* Only keep the text when both alternatives are the same. */
+      if (!sp[0].exact || !sp[1].exact || STRCMP(sp[0].pre, sp[1].pre) != 0)
+        LIT_PUSH_UNKNOWN();
+      else
+        ++sp;
+      break;
+
+    case NFA_STAR:
+    case NFA_STAR_NONGREEDY:
+    case NFA_QUEST:
+    case NFA_QUEST_NONGREEDY:
+    case NFA_END_COLL:
+    case NFA_END_NEG_COLL:
+    case NFA_COMPOSING:
+      /* may match nothing or something that isn't plain text */
+      LIT_POP(1);
+      LIT_PUSH_UNKNOWN();
+      break;
+
+    case NFA_RANGE:
+      LIT_POP(2);
+      LIT_PUSH_UNKNOWN();
+      break;
+
+    case NFA_OPT_CHARS:
+      n = *++p;
+      LIT_POP(n);
+      LIT_PUSH_UNKNOWN();
+      break;
+
+    case NFA_PREV_ATOM_NO_WIDTH:
+    case NFA_PREV_ATOM_NO_WIDTH_NEG:
+    case NFA_PREV_ATOM_JUST_BEFORE:
+    case NFA_PREV_ATOM_JUST_BEFORE_NEG:
+      /* zero width, the atom is not part of the match */
+      if (*p == NFA_PREV_ATOM_JUST_BEFORE
+          || *p == NFA_PREV_ATOM_JUST_BEFORE_NEG)
+        ++p;
+      LIT_POP(1);
+      LIT_PUSH_EMPTY();
+      break;
+
+    case NFA_PREV_ATOM_LIKE_PATTERN:
+      /* \@> matches the same text as the atom */
+      break;
+
+    case NFA_MOPEN:
+    case NFA_MOPEN1:
+    case NFA_MOPEN2:
+    case NFA_MOPEN3:
+    case NFA_MOPEN4:
+    case NFA_MOPEN5:
+    case NFA_MOPEN6:
+    case NFA_MOPEN7:
+    case NFA_MOPEN8:
+    case NFA_MOPEN9:
+    case NFA_ZOPEN:
+    case NFA_ZOPEN1:
+    case NFA_ZOPEN2:
+    case NFA_ZOPEN3:
+    case NFA_ZOPEN4:
+    case NFA_ZOPEN5:
+    case NFA_ZOPEN6:
+    case NFA_ZOPEN7:
+    case NFA_ZOPEN8:
+    case NFA_ZOPEN9:
+    case NFA_NOPEN:
+      /* a group matches the same text as what's inside, an empty group
+       * is pushed when the stack is empty */
+      if (sp == stack)
+        LIT_PUSH_EMPTY();
+      break;
+
+    case NFA_LNUM:
+    case NFA_LNUM_GT:
+    case NFA_LNUM_LT:
+    case NFA_VCOL:
+    case NFA_VCOL_GT:
+    case NFA_VCOL_LT:
+    case NFA_COL:
+    case NFA_COL_GT:
+    case NFA_COL_LT:
+    case NFA_MARK:
+    case NFA_MARK_GT:
+    case NFA_MARK_LT:
+      ++p;
+    /* FALLTHROUGH */
+    case NFA_EMPTY:
+    case NFA_BOL:
+    case NFA_EOL:
+    case NFA_BOW:
+    case NFA_EOW:
+    case NFA_BOF:
+    case NFA_EOF:
+    case NFA_ZSTART:
+    case NFA_ZEND:
+    case NFA_CURSOR:
+    case NFA_VISUAL:
+      /* zero width */
+      LIT_PUSH_EMPTY();
+      break;
+
+    case NFA_NEWL:
+      /* the text may be in another line */
+      goto theend;
+
+    default:
+      if (*p > 0 && *p != NL) {
+        /* a regular character */
+        sp->exact = TRUE;
+        if (has_mbyte)
+          sp->pre[(*mb_char2bytes)(*p, sp->pre)] = NUL;
+        else {
+          sp->pre[0] = *p;
+          sp->pre[1] = NUL;
+        }
+        STRCPY(sp->suf, sp->pre);
+        STRCPY(sp->must, sp->pre);
+        ++sp;
+      } else
+        /* character class, backreference, etc. */
+        LIT_PUSH_UNKNOWN();
+      break;
+    }
+  }
+
+  if (sp == stack + 1) {
+    lit = stack;
+    if (lit->must[0] != NUL)
+      ret = vim_strsave(lit->must);
+  }
+
+theend:
+#undef LIT_POP
+#undef LIT_PUSH_UNKNOWN
+#undef LIT_PUSH_EMPTY
+  vim_free(stack);
+  return ret;
+}
+
 /*
  * Allocate more space for post_start.  Called when
  * running above the estimated number of states.
@@ -1319,18 +1584,22 @@ static int nfa_regatom(void)                {
      * pattern -- regardless of whether or not it makes sense. */
     case '^':
       EMIT(NFA_BOF);
+      regflags |= RF_POSDEP;
       break;
 
     case '$':
       EMIT(NFA_EOF);
+      regflags |= RF_POSDEP;
       break;
 
     case '#':
       EMIT(NFA_CURSOR);
+      regflags |= RF_POSDEP;
       break;
 
     case 'V':
       EMIT(NFA_VISUAL);
+      regflags |= RF_POSDEP;
       break;
 
     case '[':
@@ -1376,6 +1645,8 @@ static int nfa_regatom(void)                {
         c = getchr();
       }
       if (c == 'l' || c == 'c' || c == 'v') {
+        if (c != 'c')
+          regflags |= RF_POSDEP;
         if (c == 'l')
           /* \%{n}l  \%{n}<l  \%{n}>l  */
           EMIT(cmp == '<' ? NFA_LNUM_LT :
@@ -1392,6 +1663,7 @@ static int nfa_regatom(void)                {
         break;
       } else if (c == '\'' && n == 0)   {
         /* \%'m  \%<'m  \%>'m  */
+        regflags |= RF_POSDEP;
         EMIT(cmp == '<' ? NFA_MARK_LT :
             cmp == '>' ? NFA_MARK_GT : NFA_MARK);
         EMIT(getchr());
@@ -4598,6 +4870,7 @@ static int recursive_regmatch(nfa_state_T *state, nfa_pim_T *pim, nfa_regprog_T
 }
 
 static int skip_to_start __ARGS((int c, colnr_T *colp));
+static int nfa_has_regmust __ARGS((nfa_regprog_T *prog, char_u *s));
 static long find_match_text __ARGS((colnr_T startcol, int regstart,
                                     char_u *match_text));
 
@@ -4777,6 +5050,24 @@ static int skip_to_start(int c, colnr_T *colp)
   return OK;
 }
 
+/*
+ * Check if the text that any match must contain, prog->regmust, appears in
+ * "s".  Returns TRUE when it does, or when that can't be decided.
+ */
+static int nfa_has_regmust(nfa_regprog_T *prog, char_u *s)
+{
+  if (!ireg_ic || (has_mbyte && prog->regmust_anycase))
+    return strstr((char *)s, (char *)prog->regmust) != NULL;
+  if (has_mbyte)
+    return TRUE;
+  while ((s = cstrchr(s, *prog->regmust)) != NULL) {
+    if (cstrncmp(s, prog->regmust, &prog->regmlen) == 0)
+      return TRUE;
+    ++s;
+  }
+  return FALSE;
+}
+
 /*
  * Check for a match with match_text.
  * Called after skip_to_start() has found regstart.
@@ -4795,7 +5086,7 @@ static long find_match_text(colnr_T startcol, int regstart, char_u *match_text)
     for (len1 = 0; match_text[len1] != NUL; len1 += MB_CHAR2LEN(c1)) {
       c1 = PTR2CHAR(match_text + len1);
       c2 = PTR2CHAR(regline + col + len2);
-      if (c1 != c2 && (!ireg_ic || MB_TOLOWER(c1) != MB_TOLOWER(c2))) {
+      if (c1 != c2 && (!ireg_ic || reg_tolower(c1) != reg_tolower(c2))) {
         match = FALSE;
         break;
       }
@@ -4864,9 +5155,10 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
   }
 #endif
   /* Some patterns may take a long time to match, especially when using
-   * recursive_regmatch(). Allow interrupting them with CTRL-C. */
+   * recursive_regmatch(). Allow interrupting them with CTRL-C and stop at
+   * the time limit. */
   fast_breakcheck();
-  if (got_int)
+  if (got_int || reg_check_time())
     return FALSE;
 
   nfa_match = FALSE;
@@ -4973,10 +5265,14 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
     fprintf(debug, "\n-------------------\n");
 #endif
     /*
-     * If the state lists are empty we can stop.
+     * If the state lists are empty we can stop.  Also when past the time
+     * limit, the match is abandoned.
      */
-    if (thislist->n == 0)
+    if (thislist->n == 0 || reg_check_time()) {
+      if (reg_timed_out)
+        nfa_match = FALSE;
       break;
+    }
 
     /* compute nextlist */
     for (listidx = 0; listidx < thislist->n; ++listidx) {
@@ -5434,6 +5730,19 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
         if (curc == NUL)
           break;
 
+        if (curc < 256 && t->state->val > 0) {
+          nfa_coll_T    *coll = &prog->coll[t->state->val - 1];
+
+          if (!coll->nc_valid || coll->nc_ic != ireg_ic
+              || coll->nc_chartab_tick != chartab_tick)
+            nfa_coll_fill(coll, t->state);
+          if (coll->nc_map[curc >> 3] & (1 << (curc & 7))) {
+            add_state = t->state->out1->out;
+            add_off = clen;
+          }
+          break;
+        }
+
         state = t->state->out;
         result_if_matched = (t->state->c == NFA_START_COLL);
         for (;; ) {
@@ -5454,11 +5763,11 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
               break;
             }
             if (ireg_ic) {
-              int curc_low = MB_TOLOWER(curc);
+              int curc_low = reg_tolower(curc);
               int done = FALSE;
 
               for (; c1 <= c2; ++c1)
-                if (MB_TOLOWER(c1) == curc_low) {
+                if (reg_tolower(c1) == curc_low) {
                   result = result_if_matched;
                   done = TRUE;
                   break;
@@ -5468,8 +5777,8 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
             }
           } else if (state->c < 0 ? check_char_class(state->c, curc)
                      : (curc == state->c
-                        || (ireg_ic && MB_TOLOWER(curc)
-                            == MB_TOLOWER(state->c)))) {
+                        || (ireg_ic && reg_tolower(curc)
+                            == reg_tolower(state->c)))) {
             result = result_if_matched;
             break;
           }
@@ -5830,7 +6139,7 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
         result = (c == curc);
 
         if (!result && ireg_ic)
-          result = MB_TOLOWER(c) == MB_TOLOWER(curc);
+          result = reg_tolower(c) == reg_tolower(curc);
         /* If there is a composing character which is not being
          * ignored there can be no match. Match with composing
          * character uses NFA_COMPOSING above. */
@@ -5977,8 +6286,8 @@ static int nfa_regmatch(nfa_regprog_T *prog, nfa_state_T *start, regsubs_T *subm
             /* Checking if the required start character matches is
              * cheaper than adding a state that won't match. */
             c = PTR2CHAR(reginput + clen);
-            if (c != prog->regstart && (!ireg_ic || MB_TOLOWER(c)
-                                        != MB_TOLOWER(prog->regstart))) {
+            if (c != prog->regstart && (!ireg_ic || reg_tolower(c)
+                                        != reg_tolower(prog->regstart))) {
 #ifdef ENABLE_LOG
               fprintf(log_fd,
                   "  Skipping start state, regstart does not match\n");
@@ -6042,6 +6351,541 @@ theend:
   return nfa_match;
 }
 
+/*
+ * Lazy DFA.
+ *
+ * For patterns made of characters, character classes, collections, "^", "$"
+ * and groups, the sets of NFA states that nfa_regmatch() goes through can be
+ * used as DFA states.  They are built when first needed and kept with the
+ * program, each with a transition for every byte value.  The DFA only finds
+ * out whether there is a match in the line at all: most lines don't match,
+ * and for those the NFA doesn't need to run.  When there may be a match
+ * nfa_regtry() is used to find where it is and the submatches.
+ * A byte with the high bit set in a multi-byte encoding stops the DFA and the
+ * NFA is used for that line.
+ */
+#define DFA_NCHARS      256
+#define DFA_MEM_MAX     (256 * 1024L)   /* max memory used for DFA states */
+#define DFA_MAX_FLUSH   10              /* give up after this many flushes */
+#define DFA_HASH_SIZE   256             /* nr of hash buckets, power of 2 */
+
+typedef struct nfa_dfa_state_S nfa_dfa_state_T;
+struct nfa_dfa_state_S {
+  nfa_dfa_state_T *ds_next[DFA_NCHARS]; /* transitions, NULL when unknown */
+  nfa_dfa_state_T *ds_hash_next;        /* next state in hash bucket */
+  unsigned ds_hash;
+  int ds_match;                         /* contains NFA_MATCH */
+  int ds_eol_match;                     /* matches at end of line when not
+                                           in column zero, -1 if unknown */
+  int ds_len;                           /* nr of entries in ds_ids[] */
+  int ds_ids[1];                        /* sorted NFA state indexes,
+                                           actually longer */
+};
+
+struct nfa_dfa_S {
+  nfa_dfa_state_T *dfa_hash[DFA_HASH_SIZE];
+  nfa_dfa_state_T *dfa_start[2];        /* start state, [1] in column zero */
+  long dfa_mem_used;                    /* memory used for DFA states */
+  int dfa_flushes;                      /* nr of times states were flushed */
+  int dfa_disabled;                     /* TRUE when giving up */
+  int dfa_ic;                           /* ireg_ic when states were made */
+  int dfa_has_mbyte;                    /* has_mbyte when states were made */
+  int dfa_chartab_tick;                 /* chartab_tick when states were made */
+  int *dfa_mark;                        /* per NFA state: dfa_gen when added */
+  int dfa_gen;
+  int *dfa_stack;                       /* NFA states to be added */
+  int *dfa_ids;                         /* NFA state set being built */
+  int dfa_nids;
+};
+
+static int nfa_dfa_possible __ARGS((nfa_regprog_T *prog));
+static void nfa_dfa_flush __ARGS((nfa_dfa_T *dfa));
+static void nfa_dfa_free __ARGS((nfa_dfa_T *dfa));
+static int nfa_dfa_match_char __ARGS((nfa_state_T *state, int c));
+static void nfa_dfa_addstate __ARGS((nfa_regprog_T *prog, nfa_state_T *state,
+                                     int bol, int eol));
+static int nfa_dfa_id_cmp __ARGS((const void *a, const void *b));
+static nfa_dfa_state_T *nfa_dfa_getstate __ARGS((nfa_regprog_T *prog));
+static nfa_dfa_state_T *nfa_dfa_start __ARGS((nfa_regprog_T *prog, int bol));
+static nfa_dfa_state_T *nfa_dfa_step __ARGS((nfa_regprog_T *prog,
+                                             nfa_dfa_state_T *ds, int c));
+static int nfa_dfa_eol_match __ARGS((nfa_regprog_T *prog, nfa_dfa_state_T *ds,
+                                     int bol));
+static int nfa_dfa_may_match __ARGS((nfa_regprog_T *prog, char_u *line,
+                                     colnr_T col));
+
+/*
+ * Return TRUE if the DFA can be used for "prog": it doesn't contain items
+ * that depend on the position, the buffer or on what matched before.
+ */
+static int nfa_dfa_possible(nfa_regprog_T *prog)
+{
+  int i;
+
+  for (i = 0; i < prog->nstate; ++i) {
+    int c = prog->state[i].c;
+
+    if (c > 0)
+      continue;             /* regular character */
+    switch (c) {
+    case NFA_SPLIT:
+    case NFA_MATCH:
+    case NFA_EMPTY:
+    case NFA_START_COLL:
+    case NFA_END_COLL:
+    case NFA_START_NEG_COLL:
+    case NFA_RANGE_MIN:
+    case NFA_RANGE_MAX:
+    case NFA_BOL:
+    case NFA_EOL:
+    case NFA_ZSTART:
+    case NFA_ZEND:
+    case NFA_NOPEN:
+    case NFA_NCLOSE:
+    case NFA_ANY:
+    case NFA_WHITE:
+    case NFA_NWHITE:
+    case NFA_DIGIT:
+    case NFA_NDIGIT:
+    case NFA_HEX:
+    case NFA_NHEX:
+    case NFA_OCTAL:
+    case NFA_NOCTAL:
+    case NFA_WORD:
+    case NFA_NWORD:
+    case NFA_HEAD:
+    case NFA_NHEAD:
+    case NFA_ALPHA:
+    case NFA_NALPHA:
+    case NFA_LOWER:
+    case NFA_NLOWER:
+    case NFA_UPPER:
+    case NFA_NUPPER:
+    case NFA_LOWER_IC:
+    case NFA_NLOWER_IC:
+    case NFA_UPPER_IC:
+    case NFA_NUPPER_IC:
+      break;
+
+    default:
+      if ((c >= NFA_MOPEN && c <= NFA_MCLOSE9)
+          || (c >= NFA_ZOPEN && c <= NFA_ZCLOSE9)
+          || (c >= NFA_CLASS_ALNUM && c <= NFA_CLASS_ESCAPE))
+        break;
+      /* \n, \<, \%V, \@=, \1, \k, composing characters, etc. */
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/*
+ * Free all DFA states.
+ */
+static void nfa_dfa_flush(nfa_dfa_T *dfa)
+{
+  int i;
+  nfa_dfa_state_T *ds;
+
+  for (i = 0; i < DFA_HASH_SIZE; ++i) {
+    while (dfa->dfa_hash[i] != NULL) {
+      ds = dfa->dfa_hash[i];
+      dfa->dfa_hash[i] = ds->ds_hash_next;
+      vim_free(ds);
+    }
+  }
+  dfa->dfa_start[0] = NULL;
+  dfa->dfa_start[1] = NULL;
+  dfa->dfa_mem_used = 0;
+}
+
+static void nfa_dfa_free(nfa_dfa_T *dfa)
+{
+  if (dfa != NULL) {
+    nfa_dfa_flush(dfa);
+    vim_free(dfa->dfa_mark);
+    vim_free(dfa->dfa_stack);
+    vim_free(dfa->dfa_ids);
+    vim_free(dfa);
+  }
+}
+
+/*
+ * Return TRUE if NFA state "state" consumes character "c", which is not NUL.
+ * Does the same checks as nfa_regmatch() for the states accepted by
+ * nfa_dfa_possible().
+ */
+static int nfa_dfa_match_char(nfa_state_T *state, int c)
+{
+  switch (state->c) {
+  case NFA_START_COLL:
+  case NFA_START_NEG_COLL:
+  {
+    nfa_state_T *s;
+    int result_if_matched = (state->c == NFA_START_COLL);
+    int c1, c2;
+
+    for (s = state->out; s->c != NFA_END_COLL; s = s->out) {
+      if (s->c == NFA_RANGE_MIN) {
+        c1 = s->val;
+        s = s->out;                     /* advance to NFA_RANGE_MAX */
+        c2 = s->val;
+        if (c >= c1 && c <= c2)
+          return result_if_matched;
+        if (ireg_ic) {
+          int c_low = MB_TOLOWER(c);
+
+          for (; c1 <= c2; ++c1)
+            if (MB_TOLOWER(c1) == c_low)
+              return result_if_matched;
+        }
+      } else if (s->c < 0 ? check_char_class(s->c, c)
+                 : (c == s->c
+                    || (ireg_ic && MB_TOLOWER(c) == MB_TOLOWER(s->c))))
+        return result_if_matched;
+    }
+    return !result_if_matched;
+  }
+
+  case NFA_ANY:       return TRUE;
+  case NFA_WHITE:     return vim_iswhite(c);
+  case NFA_NWHITE:    return !vim_iswhite(c);
+  case NFA_DIGIT:     return ri_digit(c);
+  case NFA_NDIGIT:    return !ri_digit(c);
+  case NFA_HEX:       return ri_hex(c);
+  case NFA_NHEX:      return !ri_hex(c);
+  case NFA_OCTAL:     return ri_octal(c);
+  case NFA_NOCTAL:    return !ri_octal(c);
+  case NFA_WORD:      return ri_word(c);
+  case NFA_NWORD:     return !ri_word(c);
+  case NFA_HEAD:      return ri_head(c);
+  case NFA_NHEAD:     return !ri_head(c);
+  case NFA_ALPHA:     return ri_alpha(c);
+  case NFA_NALPHA:    return !ri_alpha(c);
+  case NFA_LOWER:     return ri_lower(c);
+  case NFA_NLOWER:    return !ri_lower(c);
+  case NFA_UPPER:     return ri_upper(c);
+  case NFA_NUPPER:    return !ri_upper(c);
+  case NFA_LOWER_IC:  return ri_lower(c) || (ireg_ic && ri_upper(c));
+  case NFA_NLOWER_IC: return !(ri_lower(c) || (ireg_ic && ri_upper(c)));
+  case NFA_UPPER_IC:  return ri_upper(c) || (ireg_ic && ri_lower(c));
+  case NFA_NUPPER_IC: return !(ri_upper(c) || (ireg_ic && ri_lower(c)));
+  }
+
+  if (state->c <= 0)
+    return FALSE;       /* NFA_MATCH, NFA_EOL */
+  return c == state->c || (ireg_ic && MB_TOLOWER(c) == MB_TOLOWER(state->c));
+}
+
+/*
+ * Add "state" and the states reachable from it without consuming a character
+ * to the set in dfa_ids[].  Like addstate() does, but without submatches.
+ * "bol" is TRUE in column zero, "eol" at the end of the line.
+ */
+static void nfa_dfa_addstate(nfa_regprog_T *prog, nfa_state_T *state,
+                             int bol, int eol)
+{
+  nfa_dfa_T *dfa = prog->dfa;
+  int sp = 0;
+  int idx;
+
+  idx = (int)(state - prog->state);
+  if (dfa->dfa_mark[idx] == dfa->dfa_gen)
+    return;
+  dfa->dfa_mark[idx] = dfa->dfa_gen;
+  dfa->dfa_stack[sp++] = idx;
+
+  while (sp > 0) {
+    nfa_state_T *s = &prog->state[dfa->dfa_stack[--sp]];
+    nfa_state_T *out[2];
+    int n = 0;
+    int i;
+
+    switch (s->c) {
+    case NFA_SPLIT:
+      out[n++] = s->out;
+      out[n++] = s->out1;
+      break;
+    case NFA_BOL:
+      if (bol)
+        out[n++] = s->out;
+      break;
+    case NFA_EOL:
+      if (eol)
+        out[n++] = s->out;
+      else
+        dfa->dfa_ids[dfa->dfa_nids++] = (int)(s - prog->state);
+      break;
+    case NFA_EMPTY:
+    case NFA_ZSTART:
+    case NFA_ZEND:
+    case NFA_NOPEN:
+    case NFA_NCLOSE:
+      out[n++] = s->out;
+      break;
+    default:
+      if ((s->c >= NFA_MOPEN && s->c <= NFA_MCLOSE9)
+          || (s->c >= NFA_ZOPEN && s->c <= NFA_ZCLOSE9))
+        out[n++] = s->out;
+      else
+        /* NFA_MATCH or a state that consumes a character */
+        dfa->dfa_ids[dfa->dfa_nids++] = (int)(s - prog->state);
+      break;
+    }
+
+    for (i = 0; i < n; ++i) {
+      idx = (int)(out[i] - prog->state);
+      if (dfa->dfa_mark[idx] != dfa->dfa_gen) {
+        dfa->dfa_mark[idx] = dfa->dfa_gen;
+        dfa->dfa_stack[sp++] = idx;
+      }
+    }
+  }
+}
+
+static int nfa_dfa_id_cmp(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Find or make the DFA state for the set of NFA states in dfa_ids[].
+ * Returns NULL when out of memory or when the DFA is given up.
+ */
+static nfa_dfa_state_T *nfa_dfa_getstate(nfa_regprog_T *prog)
+{
+  nfa_dfa_T *dfa = prog->dfa;
+  nfa_dfa_state_T *ds;
+  unsigned hash = 0;
+  long size;
+  int i;
+
+  qsort(dfa->dfa_ids, (size_t)dfa->dfa_nids, sizeof(int), nfa_dfa_id_cmp);
+  for (i = 0; i < dfa->dfa_nids; ++i)
+    hash = hash * 31 + (unsigned)dfa->dfa_ids[i];
+
+  for (ds = dfa->dfa_hash[hash & (DFA_HASH_SIZE - 1)]; ds != NULL;
+       ds = ds->ds_hash_next)
+    if (ds->ds_hash == hash && ds->ds_len == dfa->dfa_nids
+        && memcmp(ds->ds_ids, dfa->dfa_ids,
+            sizeof(int) * (size_t)dfa->dfa_nids) == 0)
+      return ds;
+
+  size = (long)sizeof(nfa_dfa_state_T) + (long)sizeof(int) * dfa->dfa_nids;
+  if (dfa->dfa_mem_used + size > DFA_MEM_MAX) {
+    /* Too many states: start all over, unless this happens too often. */
+    nfa_dfa_flush(dfa);
+    if (++dfa->dfa_flushes > DFA_MAX_FLUSH) {
+      dfa->dfa_disabled = TRUE;
+      return NULL;
+    }
+  }
+
+  ds = (nfa_dfa_state_T *)alloc_clear((unsigned)size);
+  if (ds == NULL)
+    return NULL;
+  dfa->dfa_mem_used += size;
+  ds->ds_hash = hash;
+  ds->ds_len = dfa->dfa_nids;
+  ds->ds_eol_match = -1;
+  for (i = 0; i < dfa->dfa_nids; ++i) {
+    ds->ds_ids[i] = dfa->dfa_ids[i];
+    if (prog->state[ds->ds_ids[i]].c == NFA_MATCH)
+      ds->ds_match = TRUE;
+  }
+  ds->ds_hash_next = dfa->dfa_hash[hash & (DFA_HASH_SIZE - 1)];
+  dfa->dfa_hash[hash & (DFA_HASH_SIZE - 1)] = ds;
+  return ds;
+}
+
+/*
+ * Get the state to start with, "bol" is TRUE when starting in column zero.
+ */
+static nfa_dfa_state_T *nfa_dfa_start(nfa_regprog_T *prog, int bol)
+{
+  nfa_dfa_T *dfa = prog->dfa;
+
+  if (dfa->dfa_start[bol] == NULL) {
+    ++dfa->dfa_gen;
+    dfa->dfa_nids = 0;
+    nfa_dfa_addstate(prog, prog->start, bol, FALSE);
+    dfa->dfa_start[bol] = nfa_dfa_getstate(prog);
+  }
+  return dfa->dfa_start[bol];
+}
+
+/*
+ * Compute the state that follows "ds" after character "c".  A match may also
+ * start after "c", thus the start states are added.
+ * Returns NULL when out of memory or when the DFA is given up.
+ */
+static nfa_dfa_state_T *nfa_dfa_step(nfa_regprog_T *prog,
+                                     nfa_dfa_state_T *ds, int c)
+{
+  nfa_dfa_T *dfa = prog->dfa;
+  nfa_dfa_state_T *next;
+  int flushes = dfa->dfa_flushes;
+  int i;
+
+  ++dfa->dfa_gen;
+  dfa->dfa_nids = 0;
+  for (i = 0; i < ds->ds_len; ++i) {
+    nfa_state_T *s = &prog->state[ds->ds_ids[i]];
+
+    if (nfa_dfa_match_char(s, c))
+      /* for a collection the next state is after NFA_END_COLL */
+      nfa_dfa_addstate(prog, s->c == NFA_START_COLL
+          || s->c == NFA_START_NEG_COLL ? s->out1->out : s->out,
+          FALSE, FALSE);
+  }
+  if (!prog->reganch)
+    nfa_dfa_addstate(prog, prog->start, FALSE, FALSE);
+
+  next = nfa_dfa_getstate(prog);
+  /* When states were flushed "ds" was freed. */
+  if (next != NULL && dfa->dfa_flushes == flushes)
+    ds->ds_next[c] = next;
+  return next;
+}
+
+/*
+ * Return TRUE if "ds" matches at the end of the line.
+ */
+static int nfa_dfa_eol_match(nfa_regprog_T *prog, nfa_dfa_state_T *ds, int bol)
+{
+  nfa_dfa_T *dfa = prog->dfa;
+  int i;
+
+  if (ds->ds_match)
+    return TRUE;
+  if (!bol && ds->ds_eol_match >= 0)
+    return ds->ds_eol_match;
+
+  ++dfa->dfa_gen;
+  dfa->dfa_nids = 0;
+  for (i = 0; i < ds->ds_len; ++i)
+    if (prog->state[ds->ds_ids[i]].c == NFA_EOL)
+      nfa_dfa_addstate(prog, prog->state[ds->ds_ids[i]].out, bol, TRUE);
+  for (i = 0; i < dfa->dfa_nids; ++i)
+    if (prog->state[dfa->dfa_ids[i]].c == NFA_MATCH)
+      break;
+  if (!bol)
+    ds->ds_eol_match = i < dfa->dfa_nids;
+  return i < dfa->dfa_nids;
+}
+
+/*
+ * Use the DFA to check if "prog" can match in "line" at or after "col".
+ * Returns FALSE if there is no match, TRUE when there may be one.
+ */
+static int nfa_dfa_may_match(nfa_regprog_T *prog, char_u *line, colnr_T col)
+{
+  nfa_dfa_T *dfa = prog->dfa;
+  nfa_dfa_state_T *ds;
+  nfa_dfa_state_T *next;
+  char_u *p;
+  int c;
+
+  if (dfa == NULL) {
+    dfa = (nfa_dfa_T *)alloc_clear((unsigned)sizeof(nfa_dfa_T));
+    if (dfa == NULL) {
+      prog->dfa_ok = FALSE;
+      return TRUE;
+    }
+    dfa->dfa_mark = (int *)alloc_clear(
+        (unsigned)(sizeof(int) * prog->nstate));
+    dfa->dfa_stack = (int *)alloc((unsigned)(sizeof(int) * prog->nstate));
+    dfa->dfa_ids = (int *)alloc((unsigned)(sizeof(int) * prog->nstate));
+    prog->dfa = dfa;
+    if (dfa->dfa_mark == NULL || dfa->dfa_stack == NULL
+        || dfa->dfa_ids == NULL) {
+      dfa->dfa_disabled = TRUE;
+      return TRUE;
+    }
+    dfa->dfa_ic = ireg_ic;
+    dfa->dfa_has_mbyte = has_mbyte;
+    dfa->dfa_chartab_tick = chartab_tick;
+  }
+  if (dfa->dfa_disabled) {
+    prog->dfa_ok = FALSE;
+    return TRUE;
+  }
+  if (dfa->dfa_ic != ireg_ic || dfa->dfa_has_mbyte != has_mbyte
+      || dfa->dfa_chartab_tick != chartab_tick) {
+    /* The states depend on 'ignorecase', 'encoding' and, for classes like
+     * [:print:], on 'isprint' and friends. */
+    nfa_dfa_flush(dfa);
+    dfa->dfa_ic = ireg_ic;
+    dfa->dfa_has_mbyte = has_mbyte;
+    dfa->dfa_chartab_tick = chartab_tick;
+  }
+
+  ds = nfa_dfa_start(prog, col == 0);
+  if (ds == NULL)
+    return TRUE;
+  for (p = line + col; *p != NUL; ++p) {
+    c = *p;
+    if (c >= 0x80 && has_mbyte)
+      return TRUE;      /* let the NFA handle multi-byte characters */
+    if (ds->ds_match)
+      return TRUE;
+    if (ds->ds_len == 0)
+      return FALSE;     /* no state left, can't match */
+    next = ds->ds_next[c];
+    if (next == NULL) {
+      next = nfa_dfa_step(prog, ds, c);
+      if (next == NULL)
+        return TRUE;
+    }
+    ds = next;
+  }
+  return nfa_dfa_eol_match(prog, ds, p == line);
+}
+
+/*
+ * Number the collections of "prog", stored in "val" of the NFA_START_COLL
+ * and NFA_START_NEG_COLL states, and allocate their bitmaps.
+ */
+static void nfa_coll_setup(nfa_regprog_T *prog)
+{
+  int i;
+  int ncoll = 0;
+
+  prog->coll = NULL;
+  for (i = 0; i < prog->nstate; ++i)
+    if (prog->state[i].c == NFA_START_COLL
+        || prog->state[i].c == NFA_START_NEG_COLL)
+      ++ncoll;
+  if (ncoll == 0)
+    return;
+  prog->coll = (nfa_coll_T *)alloc_clear(
+      (unsigned)(ncoll * sizeof(nfa_coll_T)));
+  if (prog->coll == NULL)
+    return;
+  ncoll = 0;
+  for (i = 0; i < prog->nstate; ++i)
+    if (prog->state[i].c == NFA_START_COLL
+        || prog->state[i].c == NFA_START_NEG_COLL)
+      prog->state[i].val = ++ncoll;
+}
+
+/*
+ * Fill the bitmap "coll" for collection "state" for the current ireg_ic.
+ */
+static void nfa_coll_fill(nfa_coll_T *coll, nfa_state_T *state)
+{
+  int c;
+
+  vim_memset(coll->nc_map, 0, sizeof(coll->nc_map));
+  /* NUL never matches */
+  for (c = 1; c < 256; ++c)
+    if (nfa_dfa_match_char(state, c))
+      coll->nc_map[c >> 3] |= 1 << (c & 7);
+  coll->nc_valid = TRUE;
+  coll->nc_ic = ireg_ic;
+  coll->nc_chartab_tick = chartab_tick;
+}
+
 /*
  * Try match of "prog" with at regline["col"].
  * Returns 0 for failure, number of lines contained in the match otherwise.
@@ -6152,7 +6996,8 @@ static long nfa_regtry(nfa_regprog_T *prog, colnr_T col)
 static long 
 nfa_regexec_both (
     char_u *line,
-    colnr_T startcol               /* column to start looking for match */
+    colnr_T startcol,              /* column to start looking for match */
+    proftime_T *tm                 /* timeout limit or NULL */
 )
 {
   nfa_regprog_T   *prog;
@@ -6160,6 +7005,8 @@ nfa_regexec_both (
   int i;
   colnr_T col = startcol;
 
+  reg_start_time(tm);
+
   if (REG_MULTI) {
     prog = (nfa_regprog_T *)reg_mmatch->regprog;
     line = reg_getline((linenr_T)0);        /* relative to the cursor */
@@ -6187,6 +7034,9 @@ nfa_regexec_both (
   if (prog->regflags & RF_ICOMBINE)
     ireg_icombine = TRUE;
 
+  if (ireg_ic)
+    init_lower_tab();
+
   regline = line;
   reglnum = 0;      /* relative to line */
 
@@ -6202,6 +7052,12 @@ nfa_regexec_both (
   if (prog->reganch && col > 0)
     return 0L;
 
+  /* If there is text that must appear, look for it.  With "\Z" composing
+   * characters in the text are skipped, it may be split up. */
+  if (prog->regmust != NULL && !ireg_icombine
+      && !nfa_has_regmust(prog, line + col))
+    return 0L;
+
   need_clear_subexpr = TRUE;
   /* Clear the external match subpointers if necessary. */
   if (prog->reghasz == REX_SET) {
@@ -6228,6 +7084,12 @@ nfa_regexec_both (
   if (ireg_maxcol > 0 && col >= ireg_maxcol)
     goto theend;
 
+  /* When the DFA finds that there is no match in this line there is no need
+   * to run the NFA.  A "\n" in "line" is a line break for
+   * vim_regexec_nl(), leave that to the NFA. */
+  if (prog->dfa_ok && !reg_line_lbr && !nfa_dfa_may_match(prog, line, col))
+    goto theend;
+
   nstate = prog->nstate;
   for (i = 0; i < nstate; ++i) {
     prog->state[i].id = i;
@@ -6330,6 +7192,23 @@ static regprog_T *nfa_regcomp(char_u *expr, int re_flags)
   prog->reganch = nfa_get_reganch(prog->start, 0);
   prog->regstart = nfa_get_regstart(prog->start, 0);
   prog->match_text = nfa_get_match_text(prog->start);
+  prog->regmust = nfa_get_regmust(postfix, post_ptr);
+  prog->regmust_anycase = FALSE;
+  if (prog->regmust != NULL) {
+    char_u *s;
+
+    prog->regmlen = (int)STRLEN(prog->regmust);
+    /* Case folding may turn a multi-byte character into one of these
+     * characters, only use regmust with 'ignorecase' when there are no
+     * letters. */
+    for (s = prog->regmust; *s != NUL; ++s)
+      if (*s >= 0x80 || ASCII_ISALPHA(*s))
+        break;
+    prog->regmust_anycase = (*s == NUL);
+  }
+  prog->dfa_ok = nfa_dfa_possible(prog);
+  prog->dfa = NULL;
+  nfa_coll_setup(prog);
 
 #ifdef ENABLE_LOG
   nfa_postfix_dump(expr, OK);
@@ -6367,6 +7246,9 @@ static void nfa_regfree(regprog_T *prog)
 {
   if (prog != NULL) {
     vim_free(((nfa_regprog_T *)prog)->match_text);
+    vim_free(((nfa_regprog_T *)prog)->regmust);
+    nfa_dfa_free(((nfa_regprog_T *)prog)->dfa);
+    vim_free(((nfa_regprog_T *)prog)->coll);
 #ifdef REGEXP_DEBUG
     vim_free(((nfa_regprog_T *)prog)->pattern);
 #endif
@@ -6397,7 +7279,7 @@ nfa_regexec (
   ireg_ic = rmp->rm_ic;
   ireg_icombine = FALSE;
   ireg_maxcol = 0;
-  return nfa_regexec_both(line, col) != 0;
+  return nfa_regexec_both(line, col, NULL) != 0;
 }
 
 #if defined(FEAT_MODIFY_FNAME) || defined(FEAT_EVAL) \
@@ -6424,7 +7306,7 @@ nfa_regexec_nl (
   ireg_ic = rmp->rm_ic;
   ireg_icombine = FALSE;
   ireg_maxcol = 0;
-  return nfa_regexec_both(line, col) != 0;
+  return nfa_regexec_both(line, col, NULL) != 0;
 }
 #endif
 
@@ -6473,7 +7355,7 @@ proftime_T  *tm;         /* timeout limit or NULL */
   ireg_icombine = FALSE;
   ireg_maxcol = rmp->rmm_maxcol;
 
-  return nfa_regexec_both(NULL, col);
+  return nfa_regexec_both(NULL, col, tm);
 }
 
 #ifdef REGEXP_DEBUG
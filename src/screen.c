@@ -136,6 +136,15 @@ static void init_search_hl __ARGS((win_T *wp));
 static void prepare_search_hl __ARGS((win_T *wp, linenr_T lnum));
 static void next_search_hl __ARGS((win_T *win, match_T *shl, linenr_T lnum,
                                    colnr_T mincol));
+static hlcache_T *hlcache_prepare __ARGS((hlcache_T *hc, regmmatch_T *rmp,
+                                          buf_T *buf));
+static void hlcache_forget __ARGS((hlcache_T *hc, linenr_T lnum,
+                                   linenr_T lnume));
+static void hlcache_update __ARGS((hlcache_T *hc, buf_T *buf, linenr_T lnum,
+                                   linenr_T lnume));
+static int hlcache_nomatch __ARGS((hlcache_T *hc, linenr_T lnum));
+static void hlcache_set_nomatch __ARGS((hlcache_T *hc, linenr_T lnum,
+                                        linenr_T line_count));
 static void screen_start_highlight __ARGS((int attr));
 static void screen_char __ARGS((unsigned off, int row, int col));
 static void screen_char_2 __ARGS((unsigned off, int row, int col));
@@ -476,6 +485,9 @@ void update_screen(int type)
   if (type == CLEAR) {          /* first clear screen */
     screenclear();              /* will reset clear_cmdline */
     type = NOT_VALID;
+    /* Try syntax highlighting again where it took too long before. */
+    FOR_ALL_WINDOWS(wp)
+      wp->w_s->b_syn_slow = FALSE;
   }
 
   if (clear_cmdline)            /* going to clear cmdline (done below) */
@@ -708,6 +720,7 @@ static void win_update(win_T *wp)
   linenr_T mod_top = 0;
   linenr_T mod_bot = 0;
   int save_got_int;
+  proftime_T syntax_tm;
 
   type = wp->w_redr_type;
 
@@ -1240,6 +1253,10 @@ static void win_update(win_T *wp)
   got_int = 0;
   win_foldinfo.fi_level = 0;
 
+  /* Syntax highlighting gets 'redrawtime' for the whole window. */
+  profile_setlimit(p_rdt, &syntax_tm);
+  syn_set_timeout(&syntax_tm);
+
   /*
    * Update all the window rows.
    */
@@ -1576,6 +1593,8 @@ static void win_update(win_T *wp)
     win_draw_end(wp, '~', ' ', row, wp->w_height, HLF_AT);
   }
 
+  syn_set_timeout(NULL);
+
   /* Reset the type of redrawing required, the window has been updated. */
   wp->w_redr_type = 0;
   wp->w_old_topfill = wp->w_topfill;
@@ -2120,6 +2139,8 @@ win_line (
   int vcol_save_attr = 0;               /* saved attr for 'cursorcolumn' */
   int syntax_attr = 0;                  /* attributes desired by syntax */
   int has_syntax = FALSE;               /* this buffer has syntax highl. */
+  int         *syn_attrs = NULL;        /* syntax attributes computed ahead */
+  int syn_attrs_len = 0;                /* nr of entries in syn_attrs[] */
   int save_did_emsg;
   int eol_hl_off = 0;                   /* 1 if highlighted char after EOL */
   int draw_color_col = FALSE;           /* highlight colorcolumn */
@@ -2209,7 +2230,14 @@ win_line (
    * trailing white space and/or syntax processing to be done.
    */
   extra_check = wp->w_p_lbr;
-  if (syntax_present(wp) && !wp->w_s->b_syn_error) {
+  if (syntax_present(wp) && !wp->w_s->b_syn_error && !wp->w_s->b_syn_slow
+      && wp->w_p_cole == 0 && !wp->w_p_spell
+      && (syn_attrs = syntax_line_attrs(wp, lnum, &syn_attrs_len)) != NULL) {
+    /* Use the attributes computed while waiting for a character. */
+    has_syntax = TRUE;
+    extra_check = TRUE;
+  } else if (syntax_present(wp) && !wp->w_s->b_syn_error
+             && !wp->w_s->b_syn_slow) {
     /* Prepare for syntax highlighting in this line.  When there is an
      * error, stop syntax highlighting. */
     save_did_emsg = did_emsg;
@@ -3134,7 +3162,14 @@ win_line (
         /* Get syntax attribute, unless still at the start of the line
          * (double-wide char that doesn't fit). */
         v = (long)(ptr - line);
-        if (has_syntax && v > 0) {
+        if (has_syntax && v > 0 && syn_attrs != NULL) {
+          syntax_attr = v - 1 < syn_attrs_len ? syn_attrs[v - 1] : 0;
+          if (!attr_pri)
+            char_attr = syntax_attr;
+          else
+            char_attr = hl_combine_attr(syntax_attr, char_attr);
+          syntax_flags = 0;
+        } else if (has_syntax && v > 0) {
           /* Get the syntax attribute for the character.  If there
            * is an error, disable syntax highlighting. */
           save_did_emsg = did_emsg;
@@ -3149,6 +3184,10 @@ win_line (
             has_syntax = FALSE;
           } else
             did_emsg = save_did_emsg;
+          /* When syntax highlighting took too long the rest of the line
+           * is drawn without it. */
+          if (wp->w_s->b_syn_slow)
+            has_syntax = FALSE;
 
           /* Need to get the line again, a multi-line regexp may
            * have made it invalid. */
@@ -4668,6 +4707,7 @@ void win_redr_status(win_T *wp)
   int fillchar;
   int attr;
   int this_ru_col;
+  int loaded;
   static int busy = FALSE;
 
   /* It's possible to get here recursively when 'statusline' (indirectly)
@@ -4696,11 +4736,13 @@ void win_redr_status(win_T *wp)
     get_trans_bufname(wp->w_buffer);
     p = NameBuff;
     len = (int)STRLEN(p);
+    loaded = readfile_bg_percent(wp->w_buffer);
 
     if (wp->w_buffer->b_help
         || wp->w_p_pvw
         || bufIsChanged(wp->w_buffer)
-        || wp->w_buffer->b_p_ro)
+        || wp->w_buffer->b_p_ro
+        || loaded >= 0)
       *(p + len++) = ' ';
     if (wp->w_buffer->b_help) {
       STRCPY(p + len, _("[Help]"));
@@ -4718,6 +4760,11 @@ void win_redr_status(win_T *wp)
       STRCPY(p + len, _("[RO]"));
       len += 4;
     }
+    if (loaded >= 0) {
+      /* file is being loaded in the background */
+      sprintf((char *)p + len, _("[loading %d%%]"), loaded);
+      len += (int)STRLEN(p + len);
+    }
 
     this_ru_col = ru_col - (Columns - W_WIDTH(wp));
     if (this_ru_col < (W_WIDTH(wp) + 1) / 2)
@@ -5363,6 +5410,7 @@ static void init_search_hl(win_T *wp)
     cur->hl.buf = wp->w_buffer;
     cur->hl.lnum = 0;
     cur->hl.first_lnum = 0;
+    cur->hl.hc = hlcache_prepare(&cur->hlcache, &cur->hl.rm, wp->w_buffer);
     /* Set the time limit to 'redrawtime'. */
     profile_setlimit(p_rdt, &(cur->hl.tm));
     cur = cur->next;
@@ -5370,6 +5418,8 @@ static void init_search_hl(win_T *wp)
   search_hl.buf = wp->w_buffer;
   search_hl.lnum = 0;
   search_hl.first_lnum = 0;
+  search_hl.hc = hlcache_prepare(&wp->w_buffer->b_hlcache, &search_hl.rm,
+      wp->w_buffer);
   /* time limit is set at the toplevel, for all windows */
 }
 
@@ -5426,6 +5476,143 @@ static void prepare_search_hl(win_T *wp, linenr_T lnum)
   }
 }
 
+/*
+ * To avoid matching the same lines again and again while redrawing, the
+ * lines that are known not to contain a match for a 'hlsearch' or match
+ * pattern are remembered in a bitmap.  This is only done for patterns that
+ * match within a line and don't depend on the cursor position, marks, the
+ * line number, etc.  changed_common() calls hlcache_changed() to forget
+ * about changed lines, other changes to the buffer or 'iskeyword' make the
+ * whole bitmap invalid.
+ */
+
+/*
+ * Prepare using "hc" for the matches of "rmp" in buffer "buf".
+ * Returns "hc", or NULL when it can't be used for this pattern.
+ */
+static hlcache_T *hlcache_prepare(hlcache_T *hc, regmmatch_T *rmp, buf_T *buf)
+{
+  regprog_T   *prog = rmp->regprog;
+
+  if (prog == NULL || re_multiline(prog) || re_lookbehind(prog)
+      || re_posdep(prog))
+    return NULL;
+  if (hc->hc_prog != prog
+      || hc->hc_ic != rmp->rmm_ic
+      || hc->hc_fnum != buf->b_fnum
+      || hc->hc_changedtick != buf->b_changedtick
+      || hc->hc_chartab_tick != chartab_tick) {
+    hlcache_clear(hc);
+    hc->hc_prog = vim_regref(prog);
+    hc->hc_ic = rmp->rmm_ic;
+    hc->hc_fnum = buf->b_fnum;
+    hc->hc_changedtick = buf->b_changedtick;
+    hc->hc_chartab_tick = chartab_tick;
+  }
+  return hc;
+}
+
+/*
+ * Forget everything in "hc" and release the pattern.
+ */
+void hlcache_clear(hlcache_T *hc)
+{
+  vim_regfree(hc->hc_prog);
+  hc->hc_prog = NULL;
+  vim_free(hc->hc_nomatch);
+  hc->hc_nomatch = NULL;
+  hc->hc_size = 0;
+}
+
+/*
+ * Forget about lines "lnum" to "lnume" (not including) in "hc".
+ */
+static void hlcache_forget(hlcache_T *hc, linenr_T lnum, linenr_T lnume)
+{
+  if (lnume > hc->hc_size)
+    lnume = hc->hc_size;
+  for (; lnum < lnume && (lnum & 7) != 0; ++lnum)
+    hc->hc_nomatch[lnum >> 3] &= ~(1 << (lnum & 7));
+  if (lnum + 8 <= lnume) {
+    vim_memset(hc->hc_nomatch + (lnum >> 3), 0, (size_t)((lnume - lnum) >> 3));
+    lnum += (lnume - lnum) & ~7;
+  }
+  for (; lnum < lnume; ++lnum)
+    hc->hc_nomatch[lnum >> 3] &= ~(1 << (lnum & 7));
+}
+
+/*
+ * Return TRUE if line "lnum" is known not to contain a match.
+ */
+static int hlcache_nomatch(hlcache_T *hc, linenr_T lnum)
+{
+  return lnum < hc->hc_size
+         && (hc->hc_nomatch[lnum >> 3] & (1 << (lnum & 7)));
+}
+
+/*
+ * Remember that line "lnum" doesn't contain a match.  "line_count" is the
+ * number of lines in the buffer.
+ */
+static void hlcache_set_nomatch(hlcache_T *hc, linenr_T lnum,
+                                linenr_T line_count)
+{
+  char_u      *p;
+  linenr_T size;
+
+  if (lnum >= hc->hc_size) {
+    size = (line_count > lnum ? line_count : lnum) + 64;
+    size = (size + 7) & ~7;
+    p = alloc_clear((unsigned)(size >> 3));
+    if (p == NULL)
+      return;
+    if (hc->hc_nomatch != NULL) {
+      mch_memmove(p, hc->hc_nomatch, (size_t)(hc->hc_size >> 3));
+      vim_free(hc->hc_nomatch);
+    }
+    hc->hc_nomatch = p;
+    hc->hc_size = size;
+  }
+  hc->hc_nomatch[lnum >> 3] |= 1 << (lnum & 7);
+}
+
+/*
+ * Called by changed_common() for a change in lines "lnum" to "lnume" (not
+ * including) of buffer "buf", with "xtra" lines inserted (negative when
+ * deleted).  Forgets about the changed lines for the 'hlsearch' pattern and
+ * the matches of windows on this buffer.  When lines were inserted or
+ * deleted the lines below them are forgotten as well.
+ * Must be called after b_changedtick was incremented for the change.
+ */
+void hlcache_changed(buf_T *buf, linenr_T lnum, linenr_T lnume, long xtra)
+{
+  win_T       *wp;
+  tabpage_T   *tp;
+  matchitem_T *cur;
+
+  if (xtra != 0)
+    lnume = MAXLNUM;
+  hlcache_update(&buf->b_hlcache, buf, lnum, lnume);
+  FOR_ALL_TAB_WINDOWS(tp, wp)
+  for (cur = wp->w_match_head; cur != NULL; cur = cur->next)
+    hlcache_update(&cur->hlcache, buf, lnum, lnume);
+}
+
+/*
+ * Forget lines "lnum" to "lnume" (not including) in "hc" when it is for
+ * buffer "buf" and was valid before the change.
+ */
+static void hlcache_update(hlcache_T *hc, buf_T *buf, linenr_T lnum,
+                           linenr_T lnume)
+{
+  if (hc->hc_prog != NULL
+      && hc->hc_fnum == buf->b_fnum
+      && hc->hc_changedtick == buf->b_changedtick - 1) {
+    hlcache_forget(hc, lnum, lnume);
+    hc->hc_changedtick = buf->b_changedtick;
+  }
+}
+
 /*
  * Search for a next 'hlsearch' or match.
  * Uses shl->buf.
@@ -5445,6 +5632,7 @@ next_search_hl (
   linenr_T l;
   colnr_T matchcol;
   long nmatched;
+  int timed_out;
 
   if (shl->lnum != 0) {
     /* Check for three situations:
@@ -5497,9 +5685,16 @@ next_search_hl (
     } else
       matchcol = shl->rm.endpos[0].col;
 
+    /* Don't try matching a line that is known not to match. */
+    if (matchcol == 0 && shl->hc != NULL && hlcache_nomatch(shl->hc, lnum)) {
+      shl->lnum = 0;
+      break;
+    }
+
     shl->lnum = lnum;
+    timed_out = FALSE;
     nmatched = vim_regexec_multi(&shl->rm, win, shl->buf, lnum, matchcol,
-        &(shl->tm)
+        &(shl->tm), &timed_out
         );
     if (called_emsg || got_int) {
       /* Error while handling regexp: stop using this regexp. */
@@ -5514,6 +5709,10 @@ next_search_hl (
       break;
     }
     if (nmatched == 0) {
+      /* Remember the whole line doesn't match, unless matching stopped
+       * at the time limit. */
+      if (matchcol == 0 && shl->hc != NULL && !timed_out)
+        hlcache_set_nomatch(shl->hc, lnum, shl->buf->b_ml.ml_line_count);
       shl->lnum = 0;                    /* no match found */
       break;
     }
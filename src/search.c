@@ -449,6 +449,11 @@ proftime_T  *tm;         /* timeout limit or NULL */
   int submatch = 0;
   int save_called_emsg = called_emsg;
   int break_loop = FALSE;
+  int timed_out = FALSE;
+  char_u      *must;
+  int mustlen;
+  int mustic;
+  linenr_T lnum_end;
 
   if (search_regcomp(pat, RE_SEARCH, pat_use,
           (options & (SEARCH_HIS + SEARCH_KEEP)), &regmatch) == FAIL) {
@@ -456,6 +461,14 @@ proftime_T  *tm;         /* timeout limit or NULL */
       EMSG2(_("E383: Invalid search string: %s"), mr_pattern);
     return FAIL;
   }
+  /* Search all lines of a file loaded in the background, except when only
+   * peeking for 'incsearch'. */
+  if (!(options & SEARCH_PEEK))
+    readfile_bg_wait(buf);
+
+  /* Text that must be in a line for a match to start there. */
+  mustic = regmatch.rmm_ic;
+  must = vim_regmust(regmatch.regprog, &mustic, &mustlen);
 
   /* When not accepting a match at the start position set "extra_col" to a
    * non-zero value.  Don't do that when starting at MAXCOL, since MAXCOL +
@@ -513,15 +526,32 @@ proftime_T  *tm;         /* timeout limit or NULL */
         if (tm != NULL && profile_passed_limit(tm))
           break;
 
+        /* Skip over lines without the text a match must contain, looking
+         * at the memline blocks instead of trying to match each line. */
+        if (must != NULL && !at_first_line) {
+          lnum_end = dir == FORWARD ? buf->b_ml.ml_line_count : 1;
+          if (stop_lnum != 0 && (dir == FORWARD ? stop_lnum < lnum_end
+                                 : stop_lnum > lnum_end))
+            lnum_end = stop_lnum;
+          if (loop && (dir == FORWARD ? start_pos.lnum < lnum_end
+                       : start_pos.lnum > lnum_end))
+            lnum_end = start_pos.lnum;
+          lnum = ml_find_text(buf, lnum, lnum_end, dir, must, mustlen,
+              mustic);
+          if (lnum == 0 || got_int)
+            break;
+        }
+
         /*
          * Look for a match somewhere in line "lnum".
          */
         nmatched = vim_regexec_multi(&regmatch, win, buf,
             lnum, (colnr_T)0,
-            tm
+            tm, &timed_out
             );
-        /* Abort searching on an error (e.g., out of stack). */
-        if (called_emsg)
+        /* Abort searching on an error (e.g., out of stack) or when matching
+         * took too long. */
+        if (called_emsg || timed_out)
           break;
         if (nmatched > 0) {
           /* match may actually be in another line when using \zs */
@@ -594,7 +624,7 @@ proftime_T  *tm;         /* timeout limit or NULL */
                   || (nmatched = vim_regexec_multi(&regmatch,
                           win, buf, lnum + matchpos.lnum,
                           matchcol,
-                          tm
+                          tm, &timed_out
                           )) == 0) {
                 match_ok = FALSE;
                 break;
@@ -684,7 +714,7 @@ proftime_T  *tm;         /* timeout limit or NULL */
                   || (nmatched = vim_regexec_multi(&regmatch,
                           win, buf, lnum + matchpos.lnum,
                           matchcol,
-                          tm
+                          tm, &timed_out
                           )) == 0)
                 break;
 
@@ -695,9 +725,10 @@ proftime_T  *tm;         /* timeout limit or NULL */
 
             /*
              * If there is only a match after the cursor, skip
-             * this match.
+             * this match.  When matching took too long the match
+             * found may not be the last one.
              */
-            if (!match_ok)
+            if (!match_ok || timed_out)
               continue;
           }
 
@@ -762,7 +793,7 @@ proftime_T  *tm;         /* timeout limit or NULL */
        * twice.
        */
       if (!p_ws || stop_lnum != 0 || got_int || called_emsg
-          || break_loop
+          || break_loop || timed_out
           || found || loop)
         break;
 
@@ -782,7 +813,7 @@ proftime_T  *tm;         /* timeout limit or NULL */
                 ? top_bot_msg : bot_top_msg), TRUE);
     }
     if (got_int || called_emsg
-        || break_loop
+        || break_loop || timed_out
         )
       break;
   } while (--count > 0 && found);   /* stop after count matches or no match */
@@ -3906,7 +3937,7 @@ static int is_one_char(char_u *pattern)
      * start and end are in the same position. */
     called_emsg = FALSE;
     nmatched = vim_regexec_multi(&regmatch, curwin, curbuf,
-        pos.lnum, (colnr_T)0, NULL);
+        pos.lnum, (colnr_T)0, NULL, NULL);
 
     if (!called_emsg)
       result = (nmatched != 0
@@ -326,29 +326,27 @@ typedef struct memfile memfile_T;
 typedef long blocknr_T;
 
 /*
- * mf_hashtab_T is a chained hashtable with blocknr_T key and arbitrary
- * structures as items.  This is an intrusive data structure: we require
- * that items begin with mf_hashitem_T which contains the key and linked
- * list pointers.  List of items in each bucket is doubly-linked.
+ * mf_hashtab_T is an open addressing hashtable with blocknr_T key and
+ * arbitrary structures as items.  This is an intrusive data structure: we
+ * require that items begin with mf_hashitem_T which contains the key.  The
+ * table holds pointers to the items.
  */
 
 typedef struct mf_hashitem_S mf_hashitem_T;
 
 struct mf_hashitem_S {
-  mf_hashitem_T   *mhi_next;
-  mf_hashitem_T   *mhi_prev;
   blocknr_T mhi_key;
 };
 
 #define MHT_INIT_SIZE   64
 
 typedef struct mf_hashtab_S {
-  long_u mht_mask;                  /* mask used for hash value (nr of items
+  long_u mht_mask;                  /* mask used for hash value (nr of slots
                                      * in array is "mht_mask" + 1) */
   long_u mht_count;                 /* nr of items inserted into hashtable */
   mf_hashitem_T   **mht_buckets;    /* points to mht_small_buckets or
                                      *dynamically allocated array */
-  mf_hashitem_T   *mht_small_buckets[MHT_INIT_SIZE];     /* initial buckets */
+  mf_hashitem_T   *mht_small_buckets[MHT_INIT_SIZE];     /* initial slots */
   char mht_fixed;                   /* non-zero value forbids growth */
 } mf_hashtab_T;
 
@@ -358,10 +356,13 @@ typedef struct mf_hashtab_S {
  * The block may be linked in the used list OR in the free list.
  * The used blocks are also kept in hash lists.
  *
- * The used list is a doubly linked list, most recently used block first.
+ * The used list is a doubly linked list, most recently added block first.
  *	The blocks in the used list have a block of memory allocated.
  *	mf_used_count is the number of pages in the used list.
- * The hash lists are used to quickly find a block in the used list.
+ *	A block that was used again gets BH_REF set.  When releasing a block
+ *	such a block is moved to the front once instead of being released
+ *	("second chance" or CLOCK replacement).
+ * The hash table is used to quickly find a block in the used list.
  * The free list is a single linked list, not sorted.
  *	The blocks in the free list have no block of memory allocated and
  *	the contents of the block in the file (if any) is irrelevant.
@@ -375,17 +376,19 @@ struct block_hdr {
   bhdr_T      *bh_prev;             /* previous block_hdr in used list */
   char_u      *bh_data;             /* pointer to memory (for used block) */
   int bh_page_count;                /* number of pages in this block */
+  char bh_arena;                    /* bh_data is a page in mf_arena */
 
 #define BH_DIRTY    1
 #define BH_LOCKED   2
-  char bh_flags;                    /* BH_DIRTY or BH_LOCKED */
+#define BH_REF      4               /* used since put in the used list */
+  char bh_flags;                    /* BH_DIRTY, BH_LOCKED or BH_REF */
 };
 
 /*
  * when a block with a negative number is flushed to the file, it gets
  * a positive number. Because the reference to the block is still the negative
  * number, we remember the translation to the new positive number in the
- * double linked trans lists. The structure is the same as the hash lists.
+ * trans hash table.  The structure is the same as the hash table.
  */
 typedef struct nr_trans NR_TRANS;
 
@@ -458,6 +461,17 @@ typedef struct {
   char_u      *save_ei;                 /* saved value of 'eventignore' */
 } cmdmod_T;
 
+/*
+ * Counters for the blocks of a memfile kept in memory, see memfilestats().
+ */
+typedef struct {
+  long_u mst_hits;                      /* mf_get() found block in memory */
+  long_u mst_misses;                    /* mf_get() read block from file */
+  long_u mst_evictions;                 /* blocks released to save memory */
+  long_u mst_written;                   /* bytes written to the file */
+  long_u mst_writes;                    /* nr of write() calls */
+} mfstats_T;
+
 #define MF_SEED_LEN     8
 
 struct memfile {
@@ -465,12 +479,17 @@ struct memfile {
   char_u      *mf_ffname;               /* idem, full path */
   int mf_fd;                            /* file descriptor */
   bhdr_T      *mf_free_first;           /* first block_hdr in free list */
-  bhdr_T      *mf_used_first;           /* mru block_hdr in used list */
-  bhdr_T      *mf_used_last;            /* lru block_hdr in used list */
+  bhdr_T      *mf_used_first;           /* newest block_hdr in used list */
+  bhdr_T      *mf_used_last;            /* oldest block_hdr in used list */
   unsigned mf_used_count;               /* number of pages in used list */
   unsigned mf_used_count_max;           /* maximum number of pages in memory */
-  mf_hashtab_T mf_hash;                 /* hash lists */
-  mf_hashtab_T mf_trans;                /* trans lists */
+  mf_hashtab_T mf_hash;                 /* hash table of used blocks */
+  mf_hashtab_T mf_trans;                /* hash table of translations */
+  mfstats_T mf_stats;                   /* counters for memfilestats() */
+  char_u      *mf_arena;                /* chunks of pages for blocks when
+                                           there is no swap file */
+  char_u      *mf_arena_free;           /* list of freed pages in mf_arena */
+  int mf_arena_used;                    /* nr of pages used in first chunk */
   blocknr_T mf_blocknr_max;             /* highest positive block number + 1*/
   blocknr_T mf_blocknr_min;             /* lowest negative block number - 1 */
   blocknr_T mf_neg_count;               /* number of negative blocks numbers */
@@ -502,6 +521,23 @@ typedef struct info_pointer {
   int ip_index;                 /* index for block with current lnum */
 } infoptr_T;    /* block/index pair */
 
+/*
+ * Entry in the cache of data blocks found by ml_find_line().  Holds the range
+ * of lines in the data block and the pointer blocks leading to it, as they
+ * are put in ml_stack.
+ */
+#define ML_CACHE_SIZE   32      /* nr of entries in ml_cache */
+#define ML_CACHE_DEPTH  6       /* max nr of pointer blocks in mc_path */
+
+typedef struct {
+  blocknr_T mc_bnum;            /* data block number, zero if unused */
+  int mc_page_count;            /* number of pages in the data block */
+  linenr_T mc_low;              /* lowest lnum in the data block */
+  linenr_T mc_high;             /* highest lnum in the data block */
+  int mc_depth;                 /* nr of entries in mc_path */
+  infoptr_T mc_path[ML_CACHE_DEPTH];    /* pointer blocks from the root */
+} mlcache_T;
+
 typedef struct ml_chunksize {
   int mlcs_numlines;
   long mlcs_totalsize;
@@ -513,6 +549,40 @@ typedef struct ml_chunksize {
 #define ML_CHNK_DELLINE 2
 #define ML_CHNK_UPDLINE 3
 
+/*
+ * The text of a buffer that is still in the file that readfile() mapped into
+ * memory.  Lines are copied from the mapping when they are used, until the
+ * buffer is changed, see ml_unmap().
+ */
+#define MLMAP_STEP      64      /* mm_index[] has every 64th line */
+#define MLMAP_LINES     8       /* nr of lines kept for ml_get() */
+
+typedef struct bgload_S bgload_T;  /* defined in fileio.c */
+
+typedef struct {
+  char_u      *mm_start;        /* start of the mapping */
+  size_t mm_len;                /* size of the mapping */
+  size_t mm_end;                /* end of the text of the lines, less than
+                                   mm_len while still loading */
+  bgload_T    *mm_load;         /* loading the rest of the lines in the
+                                   background or NULL */
+  dev_t mm_dev;                 /* device of the mapped file */
+  ino_t mm_ino;                 /* inode of the mapped file */
+  size_t      *mm_index;        /* offset of line 1, 1 + MLMAP_STEP, etc. */
+  int mm_dos;                   /* a CR before a NL is not in the line */
+  int mm_eol;                   /* last line has a NL */
+  linenr_T mm_find_lnum;        /* line last found, zero if none */
+  size_t mm_find_off;           /* offset of line mm_find_lnum */
+  char_u      *mm_marks;        /* a bit for each line marked with
+                                   ml_setmarked(), NULL when none */
+  struct {
+    linenr_T mml_lnum;          /* line number, zero if not used */
+    char_u      *mml_text;      /* copy of the line */
+    size_t mml_size;            /* nr of bytes allocated for mml_text */
+  } mm_lines[MLMAP_LINES];
+  int mm_lines_next;            /* entry in mm_lines[] to use next */
+} mlmap_T;
+
 /*
  * the memline structure holds all the information about a memline
  */
@@ -538,9 +608,20 @@ typedef struct memline {
   linenr_T ml_locked_low;       /* first line in ml_locked */
   linenr_T ml_locked_high;      /* last line in ml_locked */
   int ml_locked_lineadd;            /* number of lines inserted in ml_locked */
+
+  mlcache_T   *ml_cache;        /* recently found data blocks, NULL if not
+                                   allocated yet */
+  int ml_cache_used;            /* nr of used entries in ml_cache */
+  int ml_cache_next;            /* entry to be replaced next */
   chunksize_T *ml_chunksize;
   int ml_numchunks;
   int ml_usedchunks;
+  chunksize_T *ml_chunktree;    /* Fenwick tree over ml_chunksize */
+  int ml_chunktree_len;         /* nr of chunks in ml_chunktree, zero when it
+                                   must be rebuilt */
+  int ml_chunktree_size;        /* nr of entries allocated for ml_chunktree */
+
+  mlmap_T     *ml_map;          /* mapped file with the text or NULL */
 } memline_T;
 
 
@@ -721,6 +802,21 @@ typedef struct buf_state {
   reg_extmatch_T *bs_extmatch;   /* external matches from start pattern */
 } bufstate_T;
 
+/*
+ * syn_stack contains a state stack that is used by one or more entries in
+ * b_sst_array[].  Equal stacks are stored only once, they are found through
+ * the hash table b_sst_stacks[].
+ */
+typedef struct syn_stack synstack_T;
+
+struct syn_stack {
+  synstack_T  *ss_next;         /* next stack in the same hash bucket */
+  unsigned ss_hash;             /* hash value of ss_states[] */
+  int ss_refcount;              /* number of entries using this stack */
+  int ss_len;                   /* number of states in ss_states[] */
+  bufstate_T ss_states[1];      /* actually longer */
+};
+
 /*
  * syn_state contains the syntax state stack for the start of one line.
  * Used by b_sst_array[].
@@ -730,10 +826,7 @@ typedef struct syn_state synstate_T;
 struct syn_state {
   synstate_T  *sst_next;        /* next entry in used or free list */
   linenr_T sst_lnum;            /* line number for this state */
-  union {
-    bufstate_T sst_stack[SST_FIX_STATES];          /* short state stack */
-    garray_T sst_ga;            /* growarray for long state stack */
-  } sst_union;
+  synstack_T  *sst_stack;       /* shared state stack, NULL when empty */
   int sst_next_flags;           /* flags for sst_next_list */
   int sst_stacksize;            /* number of states on the stack */
   short       *sst_next_list;   /* "nextgroup" list in this state
@@ -743,6 +836,26 @@ struct syn_state {
                                  * may have made the state invalid */
 };
 
+/*
+ * synline_T contains the syntax attributes of one line, computed ahead of
+ * displaying it.  Used by b_sal_lines[].
+ */
+typedef struct {
+  int         *sl_attrs;        /* attribute for each byte and the NUL */
+  int sl_len;                   /* number of entries in sl_attrs[] */
+} synline_T;
+
+/*
+ * synidset_T contains the group IDs in an ID list of syntax items, with the
+ * clusters expanded, as a bitset.  Used by b_syn_idsets[].
+ */
+typedef struct {
+  short       *is_list;         /* the ID list, NULL for an unused entry */
+  int is_len;                   /* number of bits in is_bits[] */
+  char_u      *is_bits;         /* bit set for each group ID in the list,
+                                   NULL when it can't be used */
+} synidset_T;
+
 /*
  * Structure shared between syntax.c, screen.c and gui_x11.c.
  */
@@ -1035,7 +1148,15 @@ typedef struct {
 typedef struct {
   hashtab_T b_keywtab;                  /* syntax keywords hash table */
   hashtab_T b_keywtab_ic;               /* idem, ignore case */
+  unsigned    *b_keywlens;              /* lengths of the keywords for each
+                                           first byte or NULL, see
+                                           syn_make_keywlens() */
+  synidset_T  *b_syn_idsets;             /* hash table with bitsets for ID
+                                           lists, see syn_id_list_bits() */
+  int b_syn_idsets_size;                /* number of entries in b_syn_idsets */
+  int b_syn_idsets_used;                /* number of used entries */
   int b_syn_error;                      /* TRUE when error occurred in HL */
+  int b_syn_slow;                       /* TRUE when 'redrawtime' reached */
   int b_syn_ic;                         /* ignore case for :syn cmds */
   int b_syn_spell;                      /* SYNSPL_ values */
   garray_T b_syn_patterns;              /* table for syntax patterns */
@@ -1062,22 +1183,44 @@ typedef struct {
    * start of that line (col == 0).  This avoids having to recompute the
    * syntax state too often.
    * b_sst_array[] is allocated to hold the state for all displayed lines,
-   * and states for 1 out of about 20 other lines.
+   * and states for 1 out of SST_DIST other lines, up to SST_MAX_MEM bytes.
    * b_sst_array	pointer to an array of synstate_T
    * b_sst_len	number of entries in b_sst_array[]
    * b_sst_first	pointer to first used entry in b_sst_array[] or NULL
    * b_sst_firstfree	pointer to first free entry in b_sst_array[] or NULL
    * b_sst_freecount	number of free entries in b_sst_array[]
+   * b_sst_lastfind	entry last found by syn_stack_find_entry() or NULL
    * b_sst_check_lnum	entries after this lnum need to be checked for
    *			validity (MAXLNUM means no check needed)
+   * b_sst_stacks	hash table with the state stacks used by the entries
+   * b_sst_stacks_len	number of buckets in b_sst_stacks[], a power of two
+   * b_sst_stacks_count	number of stacks in b_sst_stacks[]
    */
   synstate_T  *b_sst_array;
   int b_sst_len;
   synstate_T  *b_sst_first;
   synstate_T  *b_sst_firstfree;
   int b_sst_freecount;
+  synstate_T  *b_sst_lastfind;
   linenr_T b_sst_check_lnum;
   short_u b_sst_lasttick;       /* last display tick */
+  synstack_T  **b_sst_stacks;
+  int b_sst_stacks_len;
+  int b_sst_stacks_count;
+
+  /*
+   * b_sal_lines[] contains the syntax attributes for the lines from
+   * b_sal_lnum on, computed by syntax_idle() while waiting for a character.
+   * They are valid while b_changedtick, the highlight attributes,
+   * 'iskeyword' and 'synmaxcol' are unchanged, remembered in b_sal_tick,
+   * b_sal_hltick, b_sal_chartick and b_sal_smc.
+   */
+  garray_T b_sal_lines;
+  linenr_T b_sal_lnum;
+  int b_sal_tick;
+  int b_sal_hltick;
+  int b_sal_chartick;
+  long b_sal_smc;
 
   /* for spell checking */
   garray_T b_langp;             /* list of pointers to slang_T, see spell.c */
@@ -1091,6 +1234,20 @@ typedef struct {
 } synblock_T;
 
 
+/*
+ * Lines known not to contain a match for a 'hlsearch' or match pattern, so
+ * that redrawing doesn't need to try matching them again.  See screen.c.
+ */
+typedef struct {
+  regprog_T   *hc_prog;         /* the pattern, holds a reference */
+  int hc_ic;                    /* "rmm_ic" used for matching */
+  int hc_fnum;                  /* buffer number */
+  int hc_changedtick;           /* b_changedtick when last updated */
+  int hc_chartab_tick;          /* chartab_tick when last updated */
+  char_u      *hc_nomatch;      /* one bit per line, set for no match */
+  linenr_T hc_size;             /* nr of bits in hc_nomatch */
+} hlcache_T;
+
 /*
  * buffer: structure that holds information about one file
  *
@@ -1180,6 +1337,9 @@ struct file_buffer {
    */
   char_u b_chartab[32];
 
+  /* Lines without a match for the 'hlsearch' pattern. */
+  hlcache_T b_hlcache;
+
   /* Table used for mappings local to a buffer. */
   mapblock_T  *(b_maphash[256]);
 
@@ -1537,6 +1697,7 @@ typedef struct {
   colnr_T startcol;       /* in win_line() points to char where HL starts */
   colnr_T endcol;        /* in win_line() points to char where HL ends */
   proftime_T tm;        /* for a time limit */
+  hlcache_T   *hc;      /* lines without a match, NULL when not used */
 } match_T;
 
 /*
@@ -1552,6 +1713,7 @@ struct matchitem {
   int hlg_id;               /* highlight group ID */
   regmmatch_T match;        /* regexp program for pattern */
   match_T hl;               /* struct for doing the actual highlighting */
+  hlcache_T hlcache;        /* lines without a match */
 };
 
 /*
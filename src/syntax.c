@@ -57,6 +57,7 @@ static garray_T highlight_ga;   /* highlight groups for 'highlight' option */
 static int include_none = 0;    /* when 1 include "None" */
 static int include_default = 0; /* when 1 include "default" */
 static int include_link = 0;    /* when 2 include "link" and "clear" */
+static int hl_attr_tick = 0;    /* incremented when attributes change */
 
 /*
  * The "term", "cterm" and "gui" arguments can be any combination of the
@@ -125,6 +126,9 @@ typedef struct syn_pattern {
   regprog_T   *sp_prog;                 /* regexp to match, program */
   syn_time_T sp_time;
   int sp_ic;                            /* ignore-case flag for sp_prog */
+  char_u      *sp_must;                 /* text any match must contain, ASCII
+                                           in lower case, or NULL */
+  int sp_mustic;                        /* sp_must is found ignoring case */
   short sp_off_flags;                   /* see below */
   int sp_offsets[SPO_COUNT];            /* offsets */
   short       *sp_cont_list;            /* cont. group IDs, if non-zero */
@@ -156,9 +160,11 @@ typedef struct syn_pattern {
 #define SF_CCOMMENT     0x01    /* sync on a C-style comment */
 #define SF_MATCH        0x02    /* sync by matching a pattern */
 
-#define SYN_STATE_P(ssp)    ((bufstate_T *)((ssp)->ga_data))
+#define SAL_LINES(block)    ((synline_T *)((block)->b_sal_lines.ga_data))
+#define SAL_MAX_LEN     1000    /* longer lines are not done ahead */
 
 #define MAXKEYWLEN      80          /* maximum length of a keyword */
+#define KEYWLEN_BITS    32          /* number of bits in b_keywlens[] items */
 
 /*
  * The attributes of the syntax item that has been recognized.
@@ -330,6 +336,21 @@ static short    *current_next_list = NULL; /* when non-zero, nextgroup list */
 static int current_next_flags = 0;      /* flags for current_next_list */
 static int current_line_id = 0;         /* unique number for current line */
 
+/*
+ * To avoid trying to match every pattern in every line, the bytes and the
+ * pairs of bytes in the current line are noted in syn_line_bytes[] and
+ * syn_line_pairs[], with ASCII letters made lower case.  A pattern that has
+ * text that any match must contain can't match in a line where a byte or a
+ * pair of bytes of that text is missing.  See syn_line_may_match().
+ */
+#define SYN_PAIR_BITS   4096
+#define SYN_PAIR_HASH(c1, c2) \
+  ((((unsigned)(c1) << 6) ^ (unsigned)(c2)) & (SYN_PAIR_BITS - 1))
+static char_u syn_line_bytes[256 / 8];
+static char_u syn_line_pairs[SYN_PAIR_BITS / 8];
+static int syn_line_nonascii;           /* line has a byte >= 0x80 */
+static int syn_line_bytes_id = -1;      /* current_line_id for the above */
+
 #define CUR_STATE(idx)  ((stateitem_T *)(current_state.ga_data))[idx]
 
 static void syn_sync __ARGS((win_T *wp, linenr_T lnum, synstate_T *last_valid));
@@ -338,7 +359,14 @@ static void syn_start_line __ARGS((void));
 static void syn_update_ends __ARGS((int startofline));
 static void syn_stack_alloc __ARGS((void));
 static int syn_stack_cleanup __ARGS((void));
+static void syn_lines_clear __ARGS((synblock_T *block));
+static int syn_lines_valid __ARGS((synblock_T *block, buf_T *buf));
+static int syn_has_posdep __ARGS((synblock_T *block));
 static void syn_stack_free_entry __ARGS((synblock_T *block, synstate_T *p));
+static void syn_stack_free_below __ARGS((synblock_T *block, linenr_T lnum));
+static unsigned syn_stack_hash __ARGS((void));
+static synstack_T *syn_stack_intern __ARGS((synblock_T *block));
+static void syn_stack_unref __ARGS((synblock_T *block, synstack_T *ss));
 static synstate_T *syn_stack_find_entry __ARGS((linenr_T lnum));
 static synstate_T *store_current_state __ARGS((void));
 static void load_current_state __ARGS((synstate_T *from));
@@ -358,6 +386,10 @@ static short *copy_id_list __ARGS((short *list));
 static int in_id_list __ARGS((stateitem_T *item, short *cont_list,
                               struct sp_syn *ssp,
                               int contained));
+static char_u *syn_id_list_bits __ARGS((short *list, int *lenp));
+static int syn_add_id_bits __ARGS((char_u *bits, int len, short *list,
+                                   int depth));
+static void syn_clear_idsets __ARGS((synblock_T *block));
 static int push_current_state __ARGS((int idx));
 static void pop_current_state __ARGS((void));
 static void syn_clear_time __ARGS((syn_time_T *tt));
@@ -367,12 +399,17 @@ static void syntime_report __ARGS((void));
 static int syn_time_on = FALSE;
 # define IF_SYN_TIME(p) (p)
 
+static proftime_T *syn_tm;              /* time limit for matching or NULL */
+static int syn_idle = FALSE;            /* TRUE while in syntax_idle() */
+static linenr_T syn_idle_timeout = 0;   /* line where syntax_idle() ran out
+                                           of time, zero when it didn't */
+
 static void syn_stack_apply_changes_block __ARGS((synblock_T *block, buf_T *buf));
 static void find_endpos __ARGS((int idx, lpos_T *startpos, lpos_T *m_endpos,
                                 lpos_T *hl_endpos, long *flagsp, lpos_T *
                                 end_endpos, int *end_idx,
                                 reg_extmatch_T *start_ext));
-static void clear_syn_state __ARGS((synstate_T *p));
+static void clear_syn_state __ARGS((synblock_T *block, synstate_T *p));
 static void clear_current_state __ARGS((void));
 
 static void limit_pos __ARGS((lpos_T *pos, lpos_T *limit));
@@ -386,6 +423,7 @@ static void syn_add_start_off __ARGS((lpos_T *result, regmmatch_T *regmatch,
 static char_u *syn_getcurline __ARGS((void));
 static int syn_regexec __ARGS((regmmatch_T *rmp, linenr_T lnum, colnr_T col,
                                syn_time_T *st));
+static int syn_line_may_match __ARGS((synpat_T *spp));
 static int check_keyword_id __ARGS((char_u *line, int startcol, int *endcol,
                                     long *flags, short **next_list,
                                     stateitem_T *cur_si,
@@ -416,6 +454,7 @@ static void put_pattern __ARGS((char *s, int c, synpat_T *spp, int attr));
 static int syn_list_keywords __ARGS((int id, hashtab_T *ht, int did_header,
                                      int attr));
 static void syn_clear_keyword __ARGS((int id, hashtab_T *ht));
+static void syn_make_keywlens __ARGS((synblock_T *block));
 static void clear_keywtab __ARGS((hashtab_T *ht));
 static void add_keyword __ARGS((char_u *name, int id, int flags,
                                 short *cont_in_list, short *next_list,
@@ -441,6 +480,16 @@ static void syn_combine_list __ARGS((short **clstr1, short **clstr2,
                                      int list_op));
 static void syn_incl_toplevel __ARGS((int id, int *flagsp));
 
+/*
+ * Set the time limit for matching syntax patterns, NULL for no limit.  When
+ * it is passed syntax highlighting is disabled for the buffer until the
+ * screen is cleared.
+ */
+void syn_set_timeout(proftime_T *tm)
+{
+  syn_tm = tm;
+}
+
 /*
  * Start the syntax recognition for a line.  This function is normally called
  * from the screen updating, once for each displayed line.
@@ -605,25 +654,185 @@ void syntax_start(win_T *wp, linenr_T lnum)
 }
 
 /*
- * We cannot simply discard growarrays full of state_items or buf_states; we
- * have to manually release their extmatch pointers first.
+ * Called when waiting for the user to type a character.  Computes the syntax
+ * attributes of the lines below the current window and keeps them in
+ * b_sal_lines[], so that scrolling forward doesn't have to parse the lines.
+ * When "typeahead" is TRUE returns as soon as a character is available, what
+ * was done is kept.
  */
-static void clear_syn_state(synstate_T *p)
+void syntax_idle(int typeahead)
 {
-  int i;
-  garray_T    *gap;
+  win_T       *wp = curwin;
+  buf_T       *buf = wp->w_buffer;
+  synblock_T  *block = wp->w_s;
+  garray_T    *gap = &block->b_sal_lines;
+  synline_T   *sl;
+  linenr_T lnum;
+  linenr_T last;
+  colnr_T col;
+  int len;
+  int n;
+  int save_did_emsg;
+  proftime_T tm;
 
-  if (p->sst_stacksize > SST_FIX_STATES) {
-    gap = &(p->sst_union.sst_ga);
-    for (i = 0; i < gap->ga_len; i++)
-      unref_extmatch(SYN_STATE_P(gap)[i].bs_extmatch);
-    ga_clear(gap);
-  } else   {
-    for (i = 0; i < p->sst_stacksize; i++)
-      unref_extmatch(p->sst_union.sst_stack[i].bs_extmatch);
+  /* The attributes can't be used with conceal and spell checking.  They
+   * would be wrong when a pattern uses the cursor position. */
+  if (!syntax_present(wp) || block->b_syn_error || block->b_syn_slow
+      || must_redraw != 0 || (wp->w_valid & VALID_BOTLINE) == 0
+      || wp->w_p_cole > 0 || wp->w_p_spell || syn_has_posdep(block))
+    return;
+
+  lnum = wp->w_botline;
+  last = wp->w_botline + wp->w_height - 1;
+  if (last > buf->b_ml.ml_line_count)
+    last = buf->b_ml.ml_line_count;
+  if (lnum > last)
+    return;
+
+  if (!syn_lines_valid(block, buf) || lnum < block->b_sal_lnum
+      || lnum > block->b_sal_lnum + gap->ga_len) {
+    syn_lines_clear(block);
+    block->b_sal_lnum = lnum;
+    block->b_sal_tick = buf->b_changedtick;
+    block->b_sal_hltick = hl_attr_tick;
+    block->b_sal_chartick = chartab_tick;
+    block->b_sal_smc = buf->b_p_smc;
+  } else {
+    /* Drop the lines above the window, continue after the last line. */
+    n = wp->w_topline - block->b_sal_lnum;
+    if (n > 0) {
+      if (n > gap->ga_len)
+        n = gap->ga_len;
+      sl = SAL_LINES(block);
+      for (len = 0; len < n; ++len)
+        vim_free(sl[len].sl_attrs);
+      mch_memmove(sl, sl + n, (size_t)(gap->ga_len - n) * sizeof(synline_T));
+      gap->ga_len -= n;
+      block->b_sal_lnum += n;
+    }
+    lnum = block->b_sal_lnum + gap->ga_len;
+  }
+
+  /* Like the screen updating, the pass gets 'redrawtime' in total.  When
+   * it runs out syn_regexec() only sets syn_idle_timeout. */
+  profile_setlimit(p_rdt, &tm);
+  syn_set_timeout(&tm);
+  syn_idle = TRUE;
+  syn_idle_timeout = 0;
+
+  for (; lnum <= last && !(typeahead && ui_char_avail()); ++lnum) {
+    if (profile_passed_limit(&tm))
+      break;
+    len = (int)STRLEN(ml_get_buf(buf, lnum, FALSE));
+    if (len > SAL_MAX_LEN || ga_grow(gap, 1) == FAIL)
+      break;
+    sl = SAL_LINES(block) + gap->ga_len;
+    sl->sl_len = len + 1;
+    sl->sl_attrs = (int *)alloc((unsigned)(sl->sl_len * sizeof(int)));
+    if (sl->sl_attrs == NULL)
+      break;
+
+    /* Get the attributes like win_line() does. */
+    save_did_emsg = did_emsg;
+    did_emsg = FALSE;
+    syntax_start(wp, lnum);
+    for (col = 0; col <= len && !did_emsg; ++col)
+      sl->sl_attrs[col] = get_syntax_attr(col, NULL, FALSE);
+    if (did_emsg || got_int || syn_idle_timeout != 0) {
+      if (did_emsg)
+        block->b_syn_error = TRUE;
+      else
+        did_emsg = save_did_emsg;
+      vim_free(sl->sl_attrs);
+      break;
+    }
+    did_emsg = save_did_emsg;
+    ++gap->ga_len;
+  }
+
+  syn_set_timeout(NULL);
+  syn_idle = FALSE;
+
+  /* A pattern that ran out of time didn't match, thus the states stored
+   * from that line on may be wrong.  Drop them, win_line() parses the lines
+   * again and decides whether highlighting is too slow. */
+  if (syn_idle_timeout != 0) {
+    invalidate_current_state();
+    syn_stack_free_below(block, syn_idle_timeout);
   }
 }
 
+/*
+ * Return the syntax attributes for line "lnum" in window "wp", computed by
+ * syntax_idle(), and set "*lenp" to their number.
+ * Returns NULL when they are not available or not valid.
+ */
+int *syntax_line_attrs(win_T *wp, linenr_T lnum, int *lenp)
+{
+  synblock_T  *block = wp->w_s;
+  synline_T   *sl;
+
+  if (lnum < block->b_sal_lnum
+      || lnum >= block->b_sal_lnum + block->b_sal_lines.ga_len
+      || !syn_lines_valid(block, wp->w_buffer))
+    return NULL;
+  sl = SAL_LINES(block) + (lnum - block->b_sal_lnum);
+  *lenp = sl->sl_len;
+  return sl->sl_attrs;
+}
+
+/*
+ * Free the syntax attributes computed by syntax_idle().
+ */
+static void syn_lines_clear(synblock_T *block)
+{
+  int i;
+
+  for (i = 0; i < block->b_sal_lines.ga_len; ++i)
+    vim_free(SAL_LINES(block)[i].sl_attrs);
+  ga_clear(&block->b_sal_lines);
+  ga_init2(&block->b_sal_lines, (int)sizeof(synline_T), 20);
+}
+
+/*
+ * Return TRUE when the attributes in b_sal_lines[] are still valid for
+ * buffer "buf".
+ */
+static int syn_lines_valid(synblock_T *block, buf_T *buf)
+{
+  return block->b_sal_tick == buf->b_changedtick
+         && block->b_sal_hltick == hl_attr_tick
+         && block->b_sal_chartick == chartab_tick
+         && block->b_sal_smc == buf->b_p_smc;
+}
+
+/*
+ * Return TRUE when a syntax pattern of "block" depends on more than the
+ * text, e.g. the cursor position.
+ */
+static int syn_has_posdep(synblock_T *block)
+{
+  int i;
+
+  for (i = 0; i < block->b_syn_patterns.ga_len; ++i)
+    if (SYN_ITEMS(block)[i].sp_prog != NULL
+        && re_posdep(SYN_ITEMS(block)[i].sp_prog))
+      return TRUE;
+  return FALSE;
+}
+
+/*
+ * Release the state stack of syn_state "p" in "block".  The stack is shared,
+ * it is only freed when no other entry uses it.
+ */
+static void clear_syn_state(synblock_T *block, synstate_T *p)
+{
+  if (p->sst_stack != NULL)
+    syn_stack_unref(block, p->sst_stack);
+  p->sst_stack = NULL;
+  p->sst_stacksize = 0;
+}
+
 /*
  * Cleanup the current_state stack.
  */
@@ -1021,10 +1230,16 @@ static void syn_update_ends(int startofline)
  * lines are likely to be displayed again, in which case the state at the
  * start of the line is needed.
  * For not displayed lines, an entry is stored for every so many lines.  These
- * entries will be used e.g., when scrolling backwards.  The distance between
- * entries depends on the number of lines in the buffer.  For small buffers
- * the distance is fixed at SST_DIST, for large buffers there is a fixed
+ * entries will be used e.g., when scrolling backwards or jumping to a line
+ * that was parsed before.  The distance between entries is SST_DIST, unless
+ * the array would use more than SST_MAX_MEM bytes, then there is a fixed
  * number of entries SST_MAX_ENTRIES, and the distance is computed.
+ *
+ * The state stacks themselves are not stored in the entries.  Most entries
+ * have the same stack as the entry before it (e.g., the lines inside a long
+ * comment or a function body), therefore each different stack is stored only
+ * once in the hash table b_sst_stacks[] and shared by reference counting.
+ * This keeps the entries small, so that a lot of them fit in SST_MAX_MEM.
  */
 
 static void syn_stack_free_block(synblock_T *block)
@@ -1033,11 +1248,17 @@ static void syn_stack_free_block(synblock_T *block)
 
   if (block->b_sst_array != NULL) {
     for (p = block->b_sst_first; p != NULL; p = p->sst_next)
-      clear_syn_state(p);
+      clear_syn_state(block, p);
     vim_free(block->b_sst_array);
     block->b_sst_array = NULL;
     block->b_sst_len = 0;
+    block->b_sst_lastfind = NULL;
   }
+  vim_free(block->b_sst_stacks);
+  block->b_sst_stacks = NULL;
+  block->b_sst_stacks_len = 0;
+  block->b_sst_stacks_count = 0;
+  syn_lines_clear(block);
 }
 /*
  * Free b_sst_array[] for buffer "buf".
@@ -1125,6 +1346,7 @@ static void syn_stack_alloc(void)                 {
     vim_free(syn_block->b_sst_array);
     syn_block->b_sst_array = sstp;
     syn_block->b_sst_len = len;
+    syn_block->b_sst_lastfind = NULL;
   }
 }
 
@@ -1252,30 +1474,184 @@ static int syn_stack_cleanup(void)                {
  */
 static void syn_stack_free_entry(synblock_T *block, synstate_T *p)
 {
-  clear_syn_state(p);
+  clear_syn_state(block, p);
+  if (block->b_sst_lastfind == p)
+    block->b_sst_lastfind = NULL;
   p->sst_next = block->b_sst_firstfree;
   block->b_sst_firstfree = p;
   ++block->b_sst_freecount;
 }
 
+/*
+ * Free the entries in the state stack of "block" for lines below "lnum".
+ */
+static void syn_stack_free_below(synblock_T *block, linenr_T lnum)
+{
+  synstate_T  *p, *prev, *np;
+
+  prev = NULL;
+  for (p = block->b_sst_first; p != NULL && p->sst_lnum <= lnum;
+       p = p->sst_next)
+    prev = p;
+  if (prev == NULL)
+    block->b_sst_first = NULL;
+  else
+    prev->sst_next = NULL;
+  for (; p != NULL; p = np) {
+    np = p->sst_next;
+    syn_stack_free_entry(block, p);
+  }
+}
+
 /*
  * Find an entry in the list of state stacks at or before "lnum".
  * Returns NULL when there is no entry or the first entry is after "lnum".
+ * Lines are mostly parsed from top to bottom, thus the search starts at the
+ * entry found the previous time when it is not after "lnum".
  */
 static synstate_T *syn_stack_find_entry(linenr_T lnum)
 {
   synstate_T  *p, *prev;
 
-  prev = NULL;
-  for (p = syn_block->b_sst_first; p != NULL; prev = p, p = p->sst_next) {
-    if (p->sst_lnum == lnum)
-      return p;
+  prev = syn_block->b_sst_lastfind;
+  if (prev != NULL && prev->sst_lnum <= lnum)
+    p = prev;
+  else {
+    prev = NULL;
+    p = syn_block->b_sst_first;
+  }
+  for (; p != NULL; prev = p, p = p->sst_next) {
+    if (p->sst_lnum == lnum) {
+      prev = p;
+      break;
+    }
     if (p->sst_lnum > lnum)
       break;
   }
+  syn_block->b_sst_lastfind = prev;
   return prev;
 }
 
+/*
+ * Return the hash value for the state stack in current_state.
+ */
+static unsigned syn_stack_hash(void)
+{
+  unsigned hash = (unsigned)current_state.ga_len;
+  stateitem_T *sip;
+  int i;
+
+  for (i = 0; i < current_state.ga_len; ++i) {
+    sip = &CUR_STATE(i);
+    hash = hash * 31 + (unsigned)sip->si_idx;
+    hash = hash * 31 + (unsigned)sip->si_flags;
+    hash = hash * 31 + (unsigned)sip->si_seqnr;
+    hash = hash * 31 + (unsigned)sip->si_cchar;
+    hash = hash * 31 + (unsigned)((long_u)sip->si_extmatch >> 4);
+  }
+  return hash;
+}
+
+/*
+ * Find the stack equal to current_state in the hash table of "block", add it
+ * when it is not there yet.  Returns the stack with its reference count
+ * incremented, NULL when out of memory.
+ */
+static synstack_T *syn_stack_intern(synblock_T *block)
+{
+  unsigned hash = syn_stack_hash();
+  synstack_T  *ss;
+  synstack_T  **table;
+  synstack_T  *next;
+  bufstate_T  *bp;
+  int len;
+  int i;
+
+  if (block->b_sst_stacks != NULL)
+    for (ss = block->b_sst_stacks[hash & (block->b_sst_stacks_len - 1)];
+         ss != NULL; ss = ss->ss_next) {
+      if (ss->ss_hash != hash || ss->ss_len != current_state.ga_len)
+        continue;
+      for (i = 0; i < ss->ss_len; ++i) {
+        bp = &ss->ss_states[i];
+        if (bp->bs_idx != CUR_STATE(i).si_idx
+            || bp->bs_flags != CUR_STATE(i).si_flags
+            || bp->bs_seqnr != CUR_STATE(i).si_seqnr
+            || bp->bs_cchar != CUR_STATE(i).si_cchar
+            || bp->bs_extmatch != CUR_STATE(i).si_extmatch)
+          break;
+      }
+      if (i == ss->ss_len) {
+        ++ss->ss_refcount;
+        return ss;
+      }
+    }
+
+  /* Grow the hash table when it gets full, also when it doesn't exist
+   * yet. */
+  if (block->b_sst_stacks_count >= block->b_sst_stacks_len) {
+    len = block->b_sst_stacks_len == 0 ? SST_MIN_STACKS
+          : block->b_sst_stacks_len * 2;
+    table = (synstack_T **)alloc_clear((unsigned)(len * sizeof(synstack_T *)));
+    if (table == NULL)
+      return NULL;
+    for (i = 0; i < block->b_sst_stacks_len; ++i)
+      for (ss = block->b_sst_stacks[i]; ss != NULL; ss = next) {
+        next = ss->ss_next;
+        ss->ss_next = table[ss->ss_hash & (len - 1)];
+        table[ss->ss_hash & (len - 1)] = ss;
+      }
+    vim_free(block->b_sst_stacks);
+    block->b_sst_stacks = table;
+    block->b_sst_stacks_len = len;
+  }
+
+  ss = (synstack_T *)alloc((unsigned)(sizeof(synstack_T)
+                                      + (current_state.ga_len - 1)
+                                      * sizeof(bufstate_T)));
+  if (ss == NULL)
+    return NULL;
+  ss->ss_hash = hash;
+  ss->ss_refcount = 1;
+  ss->ss_len = current_state.ga_len;
+  for (i = 0; i < ss->ss_len; ++i) {
+    bp = &ss->ss_states[i];
+    bp->bs_idx = CUR_STATE(i).si_idx;
+    bp->bs_flags = CUR_STATE(i).si_flags;
+    bp->bs_seqnr = CUR_STATE(i).si_seqnr;
+    bp->bs_cchar = CUR_STATE(i).si_cchar;
+    bp->bs_extmatch = ref_extmatch(CUR_STATE(i).si_extmatch);
+  }
+  table = &block->b_sst_stacks[hash & (block->b_sst_stacks_len - 1)];
+  ss->ss_next = *table;
+  *table = ss;
+  ++block->b_sst_stacks_count;
+  return ss;
+}
+
+/*
+ * Decrement the reference count of state stack "ss" in "block".  Remove it
+ * from the hash table and free it when it is no longer used.
+ */
+static void syn_stack_unref(synblock_T *block, synstack_T *ss)
+{
+  synstack_T  **pp;
+  int i;
+
+  if (--ss->ss_refcount > 0)
+    return;
+  for (pp = &block->b_sst_stacks[ss->ss_hash & (block->b_sst_stacks_len - 1)];
+       *pp != NULL; pp = &(*pp)->ss_next)
+    if (*pp == ss) {
+      *pp = ss->ss_next;
+      break;
+    }
+  --block->b_sst_stacks_count;
+  for (i = 0; i < ss->ss_len; ++i)
+    unref_extmatch(ss->ss_states[i].bs_extmatch);
+  vim_free(ss);
+}
+
 /*
  * Try saving the current state in b_sst_array[].
  * The current state must be valid for the start of the current_lnum line!
@@ -1283,7 +1659,6 @@ static synstate_T *syn_stack_find_entry(linenr_T lnum)
 static synstate_T *store_current_state(void)                         {
   int i;
   synstate_T  *p;
-  bufstate_T  *bp;
   stateitem_T *cur_si;
   synstate_T  *sp = syn_stack_find_entry(current_lnum);
 
@@ -1352,25 +1727,11 @@ static synstate_T *store_current_state(void)                         {
   }
   if (sp != NULL) {
     /* When overwriting an existing state stack, clear it first */
-    clear_syn_state(sp);
-    sp->sst_stacksize = current_state.ga_len;
-    if (current_state.ga_len > SST_FIX_STATES) {
-      /* Need to clear it, might be something remaining from when the
-       * length was less than SST_FIX_STATES. */
-      ga_init2(&sp->sst_union.sst_ga, (int)sizeof(bufstate_T), 1);
-      if (ga_grow(&sp->sst_union.sst_ga, current_state.ga_len) == FAIL)
-        sp->sst_stacksize = 0;
-      else
-        sp->sst_union.sst_ga.ga_len = current_state.ga_len;
-      bp = SYN_STATE_P(&(sp->sst_union.sst_ga));
-    } else
-      bp = sp->sst_union.sst_stack;
-    for (i = 0; i < sp->sst_stacksize; ++i) {
-      bp[i].bs_idx = CUR_STATE(i).si_idx;
-      bp[i].bs_flags = CUR_STATE(i).si_flags;
-      bp[i].bs_seqnr = CUR_STATE(i).si_seqnr;
-      bp[i].bs_cchar = CUR_STATE(i).si_cchar;
-      bp[i].bs_extmatch = ref_extmatch(CUR_STATE(i).si_extmatch);
+    clear_syn_state(syn_block, sp);
+    if (current_state.ga_len > 0) {
+      sp->sst_stack = syn_stack_intern(syn_block);
+      if (sp->sst_stack != NULL)
+        sp->sst_stacksize = current_state.ga_len;
     }
     sp->sst_next_flags = current_next_flags;
     sp->sst_next_list = current_next_list;
@@ -1394,10 +1755,7 @@ static void load_current_state(synstate_T *from)
   keepend_level = -1;
   if (from->sst_stacksize
       && ga_grow(&current_state, from->sst_stacksize) != FAIL) {
-    if (from->sst_stacksize > SST_FIX_STATES)
-      bp = SYN_STATE_P(&(from->sst_union.sst_ga));
-    else
-      bp = from->sst_union.sst_stack;
+    bp = from->sst_stack->ss_states;
     for (i = 0; i < from->sst_stacksize; ++i) {
       CUR_STATE(i).si_idx = bp[i].bs_idx;
       CUR_STATE(i).si_flags = bp[i].bs_flags;
@@ -1436,10 +1794,9 @@ static int syn_stack_equal(synstate_T *sp)
   if (sp->sst_stacksize == current_state.ga_len
       && sp->sst_next_list == current_next_list) {
     /* Need to compare all states on both stacks. */
-    if (sp->sst_stacksize > SST_FIX_STATES)
-      bp = SYN_STATE_P(&(sp->sst_union.sst_ga));
-    else
-      bp = sp->sst_union.sst_stack;
+    if (sp->sst_stacksize == 0)
+      return TRUE;
+    bp = sp->sst_stack->ss_states;
 
     for (i = current_state.ga_len; --i >= 0; ) {
       /* If the item has another index the state is different. */
@@ -1866,6 +2223,14 @@ syn_current_attr (
               if (spp->sp_line_id == current_line_id
                   && spp->sp_startcol >= next_match_col)
                 continue;
+              /* When trying this item the first time in this line, quickly
+               * check that it may match somewhere in the line. */
+              if (spp->sp_line_id != current_line_id
+                  && !syn_line_may_match(spp)) {
+                spp->sp_line_id = current_line_id;
+                spp->sp_startcol = MAXCOL;
+                continue;
+              }
               spp->sp_line_id = current_line_id;
 
               lc_col = current_col - spp->sp_offsets[SPO_LC_OFF];
@@ -2915,13 +3280,25 @@ static char_u *syn_getcurline(void)                     {
 static int syn_regexec(regmmatch_T *rmp, linenr_T lnum, colnr_T col, syn_time_T *st)
 {
   int r;
+  int timed_out = FALSE;
   proftime_T pt;
 
   if (syn_time_on)
     profile_start(&pt);
 
   rmp->rmm_maxcol = syn_buf->b_p_smc;
-  r = vim_regexec_multi(rmp, syn_win, syn_buf, lnum, col, NULL);
+  r = vim_regexec_multi(rmp, syn_win, syn_buf, lnum, col, syn_tm, &timed_out);
+  if (timed_out) {
+    /* Nobody is waiting for syntax_idle(), don't disable highlighting for
+     * it. */
+    if (syn_idle) {
+      if (syn_idle_timeout == 0)
+        syn_idle_timeout = current_lnum;
+    } else if (!syn_win->w_s->b_syn_slow) {
+      syn_win->w_s->b_syn_slow = TRUE;
+      MSG(_("'redrawtime' exceeded, syntax highlighting disabled"));
+    }
+  }
 
   if (syn_time_on) {
     profile_end(&pt);
@@ -2941,6 +3318,57 @@ static int syn_regexec(regmmatch_T *rmp, linenr_T lnum, colnr_T col, syn_time_T
   return FALSE;
 }
 
+/*
+ * Return FALSE when pattern "spp" can't match anywhere in the current line,
+ * because a byte or a pair of bytes of the text that any match must contain
+ * is not in the line.  Return TRUE when it may match.
+ */
+static int syn_line_may_match(synpat_T *spp)
+{
+  char_u      *p;
+  int c;
+  int prev;
+
+  if (spp->sp_must == NULL)
+    return TRUE;
+
+  /* Note the bytes in the line, once for every line. */
+  if (syn_line_bytes_id != current_line_id) {
+    syn_line_bytes_id = current_line_id;
+    vim_memset(syn_line_bytes, 0, sizeof(syn_line_bytes));
+    vim_memset(syn_line_pairs, 0, sizeof(syn_line_pairs));
+    syn_line_nonascii = FALSE;
+    prev = NUL;
+    for (p = syn_getcurline(); *p != NUL; ++p) {
+      c = TOLOWER_ASC(*p);
+      if (c >= 0x80)
+        syn_line_nonascii = TRUE;
+      syn_line_bytes[c >> 3] |= 1 << (c & 7);
+      if (prev != NUL)
+        syn_line_pairs[SYN_PAIR_HASH(prev, c) >> 3] |=
+          1 << (SYN_PAIR_HASH(prev, c) & 7);
+      prev = c;
+    }
+  }
+
+  /* When ignoring case a multi-byte character may match an ASCII letter,
+   * e.g. the Kelvin sign matches "k". */
+  if (spp->sp_mustic && syn_line_nonascii)
+    return TRUE;
+
+  prev = NUL;
+  for (p = spp->sp_must; *p != NUL; ++p) {
+    c = *p;
+    if (!(syn_line_bytes[c >> 3] & (1 << (c & 7))))
+      return FALSE;
+    if (prev != NUL && !(syn_line_pairs[SYN_PAIR_HASH(prev, c) >> 3]
+                         & (1 << (SYN_PAIR_HASH(prev, c) & 7))))
+      return FALSE;
+    prev = c;
+  }
+  return TRUE;
+}
+
 /*
  * Check one position in a line for a matching keyword.
  * The caller must check if a keyword can start at startcol.
@@ -2961,6 +3389,8 @@ check_keyword_id (
   char_u      *kwp;
   int round;
   int kwlen;
+  int len;
+  unsigned lenbit;
   char_u keyword[MAXKEYWLEN + 1];        /* assume max. keyword len is 80 */
   hashtab_T   *ht;
   hashitem_T  *hi;
@@ -2979,11 +3409,8 @@ check_keyword_id (
   if (kwlen > MAXKEYWLEN)
     return 0;
 
-  /*
-   * Must make a copy of the keyword, so we can add a NUL and make it
-   * lowercase.
-   */
-  vim_strncpy(keyword, kwp, kwlen);
+  if (syn_block->b_keywlens == NULL)
+    syn_make_keywlens(syn_block);
 
   /*
    * Try twice:
@@ -2994,8 +3421,26 @@ check_keyword_id (
     ht = round == 1 ? &syn_block->b_keywtab : &syn_block->b_keywtab_ic;
     if (ht->ht_used == 0)
       continue;
-    if (round == 2)     /* ignore case */
+
+    /*
+     * Must make a copy of the keyword, so we can add a NUL and make it
+     * lowercase.  Folding case is done like for the keywords in
+     * b_keywtab_ic, the length may change.
+     */
+    if (round == 1) {
+      vim_strncpy(keyword, kwp, kwlen);
+      lenbit = kwlen < KEYWLEN_BITS ? (unsigned)1 << kwlen : 1;
+    } else {    /* ignore case */
       (void)str_foldcase(kwp, kwlen, keyword, MAXKEYWLEN + 1);
+      len = (int)STRLEN(keyword);
+      lenbit = len < KEYWLEN_BITS ? (unsigned)1 << len : 1;
+    }
+
+    /* Skip the lookup when no keyword starts with this byte and has this
+     * length. */
+    if (syn_block->b_keywlens != NULL
+        && !(syn_block->b_keywlens[(round - 1) * 256 + *keyword] & lenbit))
+      continue;
 
     /*
      * Find keywords that match.  There can be several with different
@@ -3024,6 +3469,42 @@ check_keyword_id (
   return 0;
 }
 
+/*
+ * Make b_keywlens[] for "block": for each first byte of the keywords a bit for
+ * each length of the keywords starting with it.  The first 256 entries are
+ * for b_keywtab, the next 256 for b_keywtab_ic.  Bit 0 is used for lengths
+ * of KEYWLEN_BITS and more.  This allows check_keyword_id() to skip most
+ * words without looking them up.  It is freed when keywords are added or
+ * removed and made again when a keyword is looked up.
+ */
+static void syn_make_keywlens(synblock_T *block)
+{
+  unsigned    *lens;
+  hashtab_T   *ht;
+  hashitem_T  *hi;
+  keyentry_T  *kp;
+  int round;
+  int todo;
+  size_t len;
+
+  lens = (unsigned *)alloc_clear((unsigned)(512 * sizeof(unsigned)));
+  if (lens == NULL)
+    return;
+  for (round = 0; round <= 1; ++round) {
+    ht = round == 0 ? &block->b_keywtab : &block->b_keywtab_ic;
+    todo = (int)ht->ht_used;
+    for (hi = ht->ht_array; todo > 0; ++hi)
+      if (!HASHITEM_EMPTY(hi)) {
+        --todo;
+        kp = HI2KE(hi);
+        len = STRLEN(kp->keyword);
+        lens[round * 256 + kp->keyword[0]] |=
+          len < KEYWLEN_BITS ? (unsigned)1 << len : 1;
+      }
+  }
+  block->b_keywlens = lens;
+}
+
 /*
  * Handle ":syntax conceal" command.
  */
@@ -3097,6 +3578,7 @@ void syntax_clear(synblock_T *block)
   int i;
 
   block->b_syn_error = FALSE;       /* clear previous error */
+  block->b_syn_slow = FALSE;        /* clear previous timeout */
   block->b_syn_ic = FALSE;          /* Use case, by default */
   block->b_syn_spell = SYNSPL_DEFAULT;   /* default spell checking */
   block->b_syn_containedin = FALSE;
@@ -3104,6 +3586,9 @@ void syntax_clear(synblock_T *block)
   /* free the keywords */
   clear_keywtab(&block->b_keywtab);
   clear_keywtab(&block->b_keywtab_ic);
+  vim_free(block->b_keywlens);
+  block->b_keywlens = NULL;
+  syn_clear_idsets(block);
 
   /* free the syntax patterns */
   for (i = block->b_syn_patterns.ga_len; --i >= 0; )
@@ -3196,6 +3681,7 @@ static void syn_clear_pattern(synblock_T *block, int i)
 {
   vim_free(SYN_ITEMS(block)[i].sp_pattern);
   vim_regfree(SYN_ITEMS(block)[i].sp_prog);
+  vim_free(SYN_ITEMS(block)[i].sp_must);
   /* Only free sp_cont_list and sp_next_list of first start pattern */
   if (i == 0 || SYN_ITEMS(block)[i - 1].sp_type != SPTYPE_START) {
     vim_free(SYN_ITEMS(block)[i].sp_cont_list);
@@ -3297,6 +3783,8 @@ static void syn_clear_one(int id, int syncing)
   if (!syncing) {
     (void)syn_clear_keyword(id, &curwin->w_s->b_keywtab);
     (void)syn_clear_keyword(id, &curwin->w_s->b_keywtab_ic);
+    vim_free(curwin->w_s->b_keywlens);
+    curwin->w_s->b_keywlens = NULL;
   }
 
   /* clear the patterns for "id" */
@@ -3924,6 +4412,8 @@ add_keyword (
     kp->ke_next = HI2KE(hi);
     hi->hi_key = KE2HIKEY(kp);
   }
+  vim_free(curwin->w_s->b_keywlens);
+  curwin->w_s->b_keywlens = NULL;
 }
 
 /*
@@ -4395,6 +4885,7 @@ syn_cmd_match (
    */
   vim_regfree(item.sp_prog);
   vim_free(item.sp_pattern);
+  vim_free(item.sp_must);
   vim_free(syn_opt_arg.cont_list);
   vim_free(syn_opt_arg.cont_in_list);
   vim_free(syn_opt_arg.next_list);
@@ -4626,6 +5117,7 @@ syn_cmd_region (
       if (!success) {
         vim_regfree(ppp->pp_synp->sp_prog);
         vim_free(ppp->pp_synp->sp_pattern);
+        vim_free(ppp->pp_synp->sp_must);
       }
       vim_free(ppp->pp_synp);
       ppp_next = ppp->pp_next;
@@ -4960,6 +5452,9 @@ static char_u *get_syn_pattern(char_u *arg, synpat_T *ci)
   int         *p;
   int idx;
   char_u      *cpo_save;
+  char_u      *must;
+  char_u      *s;
+  int mustlen;
 
   /* need at least three chars */
   if (arg == NULL || arg[1] == NUL || arg[2] == NUL)
@@ -4985,6 +5480,15 @@ static char_u *get_syn_pattern(char_u *arg, synpat_T *ci)
   ci->sp_ic = curwin->w_s->b_syn_ic;
   syn_clear_time(&ci->sp_time);
 
+  /* Remember the text that any match must contain, to quickly skip lines
+   * that don't have it. */
+  ci->sp_mustic = ci->sp_ic;
+  must = vim_regmust(ci->sp_prog, &ci->sp_mustic, &mustlen);
+  if (must != NULL
+      && (ci->sp_must = vim_strnsave(must, mustlen)) != NULL)
+    for (s = ci->sp_must; *s != NUL; ++s)
+      *s = TOLOWER_ASC(*s);
+
   /*
    * Check for a match, highlight or region offset.
    */
@@ -5381,6 +5885,8 @@ in_id_list (
   short id = ssp->id;
   static int depth = 0;
   int r;
+  char_u      *bits;
+  int len;
 
   /* If ssp has a "containedin" list and "cur_si" is in it, return TRUE. */
   if (cur_si != NULL && ssp->cont_in_list != NULL
@@ -5433,8 +5939,11 @@ in_id_list (
     retval = TRUE;
 
   /*
-   * Return "retval" if id is in the contains list.
+   * Return "retval" if id is in the contains list.  Use the bitset for the
+   * list when possible, it has the clusters expanded.
    */
+  if (depth == 0 && (bits = syn_id_list_bits(list, &len)) != NULL)
+    return id < len && (bits[id >> 3] & (1 << (id & 7))) ? retval : !retval;
   while (item != 0) {
     if (item == id)
       return retval;
@@ -5455,6 +5964,117 @@ in_id_list (
   return !retval;
 }
 
+/*
+ * Return the bitset with the group IDs in ID list "list" of syn_block, with
+ * the clusters expanded, and its length in bits in "*lenp".  The bitset is
+ * made the first time it is asked for and kept until the syntax items are
+ * changed.
+ * Returns NULL when the list contains a cluster that starts with ALLBUT, TOP
+ * or CONTAINED, or when out of memory.
+ */
+static char_u *syn_id_list_bits(short *list, int *lenp)
+{
+  synidset_T  *table;
+  synidset_T  *isp;
+  synidset_T  *old;
+  int size;
+  int i;
+  unsigned hash;
+
+  /* Grow the hash table when it is half full, also when it doesn't exist
+   * yet. */
+  if (syn_block->b_syn_idsets_used * 2 >= syn_block->b_syn_idsets_size) {
+    size = syn_block->b_syn_idsets_size == 0 ? 64
+           : syn_block->b_syn_idsets_size * 2;
+    table = (synidset_T *)alloc_clear((unsigned)(size * sizeof(synidset_T)));
+    if (table == NULL)
+      return NULL;
+    old = syn_block->b_syn_idsets;
+    for (i = 0; i < syn_block->b_syn_idsets_size; ++i)
+      if (old[i].is_list != NULL) {
+        hash = (unsigned)((long_u)old[i].is_list >> 1);
+        for (isp = &table[hash & (size - 1)]; isp->is_list != NULL; ) {
+          if (++isp == table + size)
+            isp = table;
+        }
+        *isp = old[i];
+      }
+    vim_free(old);
+    syn_block->b_syn_idsets = table;
+    syn_block->b_syn_idsets_size = size;
+  }
+
+  size = syn_block->b_syn_idsets_size;
+  table = syn_block->b_syn_idsets;
+  hash = (unsigned)((long_u)list >> 1);
+  for (isp = &table[hash & (size - 1)]; isp->is_list != NULL; ) {
+    if (isp->is_list == list) {
+      *lenp = isp->is_len;
+      return isp->is_bits;
+    }
+    if (++isp == table + size)
+      isp = table;
+  }
+
+  /* Not found, make the bitset for all existing group IDs. */
+  isp->is_list = list;
+  isp->is_len = highlight_ga.ga_len + 1;
+  isp->is_bits = alloc_clear((unsigned)(isp->is_len + 7) / 8);
+  if (isp->is_bits != NULL
+      && syn_add_id_bits(isp->is_bits, isp->is_len, list, 0) == FAIL) {
+    vim_free(isp->is_bits);
+    isp->is_bits = NULL;
+  }
+  ++syn_block->b_syn_idsets_used;
+  *lenp = isp->is_len;
+  return isp->is_bits;
+}
+
+/*
+ * Set the bits in "bits", which has "len" bits, for the group IDs in "list",
+ * expanding clusters until "depth" is 30, like in_id_list() does.
+ * Returns FAIL when a cluster starts with ALLBUT, TOP or CONTAINED or there
+ * is an ID that doesn't fit.
+ */
+static int syn_add_id_bits(char_u *bits, int len, short *list, int depth)
+{
+  short       *scl_list;
+  short item;
+
+  for (; (item = *list) != 0; ++list) {
+    if (item < SYNID_ALLBUT) {
+      if (item >= len)
+        return FAIL;
+      bits[item >> 3] |= 1 << (item & 7);
+    } else if (item >= SYNID_CLUSTER) {
+      scl_list = SYN_CLSTR(syn_block)[item - SYNID_CLUSTER].scl_list;
+      if (scl_list != NULL && depth < 30) {
+        if (*scl_list >= SYNID_ALLBUT && *scl_list < SYNID_CLUSTER)
+          return FAIL;
+        if (syn_add_id_bits(bits, len, scl_list, depth + 1) == FAIL)
+          return FAIL;
+      }
+    }
+  }
+  return OK;
+}
+
+/*
+ * Free the bitsets for the ID lists of "block".  Must be done when the
+ * syntax items or clusters change, ID lists may be freed then.
+ */
+static void syn_clear_idsets(synblock_T *block)
+{
+  int i;
+
+  for (i = 0; i < block->b_syn_idsets_size; ++i)
+    vim_free(block->b_syn_idsets[i].is_bits);
+  vim_free(block->b_syn_idsets);
+  block->b_syn_idsets = NULL;
+  block->b_syn_idsets_size = 0;
+  block->b_syn_idsets_used = 0;
+}
+
 struct subcommand {
   char    *name;                                /* subcommand name */
   void    (*func)__ARGS((exarg_T *, int));      /* function to call */
@@ -5511,6 +6131,9 @@ void ex_syntax(exarg_T *eap)
       if (STRCMP(subcmd_name, (char_u *)subcommands[i].name) == 0) {
         eap->arg = skipwhite(subcmd_end);
         (subcommands[i].func)(eap, FALSE);
+        /* The items may have changed, the bitsets for the ID lists must
+         * be made again. */
+        syn_clear_idsets(curwin->w_s);
         break;
       }
     }
@@ -6203,6 +6826,8 @@ do_highlight (
 # define is_menu_group 0
 # define is_tooltip_group 0
 
+  ++hl_attr_tick;
+
   /*
    * If no argument, list current highlighting.
    */
@@ -6969,6 +7594,8 @@ void clear_hl_tables(void)          {
   int i;
   attrentry_T *taep;
 
+  ++hl_attr_tick;
+
   for (i = 0; i < term_attr_table.ga_len; ++i) {
     taep = &(((attrentry_T *)term_attr_table.ga_data)[i]);
     vim_free(taep->ae_u.term.start);
@@ -7335,6 +7962,8 @@ set_hl_attr (
   attrentry_T at_en;
   struct hl_group     *sgp = HL_TABLE() + idx;
 
+  ++hl_attr_tick;
+
   /* The "Normal" group doesn't need an attribute number */
   if (sgp->sg_name_u != NULL && STRCMP(sgp->sg_name_u, "NORMAL") == 0)
     return;
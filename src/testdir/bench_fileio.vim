@@ -0,0 +1,64 @@
+" Benchmark for reading and writing big files.
+" Writes a synthetic file of $BENCH_MB Mbyte (default 64) in several formats,
+" then reads and writes it with ":edit" and ":write" and reports the speed in
+" Mbyte per second to bench.out.
+" Run it with "make benchmark".
+
+set nocompatible viminfo= undolevels=-1 noswapfile
+set encoding=utf-8 fileencodings=ucs-bom,utf-8,latin1 fileformats=unix,dos
+
+let s:mb = empty($BENCH_MB) ? 64 : str2nr($BENCH_MB)
+let s:result = []
+
+" Return the number of seconds since "start" as a Float.
+func s:Elapsed(start)
+  return str2float(reltimestr(reltime(a:start)))
+endfunc
+
+" Add a line with the speed of handling "bytes" in "secs" seconds.
+func s:Report(name, bytes, secs)
+  call add(s:result, printf('%-24s %8.1f MB/s', a:name,
+	\ a:secs > 0 ? a:bytes / 1048576.0 / a:secs : 0.0))
+endfunc
+
+" Time reading and writing "lines" with 'fileformat' "ff".
+func s:Bench(name, lines, ff)
+  let fname = 'Xbench'
+  call writefile(a:ff == 'dos' ? map(copy(a:lines), 'v:val . "\r"') : a:lines,
+	\ fname)
+  let bytes = getfsize(fname)
+
+  let start = reltime()
+  exe 'edit! ' . fname
+  call s:Report(a:name . ' read', bytes, s:Elapsed(start))
+
+  let start = reltime()
+  exe 'write! ' . fname . '2'
+  call s:Report(a:name . ' write', bytes, s:Elapsed(start))
+
+  enew!
+  exe 'bwipe! ' . fname
+  call delete(fname)
+  call delete(fname . '2')
+endfunc
+
+" Log-like lines of varying length.
+let s:lines = []
+let s:line = '2024-01-01 12:00:00 INFO request handled in 17 ms id='
+let s:bytes = 0
+let s:i = 0
+while s:bytes < s:mb * 1048576
+  let s:l = s:line . s:i . ' ' . repeat('x', s:i % 80)
+  call add(s:lines, s:l)
+  let s:bytes += len(s:l) + 1
+  let s:i += 1
+endwhile
+
+call s:Bench('unix', s:lines, 'unix')
+call s:Bench('dos', s:lines, 'dos')
+" Every tenth line has a NUL, these need to be translated.
+call s:Bench('nul', map(copy(s:lines), 'v:key % 10 ? v:val : v:val . "\n"'),
+      \ 'unix')
+
+call writefile(s:result, 'bench.out')
+qa!
@@ -0,0 +1,228 @@
+" Benchmark for the regexp engines.
+" Generates $BENCH_LINES lines (default 20000) of C-like code and log text,
+" then runs a list of patterns over them with both the backtracking engine
+" ('regexpengine' 1) and the NFA engine ('regexpengine' 2) and reports the
+" time per byte of text to bench_regexp.out.
+" When bench_regexp.base exists (made with "make benchmark_baseline") every
+" case is compared with it, a case that became more than $BENCH_TOLERANCE
+" times slower (default 1.5) is marked and makes Vim exit with an error.
+" Run it with "make benchmark".
+
+set nocompatible viminfo= undolevels=-1 noswapfile
+set encoding=utf-8 nowrapscan maxmempattern=2000000
+
+let s:nlines = empty($BENCH_LINES) ? 20000 : str2nr($BENCH_LINES)
+let s:tolerance = empty($BENCH_TOLERANCE) ? 1.5 : str2float($BENCH_TOLERANCE)
+let s:result = []
+let s:failed = 0
+
+" Return the number of seconds since "start" as a Float.
+func s:Elapsed(start)
+  return str2float(reltimestr(reltime(a:start)))
+endfunc
+
+" Return the number of bytes in the current buffer.
+func s:Bytes()
+  return line2byte(line('$') + 1) - 1
+endfunc
+
+" C-like code: declarations, calls, comments, strings and numbers.
+func s:CodeLines(n)
+  let types = ['int', 'char', 'long', 'unsigned', 'size_t', 'char_u *']
+  let lines = []
+  let i = 0
+  while i < a:n
+    let t = types[i % len(types)]
+    if i % 7 == 0
+      call add(lines, '/* comment ' . i . ': TODO check the value of var_' . i
+	    \ . ' */')
+    elseif i % 7 == 1
+      call add(lines, '  ' . t . ' var_' . i . ' = 0x' . printf('%x', i * 31)
+	    \ . ';')
+    elseif i % 7 == 2
+      call add(lines, '  if (var_' . i . ' != NULL && len > ' . i . ')')
+    elseif i % 7 == 3
+      call add(lines, '    EMSG2(_("E' . (i % 900) . ': bad \"%s\""), name_'
+	    \ . i . ');')
+    elseif i % 7 == 4
+      call add(lines, '  for (idx = 0; idx < count_' . i . '; ++idx) {')
+    elseif i % 7 == 5
+      call add(lines, '    result = compute_value(buf->b_ml, lnum + ' . i
+	    \ . ', "text");  // done')
+    else
+      call add(lines, '  }')
+    endif
+    let i += 1
+  endwhile
+  return lines
+endfunc
+
+" Log lines with dates, addresses and a varying tail.
+func s:LogLines(n)
+  let levels = ['INFO', 'WARN', 'DEBUG', 'ERROR']
+  let lines = []
+  let i = 0
+  while i < a:n
+    call add(lines, printf('2024-%02d-%02d %02d:%02d:%02d %s 10.%d.%d.%d '
+	  \ . 'user%d GET /path/%d/item?id=%d %s', i % 12 + 1, i % 28 + 1,
+	  \ i % 24, i % 60, i * 7 % 60, levels[i % len(levels)], i % 256,
+	  \ i / 256 % 256, i * 13 % 256, i % 97, i, i * 3,
+	  \ repeat('x', i % 60)))
+    let i += 1
+  endwhile
+  return lines
+endfunc
+
+" Lines that make a backtracking matcher try many alternatives.
+func s:HardLines(n)
+  let lines = []
+  let i = 0
+  while i < a:n
+    call add(lines, repeat('a', 8 + i % 6) . 'c=' . repeat('ab', i % 10) . 'b')
+    let i += 1
+  endwhile
+  return lines
+endfunc
+
+let s:corpus = {
+      \ 'code': s:CodeLines(s:nlines),
+      \ 'log': s:LogLines(s:nlines),
+      \ 'hard': s:HardLines(s:nlines / 100),
+      \ }
+
+" [name, corpus, pattern]
+let s:cases = [
+      \ ['literal', 'log', 'GET /path/17'],
+      \ ['literal ic', 'log', '\cwarn'],
+      \ ['no match', 'log', 'zzqy'],
+      \ ['no match class', 'code', '[#@]\d\+'],
+      \ ['anchored', 'code', '^\s*}'],
+      \ ['date', 'log', '\d\{4}-\d\d-\d\d \d\d:\d\d'],
+      \ ['ip address', 'log', '\<\d\{1,3}\.\d\{1,3}\.\d\{1,3}\.\d\{1,3}\>'],
+      \ ['alternation', 'code', '\<\(int\|char\|long\|unsigned\|size_t\)\>'],
+      \ ['identifier', 'code', '\<\h\w*\>'],
+      \ ['function call', 'code', '\<\h\w*\ze\s*('],
+      \ ['c comment', 'code', '/\*.\{-}\*/'],
+      \ ['c string', 'code', '"\([^"\\]\|\\.\)*"'],
+      \ ['hex number', 'code', '\<0x\x\+\>'],
+      \ ['todo', 'code', '\<\(TODO\|FIXME\|XXX\)\>'],
+      \ ['trailing', 'log', 'x\+$'],
+      \ ['backref', 'log', '\(\w\+\) \1'],
+      \ ['lazy', 'log', 'GET.\{-}id='],
+      \ ['nested plus', 'hard', '\(a\+\)\+b'],
+      \ ['alternatives', 'hard', '\(a\|aa\)*c=b'],
+      \ ['counted', 'hard', '\(a\{1,3}\)\{5,}b'],
+      \ ['star star', 'hard', 'a*a*a*a*b'],
+      \ ['dot star', 'hard', '.*.*.*=.*b$'],
+      \ ]
+
+" Syntax items like a syntax file for C defines them.
+func s:DefineSyntax()
+  syntax clear
+  syn keyword bType int char long unsigned size_t char_u
+  syn keyword bStatement if for while return
+  syn keyword bTodo contained TODO FIXME XXX
+  syn match bNumber "\<\d\+\>"
+  syn match bHex "\<0x\x\+\>"
+  syn match bFunc "\<\h\w*\ze\s*("
+  syn match bLineComment "//.*$" contains=bTodo
+  syn region bComment start="/\*" end="\*/" contains=bTodo
+  syn region bString start=+"+ skip=+\\\\\|\\"+ end=+"+
+  syn region bBlock start="{" end="}" transparent fold
+endfunc
+
+" Many match items, like a big syntax file has.  Most of them don't match in
+" most lines.
+func s:DefineManySyntax()
+  call s:DefineSyntax()
+  let words = ['var', 'count', 'name', 'compute_value', 'EMSG2', 'buf', 'lnum']
+  for i in range(200)
+    exe 'syn match bMany' . i . ' "\<' . words[i % len(words)] . '_' . i
+	  \ . '\>"'
+  endfor
+endfunc
+
+" Fill a new buffer with corpus "name".
+func s:Load(name)
+  enew!
+  call setline(1, s:corpus[a:name])
+endfunc
+
+" Add the result of case "name" with 'regexpengine' "re".
+func s:Report(name, re, bytes, secs, count)
+  let ns = a:bytes > 0 ? a:secs * 1.0e9 / a:bytes : 0.0
+  let key = a:name . ' re=' . a:re
+  let line = printf('%-24s %9.2f ns/byte %8d', key, ns, a:count)
+  if has_key(s:base, key) && ns > s:base[key] * s:tolerance
+    let line .= printf('  SLOWER (was %.2f)', s:base[key])
+    let s:failed = 1
+  endif
+  call add(s:result, line)
+endfunc
+
+" Return the number of matches of "pat" in the current buffer.
+func s:Count(pat)
+  let out = ''
+  redir => out
+  silent exe '%s/' . escape(a:pat, '/') . '//gne'
+  redir END
+  return str2nr(matchstr(out, '\d\+'))
+endfunc
+
+" Read the baseline: lines of "name re=N ns".
+let s:base = {}
+if filereadable('bench_regexp.base')
+  for s:l in readfile('bench_regexp.base')
+    let s:m = matchlist(s:l, '^\(.\{-}\)\s\+\([0-9.]\+\) ns/byte')
+    if !empty(s:m)
+      let s:base[s:m[1]] = str2float(s:m[2])
+    endif
+  endfor
+endif
+
+for s:case in s:cases
+  call s:Load(s:case[1])
+  let s:counts = []
+  for s:re in [1, 2]
+    let &re = s:re
+    let s:start = reltime()
+    let s:n = s:Count(s:case[2])
+    call s:Report(s:case[0], s:re, s:Bytes(), s:Elapsed(s:start), s:n)
+    call add(s:counts, s:n)
+  endfor
+  if s:counts[0] != s:counts[1]
+    call add(s:result, s:case[0] . ': engines disagree: ' . join(s:counts))
+    let s:failed = 1
+  endif
+endfor
+
+" Highlight every line of the code corpus with the syntax items.
+call s:Load('code')
+for s:re in [1, 2]
+  let &re = s:re
+  call s:DefineSyntax()
+  let s:start = reltime()
+  let s:n = 0
+  for s:lnum in range(1, line('$'))
+    let s:n += synID(s:lnum, col([s:lnum, '$']) - 1, 1) != 0
+  endfor
+  call s:Report('syntax', s:re, s:Bytes(), s:Elapsed(s:start), s:n)
+endfor
+for s:re in [1, 2]
+  let &re = s:re
+  call s:DefineManySyntax()
+  let s:start = reltime()
+  let s:n = 0
+  for s:lnum in range(1, line('$'))
+    let s:n += synID(s:lnum, col([s:lnum, '$']) - 1, 1) != 0
+  endfor
+  call s:Report('syntax many', s:re, s:Bytes(), s:Elapsed(s:start), s:n)
+endfor
+syntax clear
+set re=0
+
+call writefile(s:result, 'bench_regexp.out')
+if s:failed
+  cquit
+endif
+qa!
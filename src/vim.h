@@ -441,9 +441,10 @@ typedef unsigned long u8char_T;     /* long should be 32 bits or more */
 # define ACTION_EXPAND  5
 
 # define SST_MIN_ENTRIES 150    /* minimal size for state stack array */
-#  define SST_MAX_ENTRIES 1000  /* maximal size for state stack array */
-# define SST_FIX_STATES  7      /* size of sst_stack[]. */
+# define SST_MAX_MEM (4L * 1024 * 1024) /* maximal bytes for state stack array */
+# define SST_MAX_ENTRIES (SST_MAX_MEM / (long)sizeof(synstate_T))
 # define SST_DIST        16     /* normal distance between entries */
+# define SST_MIN_STACKS  64     /* minimal size for state stack hash table */
 # define SST_INVALID    (synstate_T *)-1        /* invalid syn_state pointer */
 
 # define HL_CONTAINED   0x01    /* not used on toplevel */
@@ -537,6 +538,11 @@ typedef unsigned long u8char_T;     /* long should be 32 bits or more */
 #define READ_BUFFER     0x08    /* read from curbuf (converting stdin) */
 #define READ_DUMMY      0x10    /* reading into a dummy buffer */
 #define READ_KEEP_UNDO  0x20    /* keep undo info*/
+#define READ_NOBG       0x40    /* don't load in the background */
+
+/* msec to wait for a key before adding lines of a file loaded in the
+ * background */
+#define BGLOAD_WAIT     5L
 
 /* Values for change_indent() */
 #define INDENT_SET      1       /* set indent */
@@ -617,6 +623,7 @@ typedef unsigned long u8char_T;     /* long should be 32 bits or more */
 #define MFS_STOP        2       /* stop syncing when a character is available */
 #define MFS_FLUSH       4       /* flushed file to disk */
 #define MFS_ZERO        8       /* only write block 0 */
+#define MFS_ASYNC       16      /* flush to disk in the background */
 
 /* flags for buf_copy_options() */
 #define BCO_ENTER       1       /* going to enter the buffer */
@@ -802,6 +809,7 @@ enum auto_event {
   EVENT_BUFFILEPOST,            /* after renaming a buffer */
   EVENT_BUFFILEPRE,             /* before renaming a buffer */
   EVENT_BUFLEAVE,               /* before leaving a buffer */
+  EVENT_BUFLOADPOST,            /* after loading a file in the background */
   EVENT_BUFNEWFILE,             /* when creating a buffer for a new file */
   EVENT_BUFREADPOST,            /* after reading a buffer */
   EVENT_BUFREADPRE,             /* before reading a buffer */
@@ -5401,7 +5401,7 @@ int match_add(win_T *wp, char_u *grp, char_u *pat, int prio, int id)
   }
 
   /* Build new match. */
-  m = (matchitem_T *)alloc(sizeof(matchitem_T));
+  m = (matchitem_T *)alloc_clear(sizeof(matchitem_T));
   m->id = id;
   m->priority = prio;
   m->pattern = vim_strsave(pat);
@@ -5456,6 +5456,7 @@ int match_delete(win_T *wp, int id, int perr)
     wp->w_match_head = cur->next;
   else
     prev->next = cur->next;
+  hlcache_clear(&cur->hlcache);
   vim_regfree(cur->match.regprog);
   vim_free(cur->pattern);
   vim_free(cur);
@@ -5472,6 +5473,7 @@ void clear_matches(win_T *wp)
 
   while (wp->w_match_head != NULL) {
     m = wp->w_match_head->next;
+    hlcache_clear(&wp->w_match_head->hlcache);
     vim_regfree(wp->w_match_head->match.regprog);
     vim_free(wp->w_match_head->pattern);
     vim_free(wp->w_match_head);